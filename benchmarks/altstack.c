@@ -0,0 +1,106 @@
+/* altstack.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_THREADS 5000
+#define SIGNAL_STACK_SIZE (256 * 1024)
+
+// Normally emitted by valac
+const char  *__vala_debug_prefix = NULL;
+const char **__vala_extra_debug_directories = NULL;
+
+// Measures what an alternate signal stack adds to the lifetime of a short-lived
+// thread: Creating and joining threads doing nothing, threads taking a stack
+// from the pool of vala_rt_enable_signal_stack and threads mapping and
+// unmapping their own guarded stack. If built with
+// -Dinterpose_pthread_create=true, every thread takes a stack from the pool
+// before anything else, so all of them include its cost.
+
+static unsigned long long
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+plain_thread (__attribute__ ((unused)) void *arg)
+{
+  return NULL;
+}
+
+static void *
+pooled_thread (__attribute__ ((unused)) void *arg)
+{
+  vala_rt_enable_signal_stack ();
+  return NULL;
+}
+
+static void *
+mapped_thread (__attribute__ ((unused)) void *arg)
+{
+  size_t   guard_size = getpagesize ();
+  size_t   size = guard_size + SIGNAL_STACK_SIZE;
+  uint8_t *slot = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slot == MAP_FAILED)
+    {
+      return NULL;
+    }
+  mprotect (slot, guard_size, PROT_NONE);
+  stack_t ss = { 0 };
+  ss.ss_sp = slot + guard_size;
+  ss.ss_size = SIGNAL_STACK_SIZE;
+  sigaltstack (&ss, NULL);
+  ss.ss_flags = SS_DISABLE;
+  sigaltstack (&ss, NULL);
+  munmap (slot, size);
+  return NULL;
+}
+
+static int
+measure (const char *name, void *(*start_routine) (void *))
+{
+  unsigned long long start = now_ns ();
+  for (int i = 0; i < N_THREADS; i++)
+    {
+      pthread_t thread;
+      if (pthread_create (&thread, NULL, start_routine, NULL))
+        {
+          return 1;
+        }
+      pthread_join (thread, NULL);
+    }
+  unsigned long long elapsed = now_ns () - start;
+  printf ("%-8s %8.0f ns/thread\n", name, (double)elapsed / N_THREADS);
+  return 0;
+}
+
+int
+main (void)
+{
+  return measure ("none", plain_thread) || measure ("pooled", pooled_thread) || measure ("mmap", mapped_thread);
+}
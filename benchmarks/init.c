@@ -0,0 +1,141 @@
+/* init.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_RUNS 200
+
+// Normally emitted by valac
+const char  *__vala_debug_prefix = NULL;
+const char **__vala_extra_debug_directories = NULL;
+
+// Measures what __vala_init costs at the startup of a program: The wall time,
+// each run in a fresh process, and the number of syscalls, counted by tracing
+// a child between two getppid calls.
+
+static unsigned long long
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int
+measure_time (void)
+{
+  unsigned long long times[N_RUNS];
+  for (int i = 0; i < N_RUNS; i++)
+    {
+      int fds[2];
+      if (pipe (fds))
+        {
+          return 1;
+        }
+      pid_t pid = fork ();
+      if (pid == 0)
+        {
+          unsigned long long start = now_ns ();
+          __vala_init ();
+          unsigned long long elapsed = now_ns () - start;
+          write (fds[1], &elapsed, sizeof (elapsed));
+          _exit (0);
+        }
+      close (fds[1]);
+      if (pid < 0 || read (fds[0], &times[i], sizeof (times[i])) != sizeof (times[i]))
+        {
+          return 1;
+        }
+      close (fds[0]);
+      waitpid (pid, NULL, 0);
+    }
+  qsort (times, N_RUNS, sizeof (times[0]), compare);
+  printf ("__vala_init: min %llu ns, median %llu ns, max %llu ns\n", times[0], times[N_RUNS / 2], times[N_RUNS - 1]);
+  return 0;
+}
+
+static int
+count_syscalls (void)
+{
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      ptrace (PTRACE_TRACEME, 0, NULL, NULL);
+      raise (SIGSTOP);
+      syscall (SYS_getppid);
+      __vala_init ();
+      syscall (SYS_getppid);
+      _exit (0);
+    }
+  int status;
+  waitpid (pid, &status, 0);
+  ptrace (PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+  int n_markers = 0;
+  int n_syscalls = 0;
+  while (n_markers < 2)
+    {
+      if (ptrace (PTRACE_SYSCALL, pid, NULL, NULL) || waitpid (pid, &status, 0) != pid || !WIFSTOPPED (status))
+        {
+          fprintf (stderr, "Lost the traced child\n");
+          return 1;
+        }
+      if (WSTOPSIG (status) != (SIGTRAP | 0x80))
+        {
+          continue;
+        }
+      struct __ptrace_syscall_info info;
+      if (ptrace (PTRACE_GET_SYSCALL_INFO, pid, sizeof (info), &info) <= 0 || info.op != PTRACE_SYSCALL_INFO_ENTRY)
+        {
+          continue;
+        }
+      if (info.entry.nr == SYS_getppid)
+        {
+          n_markers++;
+        }
+      else if (n_markers == 1)
+        {
+          n_syscalls++;
+        }
+    }
+  kill (pid, SIGKILL);
+  waitpid (pid, NULL, 0);
+  printf ("__vala_init: %d syscalls\n", n_syscalls);
+  return 0;
+}
+
+int
+main (void)
+{
+  return measure_time () || count_syscalls ();
+}
@@ -0,0 +1,86 @@
+/* unwind.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STACK_DEPTH 32
+#define MAX_FRAMES 128
+#define DURATION_NS 1000000000ULL
+
+// Normally emitted by valac
+const char  *__vala_debug_prefix = NULL;
+const char **__vala_extra_debug_directories = NULL;
+
+// Compares the frames per second vala_rt_backtrace_capture manages with
+// libunwind and with the frame pointer unwinder, at a fixed stack depth.
+
+static unsigned long long
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+measure (const char *name)
+{
+  void              *frames[MAX_FRAMES];
+  unsigned long long n_frames = 0;
+  unsigned long long n_captures = 0;
+  unsigned long long start = now_ns ();
+  unsigned long long elapsed;
+  do
+    {
+      for (int i = 0; i < 1000; i++)
+        {
+          n_frames += vala_rt_backtrace_capture (frames, MAX_FRAMES);
+        }
+      n_captures += 1000;
+      elapsed = now_ns () - start;
+    }
+  while (elapsed < DURATION_NS);
+  printf ("%-14s %6.1f frames/capture %8.1f ns/capture %12.0f frames/s\n", name, (double)n_frames / n_captures,
+          (double)elapsed / n_captures, n_frames * 1e9 / elapsed);
+}
+
+static __attribute__ ((noinline)) void
+recurse (int depth)
+{
+  if (depth)
+    {
+      recurse (depth - 1);
+      // Prevent the tail call
+      __asm__ volatile ("");
+      return;
+    }
+  vala_rt_set_unwinder (VALA_RT_UNWINDER_LIBUNWIND);
+  measure ("libunwind");
+  vala_rt_set_unwinder (VALA_RT_UNWINDER_FRAME_POINTER);
+  measure ("frame pointer");
+}
+
+int
+main (int argc, char **argv)
+{
+  recurse (argc > 1 ? atoi (argv[1]) : STACK_DEPTH);
+  return 0;
+}
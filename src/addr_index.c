@@ -0,0 +1,160 @@
+/* addr_index.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include <string.h>
+
+/*
+ * Lookup in an address index built by vala-rt-addr-index. A frame in a Vala
+ * function is resolved by two binary searches, one for the range and one for
+ * the line, without touching the symbol table or the DWARF of the module.
+ */
+
+// Returns 1 if the index can be used, every offset in the header is checked,
+// so a lookup only has to check the offsets within the ranges and lines.
+int
+__vala_rt_addr_index_valid (const uint8_t *data, size_t size)
+{
+  if (size < sizeof (struct vala_rt_addr_index_header))
+    {
+      return 0;
+    }
+  const struct vala_rt_addr_index_header *header = (const struct vala_rt_addr_index_header *)data;
+  if (memcmp (header->magic, ADDR_INDEX_MAGIC, sizeof (header->magic)) || header->version != ADDR_INDEX_VERSION)
+    {
+      return 0;
+    }
+  uint32_t n_ranges = __vala_rt_read_be32 (&header->n_ranges);
+  uint32_t ranges_offset = __vala_rt_read_be32 (&header->ranges_offset);
+  uint32_t n_lines = __vala_rt_read_be32 (&header->n_lines);
+  uint32_t lines_offset = __vala_rt_read_be32 (&header->lines_offset);
+  uint32_t strings_offset = __vala_rt_read_be32 (&header->strings_offset);
+  uint32_t strings_size = __vala_rt_read_be32 (&header->strings_size);
+  if (ranges_offset > size || (size - ranges_offset) / sizeof (struct vala_rt_addr_range) < n_ranges)
+    {
+      return 0;
+    }
+  if (lines_offset > size || (size - lines_offset) / sizeof (struct vala_rt_addr_line) < n_lines)
+    {
+      return 0;
+    }
+  // The blob has to end with a NUL, so no string can run past it.
+  return strings_offset <= size && strings_size <= size - strings_offset && strings_size
+         && !data[strings_offset + strings_size - 1];
+}
+
+static const char *
+__vala_rt_addr_index_string (const uint8_t *data, uint32_t offset)
+{
+  const struct vala_rt_addr_index_header *header = (const struct vala_rt_addr_index_header *)data;
+  if (offset >= __vala_rt_read_be32 (&header->strings_size))
+    {
+      return NULL;
+    }
+  return (const char *)&data[__vala_rt_read_be32 (&header->strings_offset) + offset];
+}
+
+static void
+__vala_rt_addr_index_find_line (const uint8_t                 *data,
+                                const uint8_t                 *range,
+                                uint32_t                       offset,
+                                struct vala_rt_resolved_frame *resolved)
+{
+  const struct vala_rt_addr_index_header *header = (const struct vala_rt_addr_index_header *)data;
+  uint32_t first_line = __vala_rt_read_be32 (range + offsetof (struct vala_rt_addr_range, first_line));
+  uint32_t n_lines = __vala_rt_read_be32 (range + offsetof (struct vala_rt_addr_range, n_lines));
+  uint32_t total_lines = __vala_rt_read_be32 (&header->n_lines);
+  if (first_line > total_lines || n_lines > total_lines - first_line)
+    {
+      return;
+    }
+  const uint8_t *lines = &data[__vala_rt_read_be32 (&header->lines_offset)
+                               + (size_t)first_line * sizeof (struct vala_rt_addr_line)];
+  // The last line starting at or before the offset
+  size_t lo = 0;
+  size_t hi = n_lines;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (__vala_rt_read_be32 (&lines[mid * sizeof (struct vala_rt_addr_line)]) <= offset)
+        {
+          lo = mid + 1;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+  if (!lo)
+    {
+      return;
+    }
+  const uint8_t *line = &lines[(lo - 1) * sizeof (struct vala_rt_addr_line)];
+  resolved->filename
+      = __vala_rt_addr_index_string (data, __vala_rt_read_be32 (line + offsetof (struct vala_rt_addr_line, filename)));
+  if (resolved->filename)
+    {
+      resolved->lineno = (int32_t)__vala_rt_read_be32 (line + offsetof (struct vala_rt_addr_line, lineno));
+    }
+}
+
+// Resolves the symbol, function, filename and line of addr (Without the load
+// bias). Returns 0 if the index has the address, the strings point into data.
+int
+__vala_rt_addr_index_lookup (const uint8_t *data, uint64_t addr, struct vala_rt_resolved_frame *resolved)
+{
+  const struct vala_rt_addr_index_header *header = (const struct vala_rt_addr_index_header *)data;
+  const uint8_t *ranges = &data[__vala_rt_read_be32 (&header->ranges_offset)];
+  size_t         lo = 0;
+  size_t         hi = __vala_rt_read_be32 (&header->n_ranges);
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (__vala_rt_read_be64 (&ranges[mid * sizeof (struct vala_rt_addr_range)]) <= addr)
+        {
+          lo = mid + 1;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+  if (!lo)
+    {
+      return -1;
+    }
+  const uint8_t *range = &ranges[(lo - 1) * sizeof (struct vala_rt_addr_range)];
+  uint64_t       offset = addr - __vala_rt_read_be64 (range);
+  if (offset >= __vala_rt_read_be32 (range + offsetof (struct vala_rt_addr_range, size)))
+    {
+      return -1;
+    }
+  const char *symbol
+      = __vala_rt_addr_index_string (data, __vala_rt_read_be32 (range + offsetof (struct vala_rt_addr_range, symbol)));
+  const char *function = __vala_rt_addr_index_string (
+      data, __vala_rt_read_be32 (range + offsetof (struct vala_rt_addr_range, function)));
+  if (!symbol || !function)
+    {
+      return -1;
+    }
+  resolved->symbol = symbol;
+  resolved->function_name = function;
+  __vala_rt_addr_index_find_line (data, range, offset, resolved);
+  return 0;
+}
@@ -0,0 +1,231 @@
+/* altstack.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include "vala_rt-config.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The crash handler symbolizes on this stack, so it is a lot larger than
+// SIGSTKSZ.
+#define SIGNAL_STACK_SIZE (256 * 1024)
+#define SIGNAL_STACK_POOL_SIZE 128
+
+/*
+ * Alternate signal stacks, so the crash handler still runs after a stack
+ * overflow. All stacks come from one PROT_NONE reservation, each one preceded
+ * by a guard page. A slot is only made accessible the first time it is handed
+ * out, so the reservation costs no memory. If a thread exits, its slot goes back
+ * to the pool, so threads after it don't need any mmap/munmap. Once the pool is
+ * exhausted, stacks are mapped one by one.
+ *
+ * Every thread has to install its stack itself. This happens for the thread
+ * calling __vala_init, for every thread calling vala_rt_enable_signal_stack and,
+ * if built with -Dinterpose_pthread_create=true, for every thread created using
+ * pthread_create (So every GThread, too).
+ */
+
+static uint8_t        *__vala_rt_stack_pool = NULL;
+static size_t          __vala_rt_stack_slot_size = 0;
+static size_t          __vala_rt_stack_guard_size = 0;
+static int             __vala_rt_stack_free[SIGNAL_STACK_POOL_SIZE];
+static int             __vala_rt_stack_n_free = 0;
+// Slots after this one were never handed out.
+static int             __vala_rt_stack_n_touched = 0;
+static pthread_mutex_t __vala_rt_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  __vala_rt_stack_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   __vala_rt_stack_key;
+static int             __vala_rt_stack_key_valid = 0;
+
+static void
+__vala_rt_release_signal_stack (void *);
+
+static void
+__vala_rt_init_stack_pool (void)
+{
+  __vala_rt_stack_guard_size = getpagesize ();
+  __vala_rt_stack_slot_size = __vala_rt_stack_guard_size + SIGNAL_STACK_SIZE;
+  __vala_rt_stack_key_valid = pthread_key_create (&__vala_rt_stack_key, __vala_rt_release_signal_stack) == 0;
+  void *pool = mmap (NULL,
+                     __vala_rt_stack_slot_size * SIGNAL_STACK_POOL_SIZE,
+                     PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1,
+                     0);
+  __vala_rt_stack_pool = pool == MAP_FAILED ? NULL : pool;
+}
+
+static int
+__vala_rt_in_stack_pool (const uint8_t *stack)
+{
+  return __vala_rt_stack_pool && stack >= __vala_rt_stack_pool
+         && stack < __vala_rt_stack_pool + __vala_rt_stack_slot_size * SIGNAL_STACK_POOL_SIZE;
+}
+
+// Returns the usable part of a stack, the guard page is right below it.
+static uint8_t *
+__vala_rt_acquire_stack (void)
+{
+  pthread_mutex_lock (&__vala_rt_stack_lock);
+  uint8_t *slot = NULL;
+  if (__vala_rt_stack_n_free)
+    {
+      slot = __vala_rt_stack_pool + __vala_rt_stack_free[--__vala_rt_stack_n_free] * __vala_rt_stack_slot_size;
+    }
+  else if (__vala_rt_stack_pool && __vala_rt_stack_n_touched < SIGNAL_STACK_POOL_SIZE)
+    {
+      slot = __vala_rt_stack_pool + __vala_rt_stack_n_touched * __vala_rt_stack_slot_size;
+      if (mprotect (slot + __vala_rt_stack_guard_size, SIGNAL_STACK_SIZE, PROT_READ | PROT_WRITE))
+        {
+          slot = NULL;
+        }
+      else
+        {
+          __vala_rt_stack_n_touched++;
+        }
+    }
+  pthread_mutex_unlock (&__vala_rt_stack_lock);
+  if (slot)
+    {
+      return slot + __vala_rt_stack_guard_size;
+    }
+  slot = mmap (NULL, __vala_rt_stack_slot_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slot == MAP_FAILED)
+    {
+      return NULL;
+    }
+  if (mprotect (slot, __vala_rt_stack_guard_size, PROT_NONE))
+    {
+      munmap (slot, __vala_rt_stack_slot_size);
+      return NULL;
+    }
+  return slot + __vala_rt_stack_guard_size;
+}
+
+static void
+__vala_rt_return_stack (uint8_t *stack)
+{
+  uint8_t *slot = stack - __vala_rt_stack_guard_size;
+  if (!__vala_rt_in_stack_pool (slot))
+    {
+      munmap (slot, __vala_rt_stack_slot_size);
+      return;
+    }
+  pthread_mutex_lock (&__vala_rt_stack_lock);
+  __vala_rt_stack_free[__vala_rt_stack_n_free++] = (slot - __vala_rt_stack_pool) / __vala_rt_stack_slot_size;
+  pthread_mutex_unlock (&__vala_rt_stack_lock);
+}
+
+// Runs when the thread exits, it won't get any signals on this stack anymore.
+static void
+__vala_rt_release_signal_stack (void *stack)
+{
+  stack_t ss = { 0 };
+  ss.ss_flags = SS_DISABLE;
+  if (sigaltstack (&ss, NULL))
+    {
+      // Still in use, so better leak it.
+      return;
+    }
+  __vala_rt_return_stack (stack);
+}
+
+int
+vala_rt_enable_signal_stack (void)
+{
+  pthread_once (&__vala_rt_stack_once, __vala_rt_init_stack_pool);
+  stack_t old;
+  if (sigaltstack (NULL, &old))
+    {
+      return -1;
+    }
+  // Installed by us or by someone else, either one is fine.
+  if (!(old.ss_flags & SS_DISABLE))
+    {
+      return 0;
+    }
+  uint8_t *stack = __vala_rt_acquire_stack ();
+  if (!stack)
+    {
+      return -1;
+    }
+  stack_t ss = { 0 };
+  ss.ss_sp = stack;
+  ss.ss_size = SIGNAL_STACK_SIZE;
+  if (sigaltstack (&ss, NULL))
+    {
+      __vala_rt_return_stack (stack);
+      return -1;
+    }
+  if (__vala_rt_stack_key_valid)
+    {
+      pthread_setspecific (__vala_rt_stack_key, stack);
+    }
+  return 0;
+}
+
+#ifdef INTERPOSE_PTHREAD_CREATE
+struct thread_start
+{
+  void *(*start_routine) (void *);
+  void *arg;
+};
+
+typedef int (*pthread_create_func) (pthread_t *, const pthread_attr_t *, void *(*) (void *), void *);
+
+static void *
+__vala_rt_thread_trampoline (void *data)
+{
+  struct thread_start start = *(struct thread_start *)data;
+  free (data);
+  vala_rt_enable_signal_stack ();
+  return start.start_routine (start.arg);
+}
+
+// Overrides pthread_create of libc for the whole process, including the threads
+// GLib creates.
+int
+pthread_create (pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine) (void *), void *arg)
+{
+  static pthread_create_func real_pthread_create = NULL;
+  pthread_create_func        real = __atomic_load_n (&real_pthread_create, __ATOMIC_ACQUIRE);
+  if (!real)
+    {
+      *(void **)&real = dlsym (RTLD_NEXT, "pthread_create");
+      __atomic_store_n (&real_pthread_create, real, __ATOMIC_RELEASE);
+    }
+  struct thread_start *start = malloc (sizeof (struct thread_start));
+  if (!start)
+    {
+      return real (thread, attr, start_routine, arg);
+    }
+  start->start_routine = start_routine;
+  start->arg = arg;
+  int ret = real (thread, attr, __vala_rt_thread_trampoline, start);
+  if (ret)
+    {
+      free (start);
+    }
+  return ret;
+}
+#endif
@@ -0,0 +1,137 @@
+/* backend_pack.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include <string.h>
+
+/*
+ * Lookup in a vala-debug.vpack, the hashed union of all .vdbg files in a
+ * directory, as written by vala-rt-vdbg-pack.
+ */
+
+static const char *
+__vala_rt_pack_search (const struct vala_rt_vpack_header *header,
+                       const uint8_t                     *data,
+                       const char                        *key,
+                       size_t                             key_len)
+{
+  uint32_t       n_buckets = __vala_rt_read_be32 (&header->n_buckets);
+  const uint8_t *buckets = data + __vala_rt_read_be32 (&header->buckets_offset);
+  const char    *strings = (const char *)data + __vala_rt_read_be32 (&header->strings_offset);
+  uint32_t       strings_size = __vala_rt_read_be32 (&header->strings_size);
+  uint32_t       mask = n_buckets - 1;
+  uint32_t       bucket = __vala_rt_hash_name (key, key_len) & mask;
+  for (uint32_t i = 0; i < n_buckets; i++)
+    {
+      const uint8_t *entry = buckets + (size_t)bucket * sizeof (struct vala_rt_name_index_entry);
+      uint32_t       c_name = __vala_rt_read_be32 (entry);
+      if (c_name == VPACK_EMPTY_BUCKET || c_name >= strings_size)
+        {
+          return NULL;
+        }
+      if (strncmp (&strings[c_name], key, key_len) == 0 && strings[c_name + key_len] == '\0')
+        {
+          uint32_t vala_name = __vala_rt_read_be32 (entry + sizeof (uint32_t));
+          return vala_name < strings_size ? &strings[vala_name] : NULL;
+        }
+      bucket = (bucket + 1) & mask;
+    }
+  return NULL;
+}
+
+// Returns the header, if data is a valid pack.
+static const struct vala_rt_vpack_header *
+__vala_rt_pack_header (const uint8_t *data, size_t size)
+{
+  if (size < sizeof (struct vala_rt_vpack_header) || memcmp (data, VPACK_MAGIC, strlen (VPACK_MAGIC)))
+    {
+      return NULL;
+    }
+  const struct vala_rt_vpack_header *header = (const struct vala_rt_vpack_header *)data;
+  if (header->version != VPACK_VERSION)
+    {
+      return NULL;
+    }
+  uint32_t n_buckets = __vala_rt_read_be32 (&header->n_buckets);
+  uint32_t buckets_offset = __vala_rt_read_be32 (&header->buckets_offset);
+  uint32_t strings_offset = __vala_rt_read_be32 (&header->strings_offset);
+  uint32_t strings_size = __vala_rt_read_be32 (&header->strings_size);
+  if (!n_buckets || (n_buckets & (n_buckets - 1)) || buckets_offset > size
+      || (size - buckets_offset) / sizeof (struct vala_rt_name_index_entry) < n_buckets || strings_offset > size
+      || size - strings_offset < strings_size || !strings_size || data[strings_offset + strings_size - 1])
+    {
+      return NULL;
+    }
+  return header;
+}
+
+// Returns a pointer into data
+const char *
+__vala_rt_pack_lookup (const uint8_t *data, size_t size, const char *function)
+{
+  const struct vala_rt_vpack_header *header = __vala_rt_pack_header (data, size);
+  if (!header)
+    {
+      return NULL;
+    }
+  // Same suffix handling as the other formats: "foo.constprop.0" matches "foo"
+  size_t len = strlen (function);
+  while (1)
+    {
+      const char *r = __vala_rt_pack_search (header, data, function, len);
+      if (r)
+        {
+          return r;
+        }
+      while (len && function[len - 1] != '.')
+        {
+          len--;
+        }
+      if (len < 2)
+        {
+          return NULL;
+        }
+      len--;
+    }
+}
+
+// Calls func for every entry, in the order of the buckets.
+void
+__vala_rt_pack_foreach (const uint8_t *data, size_t size, name_pair_func func, void *user_data)
+{
+  const struct vala_rt_vpack_header *header = __vala_rt_pack_header (data, size);
+  if (!header)
+    {
+      return;
+    }
+  uint32_t       n_buckets = __vala_rt_read_be32 (&header->n_buckets);
+  const uint8_t *buckets = data + __vala_rt_read_be32 (&header->buckets_offset);
+  const char    *strings = (const char *)data + __vala_rt_read_be32 (&header->strings_offset);
+  uint32_t       strings_size = __vala_rt_read_be32 (&header->strings_size);
+  for (uint32_t i = 0; i < n_buckets; i++)
+    {
+      const uint8_t *entry = buckets + (size_t)i * sizeof (struct vala_rt_name_index_entry);
+      uint32_t       c_name = __vala_rt_read_be32 (entry);
+      uint32_t       vala_name = __vala_rt_read_be32 (entry + sizeof (uint32_t));
+      if (c_name != VPACK_EMPTY_BUCKET && c_name < strings_size && vala_name < strings_size)
+        {
+          func (&strings[c_name], &strings[vala_name], user_data);
+        }
+    }
+}
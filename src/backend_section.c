@@ -1,168 +1,235 @@
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
 #include "vala-rt-internal.h"
 #include "vala-rt.h"
-#define _GNU_SOURCE
+#include "vala_rt-config.h"
 #include <dlfcn.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <zlib.h>
-#define MAGIC_HEADER "VALA_DEBUG_INFO1"
-#define BUF_SIZE 1024
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#define MAGIC_HEADER SECTION_MAGIC_LINEAR
 #define CURRENT_VERSION 1
-#define COMPRESSED_SECTION_BOILERPLATE_LEN 12
+#define MAX_DECOMPRESSED_SIZE (64 * 1024 * 1024)
 
 /*
- * This backend attempts to extract the debuginfos from the ELF file. It is able
- * read it from zlib-compressed sections, too.
+ * This backend attempts to extract the debuginfos from the ELF file. Compressed
+ * sections (.zdebug_info_vala or SHF_COMPRESSED with zlib/zstd) are inflated
+ * once per module by __vala_rt_section_decompress and then handled like any
+ * other section. Sections starting with the version 2 header are looked up using
+ * their index, everything else is scanned for the version 1 records.
  */
 
-static char __vala_rt_section_scratch_buffer[BUF_SIZE] = { 0 };
-
-const char *
-__vala_rt_find_function_internal_section_compressed (const char *, const void *, size_t);
-
-const char *
-__vala_rt_find_function_internal_section (const char *function_name, const void *data, size_t len, int compressed)
+static int
+__vala_rt_section_index_init (struct vala_rt_name_index *index, const uint8_t *section, size_t len)
 {
-  const uint8_t *section = data;
-  if (compressed)
+  if (len < sizeof (struct vala_rt_section2_header)
+      || memcmp (section, SECTION_MAGIC_INDEXED, strlen (SECTION_MAGIC_INDEXED)))
     {
-      return __vala_rt_find_function_internal_section_compressed (function_name, data, len);
+      return 0;
     }
-  for (size_t i = 0; i < len; i++)
+  const struct vala_rt_section2_header *header = (const struct vala_rt_section2_header *)section;
+  return __vala_rt_name_index_init (index,
+                                    section,
+                                    len,
+                                    __vala_rt_read_be32 (&header->n_entries),
+                                    __vala_rt_read_be32 (&header->index_offset),
+                                    __vala_rt_read_be32 (&header->strings_offset),
+                                    __vala_rt_read_be32 (&header->strings_size));
+}
+
+// Returns the offset of the first version 1 mapping, 0 if there is none.
+static size_t
+__vala_rt_section_linear_start (const uint8_t *section, size_t len, uint64_t *num_mappings)
+{
+  for (size_t i = 0; i + strlen (MAGIC_HEADER) < len; i++)
     {
-      if (i + strlen (MAGIC_HEADER) < len && memcmp (&section[i], MAGIC_HEADER, strlen (MAGIC_HEADER)) == 0)
+      if (memcmp (&section[i], MAGIC_HEADER, strlen (MAGIC_HEADER)) == 0)
         {
-          uint64_t num_mappings = 0;
           size_t   offset = i + strlen (MAGIC_HEADER);
           uint64_t version = 0;
+          if (len - offset < sizeof (version) + sizeof (*num_mappings))
+            {
+              return 0;
+            }
           memcpy (&version, &section[offset], sizeof (version));
           offset += sizeof (version);
           if (version != CURRENT_VERSION)
             {
-              goto end;
-            }
-          memcpy (&num_mappings, &section[offset], sizeof (num_mappings));
-          num_mappings = __builtin_bswap64 (num_mappings);
-          offset += sizeof (num_mappings);
-          for (uint64_t j = 0; j < num_mappings; j++)
-            {
-              if (offset == len)
-                {
-                  goto end;
-                }
-              uint8_t len_c_name = section[offset];
-              offset++;
-              if (offset == len || offset + len_c_name >= len)
-                {
-                  goto end;
-                }
-              if (strcmp ((const char *)&section[offset], function_name) == 0)
-                {
-                  offset += len_c_name + 2;
-                  // Skip length of variable
-                  offset++;
-                  return (const char *)&section[offset];
-                }
-              offset += len_c_name + 2;
-              uint8_t len_mangled_name = section[offset];
-              offset += len_mangled_name + 2;
-              offset++;
+              return 0;
             }
+          memcpy (num_mappings, &section[offset], sizeof (*num_mappings));
+          *num_mappings = __builtin_bswap64 (*num_mappings);
+          offset += sizeof (*num_mappings);
+          return offset;
         }
     }
-end:
-  return NULL;
+  return 0;
 }
 
-static int
-__vala_rt_z_read (z_stream *strm, void *ptr, size_t len)
+// Walks the version 1 mappings. Returns the Vala name of the first function_len
+// bytes of function_name, or, if it is NULL, calls func for every mapping.
+static const char *
+__vala_rt_section_linear_walk (const uint8_t *section,
+                               size_t         len,
+                               const char    *function_name,
+                               size_t         function_len,
+                               name_pair_func func,
+                               void          *user_data)
 {
-  strm->avail_out = len;
-  strm->next_out = ptr;
-  return inflate (strm, Z_NO_FLUSH);
+  uint64_t num_mappings = 0;
+  size_t   offset = __vala_rt_section_linear_start (section, len, &num_mappings);
+  for (uint64_t j = 0; offset && j < num_mappings; j++)
+    {
+      if (offset == len)
+        {
+          return NULL;
+        }
+      uint8_t len_c_name = section[offset];
+      offset++;
+      if (offset == len || offset + len_c_name >= len || section[offset + len_c_name])
+        {
+          return NULL;
+        }
+      const char *c_name = (const char *)&section[offset];
+      offset += len_c_name + 2;
+      if (offset >= len)
+        {
+          return NULL;
+        }
+      uint8_t len_mangled_name = section[offset];
+      // Skip length of variable
+      const char *vala_name = (const char *)&section[offset + 1];
+      if (len - offset <= (size_t)len_mangled_name + 1 || section[offset + 1 + len_mangled_name])
+        {
+          return NULL;
+        }
+      if (!function_name)
+        {
+          func (c_name, vala_name, user_data);
+        }
+      else if (len_c_name == function_len && memcmp (c_name, function_name, function_len) == 0)
+        {
+          return vala_name;
+        }
+      offset += len_mangled_name + 2;
+      offset++;
+    }
+  return NULL;
 }
 
-const char *
-__vala_rt_find_function_internal_section_compressed (const char *function_name, const void *data, size_t len)
+// Like the indexed format, "foo.constprop.0" or "foo.isra.0" will match "foo",
+// if there is no entry for the full name.
+static const char *
+__vala_rt_section_linear_find (const uint8_t *section, size_t len, const char *function_name)
 {
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = Z_NULL;
-  int ret = inflateInit (&strm);
-  if (ret != Z_OK)
-    {
-      return NULL;
-    }
-  strm.avail_in = len - COMPRESSED_SECTION_BOILERPLATE_LEN;
-  strm.next_in = (Bytef *)data + COMPRESSED_SECTION_BOILERPLATE_LEN;
-  char magic[strlen (MAGIC_HEADER) + 1];
-  magic[strlen (MAGIC_HEADER)] = 0;
-  int status = __vala_rt_z_read (&strm, magic, strlen (MAGIC_HEADER));
-  if (status != Z_OK)
+  size_t function_len = strlen (function_name);
+  while (1)
     {
-      goto end;
-    }
-  if (memcmp (magic, MAGIC_HEADER, strlen (MAGIC_HEADER)))
-    {
-      goto end;
+      const char *r = __vala_rt_section_linear_walk (section, len, function_name, function_len, NULL, NULL);
+      if (r)
+        {
+          return r;
+        }
+      while (function_len && function_name[function_len - 1] != '.')
+        {
+          function_len--;
+        }
+      if (function_len < 2)
+        {
+          return NULL;
+        }
+      function_len--;
     }
-  uint64_t version = 0;
-  status = __vala_rt_z_read (&strm, &version, sizeof (version));
-  if (status != Z_OK)
+}
+
+const char *
+__vala_rt_find_function_internal_section (const char *function_name, const void *data, size_t len)
+{
+  struct vala_rt_name_index index;
+  if (__vala_rt_section_index_init (&index, data, len))
     {
-      goto end;
+      return __vala_rt_name_index_find (&index, function_name);
     }
-  if (version != CURRENT_VERSION)
+  return __vala_rt_section_linear_find (data, len, function_name);
+}
+
+// Calls func for every mapping of a section of any version.
+void
+__vala_rt_section_foreach (const void *data, size_t len, name_pair_func func, void *user_data)
+{
+  struct vala_rt_name_index index;
+  if (__vala_rt_section_index_init (&index, data, len))
     {
-      goto end;
+      __vala_rt_name_index_foreach (&index, func, user_data);
+      return;
     }
-  uint64_t n_mappings = 0;
-  status = __vala_rt_z_read (&strm, &n_mappings, sizeof (n_mappings));
-  if (status != Z_OK)
+  __vala_rt_section_linear_walk (data, len, NULL, 0, func, user_data);
+}
+
+void
+__vala_rt_section_arena_reset (struct vala_rt_section_arena *arena)
+{
+  arena->used = 0;
+}
+
+// Decompresses the payload of a section into the arena of the session. The
+// arena is reserved at the first use and reused by the next session, so each
+// module is inflated only once and no session can use more than
+// MAX_DECOMPRESSED_SIZE.
+const void *
+__vala_rt_section_decompress (struct vala_rt_section_arena *arena,
+                              int                           compression,
+                              const void                   *payload,
+                              size_t                        payload_len,
+                              size_t                        uncompressed_len)
+{
+  // Keep the next section aligned, the indexed formats are read with 32 bit loads.
+  size_t reserved = (uncompressed_len + 15) & ~(size_t)15;
+  if (!uncompressed_len || reserved > MAX_DECOMPRESSED_SIZE - arena->used)
     {
-      goto end;
+      return NULL;
     }
-  for (uint64_t i = 0; i < n_mappings; i++)
+  if (!arena->data)
     {
-      uint8_t cname_len = 0;
-      status = __vala_rt_z_read (&strm, &cname_len, sizeof (cname_len));
-      if (status != Z_OK)
-        {
-          goto end;
-        }
-      char cname[cname_len + 3];
-      memset (cname, 0, cname_len + 3);
-      status = __vala_rt_z_read (&strm, cname, cname_len + 2);
-      if (status != Z_OK)
-        {
-          goto end;
-        }
-      uint8_t fname_len = 0;
-      status = __vala_rt_z_read (&strm, &fname_len, sizeof (fname_len));
-      if (status != Z_OK)
+      void *data = mmap (
+          NULL, MAX_DECOMPRESSED_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (data == MAP_FAILED)
         {
-          goto end;
-        }
-      char fname[fname_len + 3];
-      memset (fname, 0, fname_len + 3);
-      status = __vala_rt_z_read (&strm, fname, fname_len + 2);
-      if (strcmp (cname, function_name) == 0)
-        {
-          memset (__vala_rt_section_scratch_buffer, 0, BUF_SIZE);
-          memcpy (__vala_rt_section_scratch_buffer, fname, strlen (fname));
-          inflateEnd (&strm);
-          return __vala_rt_section_scratch_buffer;
-        }
-      if (status != Z_OK)
-        {
-          goto end;
+          return NULL;
         }
+      arena->data = data;
     }
-end:
-  inflateEnd (&strm);
-  return NULL;
+  uint8_t *into = &arena->data[arena->used];
+  switch (compression)
+    {
+    case VALA_RT_SECTION_ZLIB:
+      {
+        uLongf dest_len = uncompressed_len;
+        if (uncompress (into, &dest_len, payload, payload_len) != Z_OK || dest_len != uncompressed_len)
+          {
+            return NULL;
+          }
+        break;
+      }
+#ifdef HAVE_ZSTD
+    case VALA_RT_SECTION_ZSTD:
+      {
+        size_t ret = ZSTD_decompress (into, uncompressed_len, payload, payload_len);
+        if (ZSTD_isError (ret) || ret != uncompressed_len)
+          {
+            return NULL;
+          }
+        break;
+      }
+#endif
+    default:
+      return NULL;
+    }
+  arena->used += reserved;
+  return into;
 }
@@ -1,44 +1,53 @@
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
 #include "vala-rt-internal.h"
 #include "vala-rt.h"
-#define _GNU_SOURCE
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 #define BUF_SIZE 1024
 #define VALA_DEBUG_PATH "/share/vala/debug/"
 #define LOCAL_VALA_DEBUG_PATH "/local/share/vala/debug/"
-#define DBG_MAGIC "VDBG"
-#define CURRENT_VERSION 1
+#define BUILD_ID_DIR ".build-id/"
+#define DBG_MAGIC VDBG_MAGIC
 
 /*
  * This backend attempts to extract the debuginfos from the filesystem using the paths
  * from the __vala_extra_debug_directories and __vala_debug_prefix.
+ *
+ * If a .vdbg is installed as .build-id/xx/yyyy.vdbg in one of these directories,
+ * it is the only file consulted for the module with that build-id. Otherwise every
+ * directory is searched, using its vala-debug.vpack if it is up to date and
+ * scanning every .vdbg in it if not. An address index can be installed the same
+ * way, as .build-id/xx/yyyy.vaddr.
  */
 
-struct linux_dirent
-{
-  unsigned long  d_ino;
-  unsigned long  d_off;
-  unsigned short d_reclen;
-  char           d_name[];
-};
-
-static char __vala_rt_scratch_buffer[BUF_SIZE] = { 0 };
-
 const char *
-__vala_rt_load_from_rt (const char *, const char *, const char *);
+__vala_rt_load_from_rt (const char *, const char *, const char *, char *, size_t);
 const char *
-__vala_rt_load_from_file (const char *, const char *);
+__vala_rt_load_from_file (const char *, const char *, char *, size_t);
 const char *
-__vala_rt_scan_directory (const char *, const char *);
+__vala_rt_scan_directory (const char *, const char *, char *, size_t);
+
+// The name is copied into buffer, as the file it was found in is unmapped
+// again, so this can be used from several threads at once.
+static const char *
+__vala_rt_copy_name (const char *name, char *buffer, size_t len)
+{
+  memset (buffer, 0, len);
+  strncpy (buffer, name, len - 1);
+  return buffer;
+}
 
 const char *
-__vala_rt_find_function_internal_file (const char *function)
+__vala_rt_find_function_internal_file (const char *function, char *buffer, size_t len)
 {
   errno = 0;
   if (__vala_debug_prefix)
@@ -47,7 +56,7 @@ __vala_rt_find_function_internal_file (const char *function)
       char path[BUF_SIZE] = { 0 };
       strcat (path, __vala_debug_prefix);
       strcat (path, VALA_DEBUG_PATH);
-      const char *r = __vala_rt_scan_directory (path, function);
+      const char *r = __vala_rt_scan_directory (path, function, buffer, len);
       if (r)
         {
           return r;
@@ -55,7 +64,7 @@ __vala_rt_find_function_internal_file (const char *function)
       memset (path, 0, BUF_SIZE);
       strcat (path, __vala_debug_prefix);
       strcat (path, LOCAL_VALA_DEBUG_PATH);
-      r = __vala_rt_scan_directory (path, function);
+      r = __vala_rt_scan_directory (path, function, buffer, len);
       if (r)
         {
           return r;
@@ -65,7 +74,7 @@ __vala_rt_find_function_internal_file (const char *function)
     {
       for (size_t i = 0; __vala_extra_debug_directories[i]; i++)
         {
-          const char *demangled = __vala_rt_scan_directory (__vala_extra_debug_directories[i], function);
+          const char *demangled = __vala_rt_scan_directory (__vala_extra_debug_directories[i], function, buffer, len);
           if (demangled)
             {
               return demangled;
@@ -75,14 +84,161 @@ __vala_rt_find_function_internal_file (const char *function)
   return NULL;
 }
 
+static int
+__vala_rt_map_file (const char *file, const uint8_t **data, size_t *size)
+{
+  int fd = open (file, O_RDONLY);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  struct stat st;
+  if (fstat (fd, &st) || st.st_size <= 0)
+    {
+      close (fd);
+      return -1;
+    }
+  void *ptr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (ptr == MAP_FAILED)
+    {
+      return -1;
+    }
+  *data = ptr;
+  *size = st.st_size;
+  return 0;
+}
+
+static int
+__vala_rt_map_from_build_id_dir (const char     *prefix,
+                                 const char     *dir,
+                                 const char     *id_path,
+                                 const char     *extension,
+                                 const uint8_t **data,
+                                 size_t         *size)
+{
+  char path[BUF_SIZE] = { 0 };
+  if (strlen (prefix) + strlen (dir) + strlen (BUILD_ID_DIR) + strlen (id_path) + strlen (extension) >= BUF_SIZE)
+    {
+      return -1;
+    }
+  strcat (path, prefix);
+  strcat (path, dir);
+  strcat (path, BUILD_ID_DIR);
+  strcat (path, id_path);
+  strcat (path, extension);
+  return __vala_rt_map_file (path, data, size);
+}
+
+// Maps the file with the given extension (.vdbg or .vaddr) belonging to the
+// module with this build-id. It has to be unmapped by the caller.
+int
+__vala_rt_map_by_build_id (const unsigned char *id,
+                           int                  len,
+                           const char          *extension,
+                           const uint8_t      **data,
+                           size_t              *size)
+{
+  char id_path[MAX_BUILD_ID_LEN * 2 + 2];
+  __vala_rt_format_build_id (id_path, id, len);
+  if (__vala_debug_prefix)
+    {
+      if (__vala_rt_map_from_build_id_dir (__vala_debug_prefix, VALA_DEBUG_PATH, id_path, extension, data, size) == 0
+          || __vala_rt_map_from_build_id_dir (
+                 __vala_debug_prefix, LOCAL_VALA_DEBUG_PATH, id_path, extension, data, size)
+                 == 0)
+        {
+          return 0;
+        }
+    }
+  if (__vala_extra_debug_directories)
+    {
+      for (size_t i = 0; __vala_extra_debug_directories[i]; i++)
+        {
+          if (__vala_rt_map_from_build_id_dir (__vala_extra_debug_directories[i], "/", id_path, extension, data, size)
+              == 0)
+            {
+              return 0;
+            }
+        }
+    }
+  return -1;
+}
+
+static int
+__vala_rt_timespec_before (const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Maps the pack of the directory, if it is up to date.
+static int
+__vala_rt_map_pack (int dir_fd, const uint8_t **data, size_t *size)
+{
+  struct stat dir_st;
+  if (fstat (dir_fd, &dir_st))
+    {
+      return -1;
+    }
+  int fd = openat (dir_fd, VPACK_FILENAME, O_RDONLY);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  struct stat st;
+  // Anything added to or removed from the directory after the pack was
+  // built makes it stale.
+  if (fstat (fd, &st) || st.st_size <= 0 || __vala_rt_timespec_before (&st.st_mtim, &dir_st.st_mtim))
+    {
+      close (fd);
+      return -1;
+    }
+  void *ptr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (ptr == MAP_FAILED)
+    {
+      return -1;
+    }
+  *data = ptr;
+  *size = st.st_size;
+  return 0;
+}
+
+// Returns 1 if the directory has an up-to-date pack. In that case the pack
+// is authoritative and *result is the answer.
+static int
+__vala_rt_lookup_in_pack (int dir_fd, const char *function, const char **result, char *buffer, size_t len)
+{
+  const uint8_t *data = NULL;
+  size_t         size = 0;
+  if (__vala_rt_map_pack (dir_fd, &data, &size))
+    {
+      return 0;
+    }
+  *result = NULL;
+  const char *function_name = __vala_rt_pack_lookup (data, size, function);
+  if (function_name)
+    {
+      *result = __vala_rt_copy_name (function_name, buffer, len);
+    }
+  munmap ((void *)data, size);
+  return 1;
+}
+
 const char *
-__vala_rt_scan_directory (const char *path, const char *function)
+__vala_rt_scan_directory (const char *path, const char *function, char *buffer, size_t buffer_len)
 {
   int fd = open (path, O_RDONLY | O_DIRECTORY);
   if (fd == -1)
     {
       return NULL;
     }
+  const char *from_pack = NULL;
+  if (__vala_rt_lookup_in_pack (fd, function, &from_pack, buffer, buffer_len))
+    {
+      close (fd);
+      return from_pack;
+    }
   while (1)
     {
       char buf[BUF_SIZE];
@@ -100,7 +256,7 @@ __vala_rt_scan_directory (const char *path, const char *function)
           if (d_type == DT_REG && len >= extension_len
               && memcmp (&d->d_name[len - extension_len], ".vdbg", extension_len) == 0)
             {
-              const char *demangled = __vala_rt_load_from_rt (path, d->d_name, function);
+              const char *demangled = __vala_rt_load_from_rt (path, d->d_name, function, buffer, buffer_len);
               if (demangled)
                 {
                   close (fd);
@@ -115,109 +271,240 @@ __vala_rt_scan_directory (const char *path, const char *function)
 }
 
 const char *
-__vala_rt_load_from_rt (const char *prefix, const char *file, const char *function)
+__vala_rt_load_from_rt (const char *prefix, const char *file, const char *function, char *buffer, size_t len)
 {
   char full_filename[strlen (file) + strlen (prefix) + 2];
   memset (full_filename, 0, sizeof (full_filename));
   memcpy (full_filename, prefix, strlen (prefix));
   full_filename[strlen (prefix)] = '/';
   memcpy (&full_filename[strlen (prefix) + 1], file, strlen (file));
-  return __vala_rt_load_from_file (full_filename, function);
+  return __vala_rt_load_from_file (full_filename, function, buffer, len);
 }
 
-const char *
-__vala_rt_load_from_file (const char *file, const char *function)
+// Maps the names of a directory for the demangling index: its pack if it is up
+// to date, else every .vdbg in it. found owns the mappings.
+static void
+__vala_rt_map_directory (const char *path, mapped_names_func found, void *user_data)
 {
-  int fd = open (file, O_RDONLY);
-  if (fd <= 0)
-    {
-      perror ("open");
-      return NULL;
-    }
-  char   magic[strlen (DBG_MAGIC)];
-  size_t nread = read (fd, magic, sizeof (magic));
-  if (nread != sizeof (magic))
-    {
-      goto end;
-    }
-  if (memcmp (magic, DBG_MAGIC, strlen (DBG_MAGIC)))
-    {
-      goto end;
-    }
-  uint8_t version;
-  nread = read (fd, &version, sizeof (version));
-  if (nread != sizeof (version))
-    {
-      goto end;
-    }
-  if (version != CURRENT_VERSION)
+  int fd = open (path, O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
     {
-      goto end;
+      return;
     }
-  uint32_t n_functions;
-  nread = read (fd, &n_functions, sizeof (n_functions));
-  n_functions = __bswap_constant_32 (n_functions);
-  if (nread != sizeof (n_functions))
+  const uint8_t *data = NULL;
+  size_t         size = 0;
+  if (__vala_rt_map_pack (fd, &data, &size) == 0)
     {
-      goto end;
+      found (1, data, size, user_data);
+      close (fd);
+      return;
     }
-  for (uint32_t i = 0; i < n_functions; i++)
+  while (1)
     {
-      uint16_t len = 0;
-      nread = read (fd, &len, sizeof (len));
-      len = __bswap_constant_16 (len);
-      if (nread != sizeof (len))
+      char buf[BUF_SIZE];
+      int  nread = syscall (SYS_getdents, fd, buf, BUF_SIZE);
+      if (nread <= 0)
         {
-          goto end;
+          break;
         }
-      char c_name[len + 1];
-      memset (c_name, 0, len + 1);
-      nread = read (fd, c_name, len + 1);
-      if (nread != (size_t)len + 1)
+      for (long bpos = 0; bpos < nread;)
         {
-          goto end;
+          struct linux_dirent *d = (struct linux_dirent *)(buf + bpos);
+          char                 d_type = *(buf + bpos + d->d_reclen - 1);
+          size_t               len = strlen (d->d_name);
+          size_t               extension_len = strlen (".vdbg");
+          char                 file[BUF_SIZE];
+          if (d_type == DT_REG && len >= extension_len
+              && memcmp (&d->d_name[len - extension_len], ".vdbg", extension_len) == 0
+              && snprintf (file, sizeof (file), "%s/%s", path, d->d_name) < (int)sizeof (file)
+              && __vala_rt_map_file (file, &data, &size) == 0)
+            {
+              found (0, data, size, user_data);
+            }
+          bpos += d->d_reclen;
         }
-      if (c_name[len])
+    }
+  close (fd);
+}
+
+// Calls found for the names of every directory searched by
+// __vala_rt_find_function_internal_file, in the same order.
+void
+__vala_rt_map_search_directories (mapped_names_func found, void *user_data)
+{
+  if (__vala_debug_prefix)
+    {
+      char path[BUF_SIZE];
+      if (snprintf (path, sizeof (path), "%s%s", __vala_debug_prefix, VALA_DEBUG_PATH) < (int)sizeof (path))
         {
-          goto end;
+          __vala_rt_map_directory (path, found, user_data);
         }
-      len = 0;
-      nread = read (fd, &len, sizeof (len));
-      len = __bswap_constant_16 (len);
-      if (nread != sizeof (len))
+      if (snprintf (path, sizeof (path), "%s%s", __vala_debug_prefix, LOCAL_VALA_DEBUG_PATH) < (int)sizeof (path))
         {
-          goto end;
+          __vala_rt_map_directory (path, found, user_data);
         }
-      char function_name[len + 1];
-      memset (function_name, 0, len + 1);
-      nread = read (fd, function_name, len + 1);
-      int matches = strcmp (function, c_name) == 0;
-      if (matches)
+    }
+  if (__vala_extra_debug_directories)
+    {
+      for (size_t i = 0; __vala_extra_debug_directories[i]; i++)
         {
-          memset (__vala_rt_scratch_buffer, 0, BUF_SIZE);
-          memcpy (__vala_rt_scratch_buffer, function_name, len);
-          close (fd);
-          return __vala_rt_scratch_buffer;
+          __vala_rt_map_directory (__vala_extra_debug_directories[i], found, user_data);
         }
-      size_t f_len = strlen (function);
-      if (strlen (c_name) < f_len && memcmp (c_name, function, strlen (c_name)) == 0
-          && function[strlen (c_name)] == '.')
+    }
+}
+
+// Reads a u16be length and the NUL-terminated string after it. Returns NULL if
+// it doesn't fit.
+static const char *
+__vala_rt_vdbg_read_string (const uint8_t *data, size_t size, size_t *offset, uint16_t *len)
+{
+  if (size - *offset < sizeof (uint16_t))
+    {
+      return NULL;
+    }
+  *len = __vala_rt_read_be16 (&data[*offset]);
+  *offset += sizeof (uint16_t);
+  if (size - *offset < (size_t)*len + 1 || data[*offset + *len])
+    {
+      return NULL;
+    }
+  const char *ret = (const char *)&data[*offset];
+  *offset += *len + 1;
+  return ret;
+}
+
+// Returns the number of functions of a version 1 file.
+static uint32_t
+__vala_rt_vdbg_linear_start (const uint8_t *data, size_t size, size_t *offset)
+{
+  *offset = strlen (DBG_MAGIC) + 1;
+  if (size < *offset + sizeof (uint32_t))
+    {
+      return 0;
+    }
+  uint32_t n_functions = __vala_rt_read_be32 (&data[*offset]);
+  *offset += sizeof (uint32_t);
+  return n_functions;
+}
+
+static const char *
+__vala_rt_vdbg_lookup_linear (const uint8_t *data, size_t size, const char *function)
+{
+  size_t   offset;
+  uint32_t n_functions = __vala_rt_vdbg_linear_start (data, size, &offset);
+  size_t   f_len = strlen (function);
+  for (uint32_t i = 0; i < n_functions; i++)
+    {
+      uint16_t    len;
+      uint16_t    function_len;
+      const char *c_name = __vala_rt_vdbg_read_string (data, size, &offset, &len);
+      const char *function_name = c_name ? __vala_rt_vdbg_read_string (data, size, &offset, &function_len) : NULL;
+      if (!function_name)
         {
-          memset (__vala_rt_scratch_buffer, 0, BUF_SIZE);
-          memcpy (__vala_rt_scratch_buffer, function_name, len);
-          close (fd);
-          return __vala_rt_scratch_buffer;
+          return NULL;
         }
-      if (nread != (size_t)len + 1)
+      if (strcmp (function, c_name) == 0)
         {
-          goto end;
+          return function_name;
         }
-      if (function_name[len])
+      if (len < f_len && memcmp (c_name, function, len) == 0 && function[len] == '.')
         {
-          goto end;
+          return function_name;
         }
     }
-end:
-  close (fd);
   return NULL;
 }
+
+static int
+__vala_rt_vdbg_index_init (struct vala_rt_name_index *index, const uint8_t *data, size_t size)
+{
+  if (size < sizeof (struct vala_rt_vdbg2_header))
+    {
+      return 0;
+    }
+  const struct vala_rt_vdbg2_header *header = (const struct vala_rt_vdbg2_header *)data;
+  return __vala_rt_name_index_init (index,
+                                    data,
+                                    size,
+                                    __vala_rt_read_be32 (&header->n_entries),
+                                    __vala_rt_read_be32 (&header->index_offset),
+                                    __vala_rt_read_be32 (&header->strings_offset),
+                                    __vala_rt_read_be32 (&header->strings_size));
+}
+
+static const char *
+__vala_rt_vdbg_lookup_indexed (const uint8_t *data, size_t size, const char *function)
+{
+  struct vala_rt_name_index index;
+  return __vala_rt_vdbg_index_init (&index, data, size) ? __vala_rt_name_index_find (&index, function) : NULL;
+}
+
+// Returns a pointer into data
+const char *
+__vala_rt_vdbg_lookup (const uint8_t *data, size_t size, const char *function)
+{
+  if (size <= strlen (DBG_MAGIC) || memcmp (data, DBG_MAGIC, strlen (DBG_MAGIC)))
+    {
+      return NULL;
+    }
+  switch (data[strlen (DBG_MAGIC)])
+    {
+    case VDBG_VERSION_LINEAR:
+      return __vala_rt_vdbg_lookup_linear (data, size, function);
+    case VDBG_VERSION_INDEXED:
+      return __vala_rt_vdbg_lookup_indexed (data, size, function);
+    default:
+      return NULL;
+    }
+}
+
+// Calls func for every entry of a .vdbg file of any version.
+void
+__vala_rt_vdbg_foreach (const uint8_t *data, size_t size, name_pair_func func, void *user_data)
+{
+  if (size <= strlen (DBG_MAGIC) || memcmp (data, DBG_MAGIC, strlen (DBG_MAGIC)))
+    {
+      return;
+    }
+  struct vala_rt_name_index index;
+  if (data[strlen (DBG_MAGIC)] == VDBG_VERSION_INDEXED && __vala_rt_vdbg_index_init (&index, data, size))
+    {
+      __vala_rt_name_index_foreach (&index, func, user_data);
+    }
+  else if (data[strlen (DBG_MAGIC)] == VDBG_VERSION_LINEAR)
+    {
+      size_t   offset;
+      uint32_t n_functions = __vala_rt_vdbg_linear_start (data, size, &offset);
+      for (uint32_t i = 0; i < n_functions; i++)
+        {
+          uint16_t    len;
+          const char *c_name = __vala_rt_vdbg_read_string (data, size, &offset, &len);
+          const char *function_name = c_name ? __vala_rt_vdbg_read_string (data, size, &offset, &len) : NULL;
+          if (!function_name)
+            {
+              return;
+            }
+          func (c_name, function_name, user_data);
+        }
+    }
+}
+
+const char *
+__vala_rt_load_from_file (const char *file, const char *function, char *buffer, size_t len)
+{
+  const uint8_t *data = NULL;
+  size_t         size = 0;
+  if (__vala_rt_map_file (file, &data, &size))
+    {
+      perror ("open");
+      return NULL;
+    }
+  const char *ret = NULL;
+  const char *function_name = __vala_rt_vdbg_lookup (data, size, function);
+  if (function_name)
+    {
+      ret = __vala_rt_copy_name (function_name, buffer, len);
+    }
+  munmap ((void *)data, size);
+  return ret;
+}
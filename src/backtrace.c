@@ -0,0 +1,298 @@
+/* backtrace.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CACHE_SIZE 1024
+#define INITIAL_STRINGS_SIZE 256
+
+/*
+ * Capturing only records the return addresses, so it can be used on hot paths.
+ * Symbolizing uses a session of its own, which is kept alive for the lifetime
+ * of the process and never touched by the crash handler, so a crash while
+ * another thread symbolizes still gets a fresh session with every module
+ * loaded at that time. Every resolved address is cached, with all strings
+ * interned, so after the first lookup symbolizing an address is a hash table
+ * lookup under a read lock.
+ */
+
+struct ip_cache_entry
+{
+  uintptr_t            ip;
+  struct vala_rt_frame frame;
+};
+
+static pthread_once_t         __vala_rt_capture_once = PTHREAD_ONCE_INIT;
+static pthread_rwlock_t       __vala_rt_ip_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct ip_cache_entry *__vala_rt_ip_cache = NULL;
+static size_t                 __vala_rt_ip_cache_size = 0;
+static size_t                 __vala_rt_ip_cache_used = 0;
+// Only used with the write lock held
+static struct vala_rt_session __vala_rt_api_session = VALA_RT_SESSION_INIT;
+// Protected by the write lock, like the session
+static char                 **__vala_rt_strings = NULL;
+static size_t                 __vala_rt_strings_size = 0;
+static size_t                 __vala_rt_strings_used = 0;
+
+static void
+__vala_rt_init_capture (void)
+{
+  unw_set_caching_policy (unw_local_addr_space, UNW_CACHE_PER_THREAD);
+}
+
+int
+vala_rt_backtrace_capture (void **buffer, int size)
+{
+  if (size <= 0)
+    {
+      return 0;
+    }
+  if (__vala_rt_use_frame_pointers)
+    {
+      __vala_rt_init_stack_bounds ();
+      // Starting at this frame, so its return address is the first one
+      uintptr_t fp = (uintptr_t)__builtin_frame_address (0);
+      int       n = __vala_rt_unwind_fp (fp, fp, (uintptr_t *)buffer, size);
+      // Only worth a retry if a module was loaded since the last refresh
+      if (n < 0 && __vala_rt_refresh_executable_ranges_throttled ())
+        {
+          n = __vala_rt_unwind_fp (fp, fp, (uintptr_t *)buffer, size);
+        }
+      if (n >= 0)
+        {
+          return n;
+        }
+    }
+  pthread_once (&__vala_rt_capture_once, __vala_rt_init_capture);
+  // Straight into the buffer, so there is no limit on the depth
+  int n = unw_backtrace (buffer, size);
+  if (n <= 1)
+    {
+      return 0;
+    }
+  // Skip this function
+  memmove (buffer, &buffer[1], (n - 1) * sizeof (void *));
+  return n - 1;
+}
+
+static size_t
+__vala_rt_hash_ip (uintptr_t ip)
+{
+  uint64_t h = ip;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Must be called with the read or write lock held.
+static const struct ip_cache_entry *
+__vala_rt_ip_cache_find (uintptr_t ip)
+{
+  if (!__vala_rt_ip_cache_size)
+    {
+      return NULL;
+    }
+  size_t mask = __vala_rt_ip_cache_size - 1;
+  for (size_t i = __vala_rt_hash_ip (ip) & mask;; i = (i + 1) & mask)
+    {
+      if (__vala_rt_ip_cache[i].ip == ip)
+        {
+          return &__vala_rt_ip_cache[i];
+        }
+      if (!__vala_rt_ip_cache[i].ip)
+        {
+          return NULL;
+        }
+    }
+}
+
+static void
+__vala_rt_ip_cache_put (struct ip_cache_entry *table, size_t size, const struct ip_cache_entry *entry)
+{
+  size_t mask = size - 1;
+  size_t i = __vala_rt_hash_ip (entry->ip) & mask;
+  while (table[i].ip)
+    {
+      i = (i + 1) & mask;
+    }
+  table[i] = *entry;
+}
+
+// Must be called with the write lock held.
+static int
+__vala_rt_ip_cache_insert (const struct ip_cache_entry *entry)
+{
+  if ((__vala_rt_ip_cache_used + 1) * 2 > __vala_rt_ip_cache_size)
+    {
+      size_t                 new_size = __vala_rt_ip_cache_size ? __vala_rt_ip_cache_size * 2 : INITIAL_CACHE_SIZE;
+      struct ip_cache_entry *new_cache = calloc (new_size, sizeof (struct ip_cache_entry));
+      if (!new_cache)
+        {
+          return -1;
+        }
+      for (size_t i = 0; i < __vala_rt_ip_cache_size; i++)
+        {
+          if (__vala_rt_ip_cache[i].ip)
+            {
+              __vala_rt_ip_cache_put (new_cache, new_size, &__vala_rt_ip_cache[i]);
+            }
+        }
+      free (__vala_rt_ip_cache);
+      __vala_rt_ip_cache = new_cache;
+      __vala_rt_ip_cache_size = new_size;
+    }
+  __vala_rt_ip_cache_put (__vala_rt_ip_cache, __vala_rt_ip_cache_size, entry);
+  __vala_rt_ip_cache_used++;
+  return 0;
+}
+
+static size_t
+__vala_rt_hash_string (const char *str)
+{
+  return __vala_rt_hash_ip (__vala_rt_hash_name (str, strlen (str)));
+}
+
+// Copies str, returning the same copy for equal strings, as the names of
+// libraries and source files repeat a lot. Must be called with the write
+// lock held.
+static const char *
+__vala_rt_intern (const char *str)
+{
+  if (!str)
+    {
+      return NULL;
+    }
+  if ((__vala_rt_strings_used + 1) * 2 > __vala_rt_strings_size)
+    {
+      size_t new_size = __vala_rt_strings_size ? __vala_rt_strings_size * 2 : INITIAL_STRINGS_SIZE;
+      char **new_strings = calloc (new_size, sizeof (char *));
+      if (!new_strings)
+        {
+          return NULL;
+        }
+      for (size_t i = 0; i < __vala_rt_strings_size; i++)
+        {
+          if (__vala_rt_strings[i])
+            {
+              size_t j = __vala_rt_hash_string (__vala_rt_strings[i]) & (new_size - 1);
+              while (new_strings[j])
+                {
+                  j = (j + 1) & (new_size - 1);
+                }
+              new_strings[j] = __vala_rt_strings[i];
+            }
+        }
+      free (__vala_rt_strings);
+      __vala_rt_strings = new_strings;
+      __vala_rt_strings_size = new_size;
+    }
+  size_t mask = __vala_rt_strings_size - 1;
+  size_t i = __vala_rt_hash_string (str) & mask;
+  for (; __vala_rt_strings[i]; i = (i + 1) & mask)
+    {
+      if (!strcmp (__vala_rt_strings[i], str))
+        {
+          return __vala_rt_strings[i];
+        }
+    }
+  __vala_rt_strings[i] = strdup (str);
+  if (__vala_rt_strings[i])
+    {
+      __vala_rt_strings_used++;
+    }
+  return __vala_rt_strings[i];
+}
+
+// Must be called with the write lock held.
+static void
+__vala_rt_symbolize_uncached (uintptr_t ip, int *reloaded, struct vala_rt_frame *frame)
+{
+  struct vala_rt_resolved_frame resolved;
+  __vala_rt_session_begin (&__vala_rt_api_session);
+  __vala_rt_resolve_frame (&__vala_rt_api_session, ip, &resolved);
+  // The module may have been loaded after the session started
+  if (!resolved.library_name && !*reloaded)
+    {
+      *reloaded = 1;
+      __vala_rt_session_end (&__vala_rt_api_session);
+      __vala_rt_session_begin (&__vala_rt_api_session);
+      __vala_rt_resolve_frame (&__vala_rt_api_session, ip, &resolved);
+    }
+  frame->ip = (void *)ip;
+  frame->function_name = __vala_rt_intern (resolved.function_name);
+  frame->library_name = __vala_rt_intern (resolved.library_name);
+  frame->filename = __vala_rt_intern (resolved.filename);
+  frame->lineno = resolved.lineno;
+  // Unknown addresses may become known by loading a module
+  if (resolved.library_name)
+    {
+      struct ip_cache_entry entry = { ip, *frame };
+      __vala_rt_ip_cache_insert (&entry);
+    }
+}
+
+void
+vala_rt_backtrace_symbolize (void *const *buffer, int size, struct vala_rt_frame *frames)
+{
+  int n_missing = 0;
+  pthread_rwlock_rdlock (&__vala_rt_ip_cache_lock);
+  for (int i = 0; i < size; i++)
+    {
+      const struct ip_cache_entry *entry = __vala_rt_ip_cache_find ((uintptr_t)buffer[i]);
+      if (entry)
+        {
+          frames[i] = entry->frame;
+        }
+      else
+        {
+          frames[i].ip = NULL;
+          n_missing++;
+        }
+    }
+  pthread_rwlock_unlock (&__vala_rt_ip_cache_lock);
+  if (!n_missing)
+    {
+      return;
+    }
+  int reloaded = 0;
+  pthread_rwlock_wrlock (&__vala_rt_ip_cache_lock);
+  for (int i = 0; i < size; i++)
+    {
+      if (frames[i].ip)
+        {
+          continue;
+        }
+      // Another thread may have resolved it in the meantime
+      const struct ip_cache_entry *entry = __vala_rt_ip_cache_find ((uintptr_t)buffer[i]);
+      if (entry)
+        {
+          frames[i] = entry->frame;
+        }
+      else
+        {
+          __vala_rt_symbolize_uncached ((uintptr_t)buffer[i], &reloaded, &frames[i]);
+        }
+    }
+  pthread_rwlock_unlock (&__vala_rt_ip_cache_lock);
+}
@@ -0,0 +1,611 @@
+/* collapse.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_USER_RULES 32
+#define MAX_STEPS 16
+#define MAX_ALTERNATIVES 8
+#define MAX_NAMES 512
+#define NAME_SLOTS 1024
+#define MAX_AFFIXES 64
+#define MAX_NODES 2048
+#define MAX_EDGES 4096
+#define RULE_POOL_SIZE 8192
+
+#define TOKEN_UNKNOWN 0
+#define TOKEN_SIGNAL -1
+#define TOKEN_SAME_SIGNAL -2
+// Prefixes and suffixes are -(TOKEN_AFFIX + index)
+#define TOKEN_AFFIX 3
+
+/*
+ * Collapses runs of frames that only forward a call, like the GLib signal
+ * emission machinery between a signal handler and the code that emitted the
+ * signal, into a single frame with a label.
+ *
+ * A rule is a sequence of steps, from the innermost frame outwards, separated
+ * by spaces:
+ *   name         A frame with this function name. "foo.isra.0" matches "foo",
+ *                like for the Vala names.
+ *   prefix*      A frame whose function name starts with prefix
+ *   *suffix      A frame whose function name ends with suffix
+ *   @signal      A frame of a registered signal handler
+ *   @same-signal A frame of a handler of the same signal in the same library as
+ *                the frame matched by @signal
+ *   a|b          Any of the steps
+ *   ?step        An optional step
+ *   >            The frames matched before are kept, the ones after are
+ *                collapsed into the first of them
+ * The label replaces the function name of the collapsed frame. Rules without
+ * a label must contain @signal and are labeled with the name of the signal.
+ *
+ * All enabled rules are compiled into a trie over the function names, which
+ * are interned as tokens, so every frame is looked up in a hash table once and
+ * matching is a walk down the trie. At every frame the longest match wins,
+ * ties are won by the rule that was added first. The trie is rebuilt whenever
+ * the rules change, so an invalid rule or one that doesn't fit is rejected
+ * right away and the crash handler only has to walk it.
+ */
+
+struct collapse_rule
+{
+  const char *pattern;
+  const char *label;
+  int         group;
+};
+
+struct collapse_name
+{
+  const char *name;
+  size_t      len;
+};
+
+struct collapse_affix
+{
+  const char *affix;
+  size_t      len;
+  int         is_prefix;
+};
+
+struct collapse_step
+{
+  int n_alternatives;
+  int optional;
+  int tokens[MAX_ALTERNATIVES];
+};
+
+struct collapse_edge
+{
+  int token;
+  int child;
+  int next;
+};
+
+struct collapse_node
+{
+  int first_edge;
+  // Index of the rule ending here, or -1
+  int rule;
+  // Number of kept frames, if a rule ends here
+  int keep;
+};
+
+struct collapse_match
+{
+  int length;
+  int node;
+  int anchor;
+};
+
+// Group 0 is always enabled
+static const struct collapse_rule __vala_rt_builtin_rules[] = {
+  // Either __lambda4_ or ___lambda4_class_signal is kept and the other one or
+  // the closure becomes <<signal Class::signal>>
+  { "@signal > ?@same-signal GLib::Closure.invoke|g_closure_invoke signal_emit_unlocked_R ?g_signal_emitv", NULL, 0 },
+  { "@signal > ?@same-signal GLib::Closure.invoke|g_closure_invoke signal_emit_unlocked_R g_signal_emit_valist "
+    "?g_signal_emit|g_signal_emit_by_name",
+    NULL, 0 },
+  { "g_task_return_now ?g_task_return|complete_in_idle_cb", "<<GTask callback>>", VALA_RT_COLLAPSE_GTASK },
+  { "?g_idle_dispatch|g_timeout_dispatch|g_child_watch_dispatch|g_unix_signal_watch_dispatch|g_io_unix_dispatch "
+    "?g_main_dispatch ?g_main_context_dispatch_unlocked ?g_main_context_dispatch g_main_context_iterate "
+    "?g_main_loop_run|GLib::MainLoop.run|g_main_context_iteration",
+    "<<main loop dispatch>>", VALA_RT_COLLAPSE_MAIN_CONTEXT },
+  { "g_cclosure_marshal_*|g_type_class_meta_marshal ?GLib::Closure.invoke|g_closure_invoke|_g_closure_invoke_va",
+    "<<closure>>", VALA_RT_COLLAPSE_CLOSURES },
+  { "*_ready ?g_task_return_now ?g_task_return|complete_in_idle_cb", "<<async resume>>", VALA_RT_COLLAPSE_ASYNC },
+};
+#define N_BUILTIN_RULES (sizeof (__vala_rt_builtin_rules) / sizeof (__vala_rt_builtin_rules[0]))
+
+static struct collapse_rule  __vala_rt_user_rules[MAX_USER_RULES];
+static int                   __vala_rt_n_user_rules = 0;
+static char                  __vala_rt_rule_pool[RULE_POOL_SIZE];
+static size_t                __vala_rt_rule_pool_used = 0;
+static int                   __vala_rt_collapse_groups = 0;
+// Only set until the first compilation
+static int                   __vala_rt_collapse_dirty = 1;
+static struct collapse_name  __vala_rt_collapse_names[MAX_NAMES];
+static int                   __vala_rt_n_collapse_names = 0;
+// Token of each name, 0 if empty
+static int                   __vala_rt_collapse_name_slots[NAME_SLOTS];
+static struct collapse_affix __vala_rt_collapse_affixes[MAX_AFFIXES];
+static int                   __vala_rt_n_collapse_affixes = 0;
+static struct collapse_node  __vala_rt_collapse_nodes[MAX_NODES];
+static int                   __vala_rt_n_collapse_nodes = 0;
+static struct collapse_edge  __vala_rt_collapse_edges[MAX_EDGES];
+static int                   __vala_rt_n_collapse_edges = 0;
+static const char           *__vala_rt_collapse_labels[N_BUILTIN_RULES + MAX_USER_RULES];
+static int                   __vala_rt_frame_tokens[MAX_BACKTRACE_DEPTH];
+static const char           *__vala_rt_frame_signals[MAX_BACKTRACE_DEPTH];
+
+static int
+__vala_rt_collapse_compile (void);
+
+void
+vala_rt_enable_collapse_rules (int groups)
+{
+  __vala_rt_collapse_groups = groups;
+  __vala_rt_collapse_compile ();
+}
+
+static const char *
+__vala_rt_rule_pool_copy (const char *str)
+{
+  size_t len = strlen (str) + 1;
+  if (__vala_rt_rule_pool_used + len > RULE_POOL_SIZE)
+    {
+      return NULL;
+    }
+  char *copy = &__vala_rt_rule_pool[__vala_rt_rule_pool_used];
+  memcpy (copy, str, len);
+  __vala_rt_rule_pool_used += len;
+  return copy;
+}
+
+int
+vala_rt_add_collapse_rule (const char *pattern, const char *label)
+{
+  if (!pattern || __vala_rt_n_user_rules == MAX_USER_RULES || (!label && !strstr (pattern, "@signal")))
+    {
+      return -1;
+    }
+  size_t      pool_used = __vala_rt_rule_pool_used;
+  const char *pattern_copy = __vala_rt_rule_pool_copy (pattern);
+  const char *label_copy = label ? __vala_rt_rule_pool_copy (label) : NULL;
+  if (!pattern_copy || (label && !label_copy))
+    {
+      __vala_rt_rule_pool_used = pool_used;
+      return -1;
+    }
+  __vala_rt_user_rules[__vala_rt_n_user_rules].pattern = pattern_copy;
+  __vala_rt_user_rules[__vala_rt_n_user_rules].label = label_copy;
+  __vala_rt_user_rules[__vala_rt_n_user_rules].group = 0;
+  __vala_rt_n_user_rules++;
+  if (__vala_rt_collapse_compile ())
+    {
+      // Back to the rules that compiled before
+      __vala_rt_n_user_rules--;
+      __vala_rt_rule_pool_used = pool_used;
+      __vala_rt_collapse_compile ();
+      return -1;
+    }
+  return 0;
+}
+
+// Reads VALA_RT_COLLAPSE, a comma-separated list of gtask, main-context,
+// closures and async.
+void
+__vala_rt_collapse_rules_from_env (void)
+{
+  static const struct
+  {
+    const char *name;
+    int         group;
+  } groups[] = {
+    { "gtask", VALA_RT_COLLAPSE_GTASK },
+    { "main-context", VALA_RT_COLLAPSE_MAIN_CONTEXT },
+    { "closures", VALA_RT_COLLAPSE_CLOSURES },
+    { "async", VALA_RT_COLLAPSE_ASYNC },
+  };
+  const char *env = getenv ("VALA_RT_COLLAPSE");
+  int         enabled = 0;
+  // Compiles the built-in rules even without it, so the crash handler doesn't
+  // have to.
+  while (env && *env)
+    {
+      size_t len = strcspn (env, ",");
+      for (size_t i = 0; i < sizeof (groups) / sizeof (groups[0]); i++)
+        {
+          if (strlen (groups[i].name) == len && !strncmp (groups[i].name, env, len))
+            {
+              enabled |= groups[i].group;
+            }
+        }
+      env += len;
+      if (*env)
+        {
+          env++;
+        }
+    }
+  vala_rt_enable_collapse_rules (enabled);
+}
+
+static int
+__vala_rt_collapse_find_name (const char *name, size_t len, int add)
+{
+  uint32_t mask = NAME_SLOTS - 1;
+  for (uint32_t i = __vala_rt_hash_name (name, len) & mask;; i = (i + 1) & mask)
+    {
+      int token = __vala_rt_collapse_name_slots[i];
+      if (!token)
+        {
+          if (!add || __vala_rt_n_collapse_names + 1 == MAX_NAMES)
+            {
+              return TOKEN_UNKNOWN;
+            }
+          token = ++__vala_rt_n_collapse_names;
+          __vala_rt_collapse_names[token].name = name;
+          __vala_rt_collapse_names[token].len = len;
+          __vala_rt_collapse_name_slots[i] = token;
+          return token;
+        }
+      if (__vala_rt_collapse_names[token].len == len && !memcmp (__vala_rt_collapse_names[token].name, name, len))
+        {
+          return token;
+        }
+    }
+}
+
+static int
+__vala_rt_collapse_parse_alternative (const char *str, size_t len)
+{
+  if (len == strlen ("@signal") && !strncmp (str, "@signal", len))
+    {
+      return TOKEN_SIGNAL;
+    }
+  if (len == strlen ("@same-signal") && !strncmp (str, "@same-signal", len))
+    {
+      return TOKEN_SAME_SIGNAL;
+    }
+  // No function name starts with @, so it is a misspelled step
+  if (!len || str[0] == '@')
+    {
+      return TOKEN_UNKNOWN;
+    }
+  int is_prefix = len > 1 && str[len - 1] == '*';
+  int is_suffix = len > 1 && str[0] == '*';
+  if (!is_prefix && !is_suffix)
+    {
+      return __vala_rt_collapse_find_name (str, len, 1);
+    }
+  if (__vala_rt_n_collapse_affixes == MAX_AFFIXES)
+    {
+      return TOKEN_UNKNOWN;
+    }
+  struct collapse_affix *affix = &__vala_rt_collapse_affixes[__vala_rt_n_collapse_affixes];
+  affix->affix = is_prefix ? str : str + 1;
+  affix->len = len - 1;
+  affix->is_prefix = is_prefix;
+  return -(TOKEN_AFFIX + __vala_rt_n_collapse_affixes++);
+}
+
+// Returns the number of steps, or -1 if the pattern is invalid. sep is set to
+// the index of the first step after ">".
+static int
+__vala_rt_collapse_parse (const char *pattern, struct collapse_step *steps, int *sep)
+{
+  int n_steps = 0;
+  *sep = 0;
+  while (*pattern)
+    {
+      if (*pattern == ' ')
+        {
+          pattern++;
+          continue;
+        }
+      size_t len = strcspn (pattern, " ");
+      if (len == 1 && *pattern == '>')
+        {
+          *sep = n_steps;
+          pattern++;
+          continue;
+        }
+      if (n_steps == MAX_STEPS)
+        {
+          return -1;
+        }
+      struct collapse_step *step = &steps[n_steps++];
+      step->n_alternatives = 0;
+      step->optional = *pattern == '?';
+      const char *end = pattern + len;
+      pattern += step->optional;
+      while (pattern < end)
+        {
+          size_t alt_len = strcspn (pattern, "| ");
+          alt_len = pattern + alt_len > end ? (size_t)(end - pattern) : alt_len;
+          int token = __vala_rt_collapse_parse_alternative (pattern, alt_len);
+          if (token == TOKEN_UNKNOWN || step->n_alternatives == MAX_ALTERNATIVES)
+            {
+              return -1;
+            }
+          step->tokens[step->n_alternatives++] = token;
+          pattern += alt_len;
+          pattern += pattern < end;
+        }
+    }
+  return n_steps;
+}
+
+static int
+__vala_rt_collapse_add_node (void)
+{
+  if (__vala_rt_n_collapse_nodes == MAX_NODES)
+    {
+      return -1;
+    }
+  struct collapse_node *node = &__vala_rt_collapse_nodes[__vala_rt_n_collapse_nodes];
+  node->first_edge = -1;
+  node->rule = -1;
+  node->keep = 0;
+  return __vala_rt_n_collapse_nodes++;
+}
+
+static int
+__vala_rt_collapse_child (int node, int token)
+{
+  int *link = &__vala_rt_collapse_nodes[node].first_edge;
+  while (*link != -1)
+    {
+      if (__vala_rt_collapse_edges[*link].token == token)
+        {
+          return __vala_rt_collapse_edges[*link].child;
+        }
+      link = &__vala_rt_collapse_edges[*link].next;
+    }
+  int child = __vala_rt_collapse_add_node ();
+  if (child == -1 || __vala_rt_n_collapse_edges == MAX_EDGES)
+    {
+      return -1;
+    }
+  // Appended, so edges of earlier rules are tried first
+  struct collapse_edge *edge = &__vala_rt_collapse_edges[__vala_rt_n_collapse_edges];
+  edge->token = token;
+  edge->child = child;
+  edge->next = -1;
+  *link = __vala_rt_n_collapse_edges++;
+  return child;
+}
+
+// Adds every path through the steps, taking optional steps or not. Returns -1
+// if the trie is full.
+static int
+__vala_rt_collapse_insert (int rule, const struct collapse_step *steps, int n_steps, int sep, int step, int node,
+                           int n_kept, int n_collapsed)
+{
+  if (node == -1)
+    {
+      return -1;
+    }
+  if (step == n_steps)
+    {
+      if (n_collapsed && __vala_rt_collapse_nodes[node].rule == -1)
+        {
+          __vala_rt_collapse_nodes[node].rule = rule;
+          __vala_rt_collapse_nodes[node].keep = n_kept;
+        }
+      return 0;
+    }
+  int kept = step < sep;
+  for (int i = 0; i < steps[step].n_alternatives; i++)
+    {
+      int child = __vala_rt_collapse_child (node, steps[step].tokens[i]);
+      if (__vala_rt_collapse_insert (rule, steps, n_steps, sep, step + 1, child, n_kept + kept, n_collapsed + !kept))
+        {
+          return -1;
+        }
+    }
+  if (steps[step].optional)
+    {
+      return __vala_rt_collapse_insert (rule, steps, n_steps, sep, step + 1, node, n_kept, n_collapsed);
+    }
+  return 0;
+}
+
+static int
+__vala_rt_collapse_compile_rule (int index, const struct collapse_rule *rule)
+{
+  struct collapse_step steps[MAX_STEPS];
+  int                  sep;
+  int                  n_steps = __vala_rt_collapse_parse (rule->pattern, steps, &sep);
+  if (n_steps <= 0)
+    {
+      return -1;
+    }
+  __vala_rt_collapse_labels[index] = rule->label;
+  return __vala_rt_collapse_insert (index, steps, n_steps, sep, 0, 0, 0, 0);
+}
+
+// Returns -1 if a rule is invalid or the tables are full. The rules compiled
+// before it are still used then.
+static int
+__vala_rt_collapse_compile (void)
+{
+  int ret = 0;
+  memset (__vala_rt_collapse_name_slots, 0, sizeof (__vala_rt_collapse_name_slots));
+  __vala_rt_n_collapse_names = 0;
+  __vala_rt_n_collapse_affixes = 0;
+  __vala_rt_n_collapse_nodes = 0;
+  __vala_rt_n_collapse_edges = 0;
+  __vala_rt_collapse_add_node ();
+  for (size_t i = 0; i < N_BUILTIN_RULES; i++)
+    {
+      const struct collapse_rule *rule = &__vala_rt_builtin_rules[i];
+      if (!rule->group || (__vala_rt_collapse_groups & rule->group))
+        {
+          ret |= __vala_rt_collapse_compile_rule (i, rule);
+        }
+    }
+  for (int i = 0; i < __vala_rt_n_user_rules; i++)
+    {
+      ret |= __vala_rt_collapse_compile_rule (N_BUILTIN_RULES + i, &__vala_rt_user_rules[i]);
+    }
+  __vala_rt_collapse_dirty = 0;
+  return ret;
+}
+
+// Like the Vala name lookup, "foo.isra.0" is tried as "foo.isra" and "foo", too.
+static int
+__vala_rt_collapse_token (const char *function_name)
+{
+  size_t len = strlen (function_name);
+  while (1)
+    {
+      int token = __vala_rt_collapse_find_name (function_name, len, 0);
+      if (token)
+        {
+          return token;
+        }
+      while (len && function_name[len - 1] != '.')
+        {
+          len--;
+        }
+      if (len < 2)
+        {
+          return TOKEN_UNKNOWN;
+        }
+      len--;
+    }
+}
+
+static int
+__vala_rt_collapse_matches (int token, const struct stack_frame *frames, int pos, int anchor)
+{
+  if (token > 0)
+    {
+      return __vala_rt_frame_tokens[pos] == token;
+    }
+  if (token == TOKEN_SIGNAL)
+    {
+      return __vala_rt_frame_signals[pos] != NULL;
+    }
+  if (token == TOKEN_SAME_SIGNAL)
+    {
+      return anchor != -1 && __vala_rt_frame_signals[pos]
+             && !strcmp (__vala_rt_frame_signals[pos], __vala_rt_frame_signals[anchor])
+             && frames[pos].library_name == frames[anchor].library_name;
+    }
+  const struct collapse_affix *affix = &__vala_rt_collapse_affixes[-token - TOKEN_AFFIX];
+  const char                  *name = __vala_rt_string_pool_get (frames[pos].function_name);
+  size_t                       len = strlen (name);
+  if (!frames[pos].function_name || len < affix->len)
+    {
+      return 0;
+    }
+  return !memcmp (affix->is_prefix ? name : name + len - affix->len, affix->affix, affix->len);
+}
+
+static void
+__vala_rt_collapse_walk (const struct stack_frame *frames, int n, int node, int pos, int length, int anchor,
+                         struct collapse_match *best)
+{
+  if (__vala_rt_collapse_nodes[node].rule != -1 && length > best->length)
+    {
+      best->length = length;
+      best->node = node;
+      best->anchor = anchor;
+    }
+  if (pos == n)
+    {
+      return;
+    }
+  for (int e = __vala_rt_collapse_nodes[node].first_edge; e != -1; e = __vala_rt_collapse_edges[e].next)
+    {
+      const struct collapse_edge *edge = &__vala_rt_collapse_edges[e];
+      if (__vala_rt_collapse_matches (edge->token, frames, pos, anchor))
+        {
+          __vala_rt_collapse_walk (frames, n, edge->child, pos + 1, length + 1,
+                                   edge->token == TOKEN_SIGNAL ? pos : anchor, best);
+        }
+    }
+}
+
+static string_id
+__vala_rt_collapse_label (const char *label, const char *signal)
+{
+  const char *parts[] = { label ? label : "<<signal ", label ? NULL : signal, label ? NULL : ">>" };
+  return __vala_rt_string_pool_add_parts (parts, 3);
+}
+
+// Marks the frames hidden by a rule as skipped and relabels the frame that
+// stands in for them.
+void
+__vala_rt_collapse_frames (struct stack_frame *frames, int n)
+{
+  if (__vala_rt_collapse_dirty)
+    {
+      __vala_rt_collapse_compile ();
+    }
+  n = n < MAX_BACKTRACE_DEPTH ? n : MAX_BACKTRACE_DEPTH;
+  for (int i = 0; i < n; i++)
+    {
+      // A recursion has the same function many times, so it is only looked up
+      // once.
+      int j = i - 1;
+      while (j >= 0 && (frames[j].function_name != frames[i].function_name
+                        || frames[j].library_name != frames[i].library_name))
+        {
+          j--;
+        }
+      if (j >= 0)
+        {
+          __vala_rt_frame_tokens[i] = __vala_rt_frame_tokens[j];
+          __vala_rt_frame_signals[i] = __vala_rt_frame_signals[j];
+          continue;
+        }
+      const char *name = __vala_rt_string_pool_get (frames[i].function_name);
+      int         known = frames[i].function_name != 0;
+      __vala_rt_frame_tokens[i] = known ? __vala_rt_collapse_token (name) : TOKEN_UNKNOWN;
+      __vala_rt_frame_signals[i]
+          = known ? __vala_rt_find_signal (__vala_rt_string_pool_get (frames[i].library_name), name) : NULL;
+    }
+  for (int i = 0; i < n;)
+    {
+      struct collapse_match match = { 0, -1, -1 };
+      __vala_rt_collapse_walk (frames, n, 0, i, 0, -1, &match);
+      if (!match.length)
+        {
+          i++;
+          continue;
+        }
+      const struct collapse_node *node = &__vala_rt_collapse_nodes[match.node];
+      struct stack_frame         *collapsed = &frames[i + node->keep];
+      const char                 *signal = match.anchor != -1 ? __vala_rt_frame_signals[match.anchor] : NULL;
+      collapsed->function_name = __vala_rt_collapse_label (__vala_rt_collapse_labels[node->rule], signal);
+      collapsed->collapsed = 1;
+      collapsed->signal_name = signal;
+      for (int j = i + node->keep + 1; j < i + match.length; j++)
+        {
+          frames[j].skip = 1;
+        }
+      i += match.length;
+    }
+}
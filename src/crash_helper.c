@@ -0,0 +1,281 @@
+/* crash_helper.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define HELPER_ACK_TIMEOUT_MS 30000
+
+/*
+ * The crash helper is forked at startup and blocks on a pipe. On a crash the
+ * handler only unwinds and streams a crash record into the pipe, all the
+ * symbolization (libdwfl, reading debuginfo, demangling) happens in the helper,
+ * which still has an intact heap.
+ */
+
+static int   __vala_rt_helper_request_fd = -1;
+static int   __vala_rt_helper_ack_fd = -1;
+static pid_t __vala_rt_helper_pid = -1;
+
+static int
+__vala_rt_helper_read_all (int fd, void *data, size_t len)
+{
+  uint8_t *ptr = data;
+  size_t   offset = 0;
+  while (offset < len)
+    {
+      ssize_t n = read (fd, &ptr[offset], len - offset);
+      if (n <= 0)
+        {
+          return -1;
+        }
+      offset += n;
+    }
+  return 0;
+}
+
+// Reads one framed crash record. Returns NULL if the pipe was closed before.
+static uint8_t *
+__vala_rt_helper_receive (int fd, size_t *size)
+{
+  uint8_t *data = NULL;
+  *size = 0;
+  while (1)
+    {
+      uint32_t len = 0;
+      if (__vala_rt_helper_read_all (fd, &len, sizeof (len)))
+        {
+          free (data);
+          return NULL;
+        }
+      if (len == 0)
+        {
+          return data;
+        }
+      uint8_t *new_data = realloc (data, *size + len);
+      if (!new_data)
+        {
+          free (data);
+          return NULL;
+        }
+      data = new_data;
+      if (__vala_rt_helper_read_all (fd, &data[*size], len))
+        {
+          free (data);
+          return NULL;
+        }
+      *size += len;
+    }
+}
+
+static void
+__vala_rt_helper_close_range (int first, int last)
+{
+#ifdef SYS_close_range
+  if (syscall (SYS_close_range, first, last, 0) == 0)
+    {
+      return;
+    }
+#endif
+  // Kernels before 5.9
+  for (int fd = first; fd <= last; fd++)
+    {
+      close (fd);
+    }
+}
+
+// Closes every file descriptor the helper inherited, except the ones in keep,
+// which has to be sorted. Otherwise the helper would keep sockets, pipes and
+// locked files of the parent open until the parent exits.
+static void
+__vala_rt_helper_close_fds (const int *keep, int n_keep)
+{
+  long max_fd = sysconf (_SC_OPEN_MAX);
+  int  first = 0;
+  for (int i = 0; i < n_keep; i++)
+    {
+      if (keep[i] > first)
+        {
+          __vala_rt_helper_close_range (first, keep[i] - 1);
+        }
+      if (keep[i] >= first)
+        {
+          first = keep[i] + 1;
+        }
+    }
+  if (max_fd > first)
+    {
+      __vala_rt_helper_close_range (first, max_fd - 1);
+    }
+}
+
+static void
+__vala_rt_helper_sort_fds (int *fds, int n_fds)
+{
+  for (int i = 1; i < n_fds; i++)
+    {
+      for (int j = i; j > 0 && fds[j - 1] > fds[j]; j--)
+        {
+          int tmp = fds[j];
+          fds[j] = fds[j - 1];
+          fds[j - 1] = tmp;
+        }
+    }
+}
+
+static void __attribute__ ((noreturn))
+__vala_rt_helper_main (int request_fd, int ack_fd)
+{
+  size_t   size;
+  uint8_t *data = __vala_rt_helper_receive (request_fd, &size);
+  if (!data)
+    {
+      // The parent exited normally
+      _exit (0);
+    }
+  struct vala_rt_crash_record record;
+  if (__vala_rt_parse_crash_record (data, size, &record) == 0)
+    {
+      // The signal mappings are not part of the record, the crashed process
+      // is stopped in its handler, so they are read from its memory.
+      __vala_rt_import_remote_signal_mappings (record.pid);
+      if (__vala_rt_session_begin_offline (&__vala_rt_crash_session, &record))
+        {
+          __vala_rt_report_begin (record.signum, record.pid);
+          __vala_rt_print_folded_backtrace (record.stack);
+          for (uint32_t i = 0; i < record.n_threads; i++)
+            {
+              __vala_rt_print_thread_stack (&record.threads[i]);
+            }
+          __vala_rt_session_end (&__vala_rt_crash_session);
+        }
+      __vala_rt_free_crash_record (&record);
+    }
+  char ack = 1;
+  write (ack_fd, &ack, 1);
+  _exit (0);
+}
+
+int
+vala_rt_start_crash_helper (void)
+{
+  if (__vala_rt_helper_pid != -1)
+    {
+      // The helper is killed, if the thread that started it exits.
+      if (waitpid (__vala_rt_helper_pid, NULL, WNOHANG) != __vala_rt_helper_pid)
+        {
+          return 0;
+        }
+      close (__vala_rt_helper_request_fd);
+      close (__vala_rt_helper_ack_fd);
+      __vala_rt_helper_request_fd = -1;
+      __vala_rt_helper_ack_fd = -1;
+      __vala_rt_helper_pid = -1;
+    }
+  int request_pipe[2];
+  int ack_pipe[2];
+  if (pipe2 (request_pipe, O_CLOEXEC))
+    {
+      return -1;
+    }
+  if (pipe2 (ack_pipe, O_CLOEXEC))
+    {
+      close (request_pipe[0]);
+      close (request_pipe[1]);
+      return -1;
+    }
+  pid_t parent = getpid ();
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      close (request_pipe[0]);
+      close (request_pipe[1]);
+      close (ack_pipe[0]);
+      close (ack_pipe[1]);
+      return -1;
+    }
+  if (pid == 0)
+    {
+      prctl (PR_SET_PDEATHSIG, SIGKILL);
+      // The parent may have died before prctl
+      if (getppid () != parent)
+        {
+          _exit (0);
+        }
+      // stdin, stdout, stderr and the report file are still needed for
+      // printing the backtrace.
+      int keep[] = {
+        STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, request_pipe[0], ack_pipe[1], __vala_rt_report_get_fd (),
+      };
+      __vala_rt_helper_sort_fds (keep, sizeof (keep) / sizeof (keep[0]));
+      __vala_rt_helper_close_fds (keep, sizeof (keep) / sizeof (keep[0]));
+      signal (SIGSEGV, SIG_DFL);
+      signal (SIGILL, SIG_DFL);
+      signal (SIGFPE, SIG_DFL);
+      signal (SIGABRT, SIG_DFL);
+      __vala_rt_helper_main (request_pipe[0], ack_pipe[1]);
+    }
+  close (request_pipe[0]);
+  close (ack_pipe[1]);
+  // Required for process_vm_readv with Yama ptrace_scope=1
+  prctl (PR_SET_PTRACER, pid);
+  __vala_rt_helper_request_fd = request_pipe[1];
+  __vala_rt_helper_ack_fd = ack_pipe[0];
+  __vala_rt_helper_pid = pid;
+  return 0;
+}
+
+// Returns 0 if the helper printed the backtrace, -1 if there is no helper
+// or it could not be reached.
+int
+__vala_rt_send_to_crash_helper (int                                signum,
+                                const siginfo_t                   *info,
+                                const struct vala_rt_folded_stack *stack,
+                                int                                n_threads)
+{
+  if (__vala_rt_helper_request_fd == -1)
+    {
+      return -1;
+    }
+  if (waitpid (__vala_rt_helper_pid, NULL, WNOHANG) == __vala_rt_helper_pid)
+    {
+      return -1;
+    }
+  // A dead helper must not kill us with SIGPIPE
+  signal (SIGPIPE, SIG_IGN);
+  if (__vala_rt_send_crash_record (__vala_rt_helper_request_fd, 1, 0, signum, info, stack, n_threads))
+    {
+      return -1;
+    }
+  struct pollfd pfd = { __vala_rt_helper_ack_fd, POLLIN, 0 };
+  char          ack = 0;
+  if (poll (&pfd, 1, HELPER_ACK_TIMEOUT_MS) != 1 || read (__vala_rt_helper_ack_fd, &ack, 1) != 1)
+    {
+      return -1;
+    }
+  return 0;
+}
@@ -0,0 +1,600 @@
+/* crash_record.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <fcntl.h>
+#include <link.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_BUFFER_SIZE 4096
+
+/*
+ * Writing a crash record only needs write(2) and dl_iterate_phdr, so it is
+ * usable from the signal handler even if the heap is corrupted. The record is
+ * turned into a backtrace by vala-rt-symbolize.
+ */
+
+struct record_writer
+{
+  int     fd;
+  int     failed;
+  // Pipes are written in chunks prefixed by their length, a zero length ends it.
+  int     framed;
+  size_t  len;
+  uint8_t buf[RECORD_BUFFER_SIZE];
+};
+
+static char                 __vala_rt_crash_record_directory[PATH_MAX] = { 0 };
+static struct record_writer __vala_rt_record_writer;
+
+void
+vala_rt_set_crash_record_directory (const char *directory)
+{
+  memset (__vala_rt_crash_record_directory, 0, sizeof (__vala_rt_crash_record_directory));
+  if (directory)
+    {
+      strncpy (__vala_rt_crash_record_directory, directory, sizeof (__vala_rt_crash_record_directory) - 1);
+    }
+}
+
+static void
+__vala_rt_record_write_all (struct record_writer *w, const void *data, size_t len)
+{
+  const uint8_t *ptr = data;
+  size_t         offset = 0;
+  while (offset < len && !w->failed)
+    {
+      ssize_t n = write (w->fd, &ptr[offset], len - offset);
+      if (n <= 0)
+        {
+          w->failed = 1;
+          break;
+        }
+      offset += n;
+    }
+}
+
+static void
+__vala_rt_record_flush (struct record_writer *w)
+{
+  if (w->framed)
+    {
+      uint32_t len = w->len;
+      __vala_rt_record_write_all (w, &len, sizeof (len));
+    }
+  __vala_rt_record_write_all (w, w->buf, w->len);
+  w->len = 0;
+}
+
+static void
+__vala_rt_record_put (struct record_writer *w, const void *data, size_t len)
+{
+  const uint8_t *ptr = data;
+  while (len)
+    {
+      if (w->len == RECORD_BUFFER_SIZE)
+        {
+          __vala_rt_record_flush (w);
+        }
+      size_t n = RECORD_BUFFER_SIZE - w->len;
+      n = n < len ? n : len;
+      memcpy (&w->buf[w->len], ptr, n);
+      w->len += n;
+      ptr += n;
+      len -= n;
+    }
+}
+
+static void
+__vala_rt_record_put_u32 (struct record_writer *w, uint32_t value)
+{
+  __vala_rt_record_put (w, &value, sizeof (value));
+}
+
+static void
+__vala_rt_record_put_string (struct record_writer *w, const char *str)
+{
+  if (!str)
+    {
+      __vala_rt_record_put_u32 (w, 0);
+      return;
+    }
+  uint32_t len = strlen (str) + 1;
+  __vala_rt_record_put_u32 (w, len);
+  __vala_rt_record_put (w, str, len);
+}
+
+// Finds the NT_GNU_BUILD_ID note in the PT_NOTE segments of a loaded object.
+int
+__vala_rt_phdr_build_id (const struct dl_phdr_info *info, const uint8_t **id)
+{
+  for (ElfW (Half) i = 0; i < info->dlpi_phnum; i++)
+    {
+      const ElfW (Phdr) *phdr = &info->dlpi_phdr[i];
+      if (phdr->p_type != PT_NOTE)
+        {
+          continue;
+        }
+      const uint8_t *note = (const uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+      size_t         left = phdr->p_memsz;
+      while (left >= sizeof (ElfW (Nhdr)))
+        {
+          const ElfW (Nhdr) *nhdr = (const ElfW (Nhdr) *)note;
+          size_t name_size = (nhdr->n_namesz + 3) & ~(size_t)3;
+          size_t desc_size = (nhdr->n_descsz + 3) & ~(size_t)3;
+          size_t total = sizeof (ElfW (Nhdr)) + name_size + desc_size;
+          if (total > left)
+            {
+              break;
+            }
+          if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+              && memcmp (note + sizeof (ElfW (Nhdr)), "GNU", 4) == 0)
+            {
+              *id = note + sizeof (ElfW (Nhdr)) + name_size;
+              return nhdr->n_descsz;
+            }
+          note += total;
+          left -= total;
+        }
+    }
+  return 0;
+}
+
+static int
+__vala_rt_count_module (__attribute__ ((unused)) struct dl_phdr_info *info,
+                        __attribute__ ((unused)) size_t               size,
+                        void                                         *data)
+{
+  (*(uint32_t *)data)++;
+  return 0;
+}
+
+static int
+__vala_rt_record_module (struct dl_phdr_info            *info,
+                         __attribute__ ((unused)) size_t size,
+                         __attribute__ ((unused)) void  *data)
+{
+  char exe[PATH_MAX] = { 0 };
+  // The main executable has no name
+  const char *name = info->dlpi_name;
+  if (!name || !name[0])
+    {
+      readlink ("/proc/self/exe", exe, sizeof (exe) - 1);
+      name = exe;
+    }
+  const uint8_t *id = NULL;
+  uint32_t       id_len = __vala_rt_phdr_build_id (info, &id);
+  uint64_t       base = info->dlpi_addr;
+  __vala_rt_record_put (&__vala_rt_record_writer, &base, sizeof (base));
+  __vala_rt_record_put_u32 (&__vala_rt_record_writer, id_len);
+  __vala_rt_record_put (&__vala_rt_record_writer, id, id_len);
+  __vala_rt_record_put_string (&__vala_rt_record_writer, name);
+  return 0;
+}
+
+static char *
+__vala_rt_append_decimal (char *into, long value)
+{
+  char  tmp[24];
+  char *ptr = &tmp[sizeof (tmp)];
+  int   negative = value < 0;
+  unsigned long v = negative ? -(unsigned long)value : (unsigned long)value;
+  do
+    {
+      *--ptr = '0' + v % 10;
+      v /= 10;
+    }
+  while (v);
+  if (negative)
+    {
+      *--ptr = '-';
+    }
+  size_t len = &tmp[sizeof (tmp)] - ptr;
+  memcpy (into, ptr, len);
+  return into + len;
+}
+
+// Writes the record to fd. The signal mappings are left out, if the reader
+// is going to fetch them itself.
+int
+__vala_rt_send_crash_record (
+    int fd, int framed, int with_mappings, int signum, const siginfo_t *info, const struct vala_rt_folded_stack *stack,
+    int n_threads)
+{
+  struct record_writer *w = &__vala_rt_record_writer;
+  w->fd = fd;
+  w->failed = 0;
+  w->framed = framed;
+  w->len = 0;
+  struct vala_rt_crash_header header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CRASH_RECORD_MAGIC, sizeof (header.magic));
+  header.version = CRASH_RECORD_VERSION;
+  header.signum = signum;
+  header.pid = getpid ();
+  header.n_frames = stack->n;
+  header.n_dropped = stack->n_dropped;
+  header.n_threads = n_threads;
+  if (info)
+    {
+      memcpy (header.siginfo, info, sizeof (header.siginfo) < sizeof (*info) ? sizeof (header.siginfo) : sizeof (*info));
+    }
+  for (size_t i = 0; __vala_extra_debug_directories && __vala_extra_debug_directories[i]; i++)
+    {
+      header.n_extra_debug_directories++;
+    }
+  dl_iterate_phdr (__vala_rt_count_module, &header.n_modules);
+  header.n_signal_libraries = with_mappings ? __vala_rt_n_signal_mappings : 0;
+  __vala_rt_record_put (w, &header, sizeof (header));
+  for (int i = 0; i < stack->n; i++)
+    {
+      uint64_t ip = stack->frames[i].ip;
+      __vala_rt_record_put (w, &ip, sizeof (ip));
+      __vala_rt_record_put_u32 (w, stack->frames[i].cycle_len);
+      __vala_rt_record_put_u32 (w, stack->frames[i].count);
+    }
+  __vala_rt_record_put_string (w, __vala_debug_prefix);
+  for (uint32_t i = 0; i < header.n_extra_debug_directories; i++)
+    {
+      __vala_rt_record_put_string (w, __vala_extra_debug_directories[i]);
+    }
+  uint32_t n_modules = 0;
+  dl_iterate_phdr (__vala_rt_count_module, &n_modules);
+  // dlopen() from another thread while the process is crashing is unlikely,
+  // but the record would be unreadable.
+  if (n_modules != header.n_modules)
+    {
+      return -1;
+    }
+  dl_iterate_phdr (__vala_rt_record_module, NULL);
+  for (uint32_t i = 0; i < header.n_signal_libraries; i++)
+    {
+      const struct mapping_holder *holder = &__vala_rt_signal_mappings[i];
+      __vala_rt_record_put_string (w, holder->library_path);
+      __vala_rt_record_put_u32 (w, holder->n_mappings);
+      for (size_t j = 0; j < holder->n_mappings; j++)
+        {
+          __vala_rt_record_put_string (w, __vala_rt_mapping_c_name (holder, j));
+          __vala_rt_record_put_string (w, __vala_rt_mapping_signal_name (holder, j));
+        }
+    }
+  for (int i = 0; i < n_threads; i++)
+    {
+      struct vala_rt_thread_stack thread;
+      __vala_rt_get_other_thread (i, &thread);
+      __vala_rt_record_put_u32 (w, thread.tid);
+      __vala_rt_record_put_u32 (w, thread.status);
+      __vala_rt_record_put_u32 (w, thread.n_frames);
+      for (uint32_t j = 0; j < thread.n_frames; j++)
+        {
+          uint64_t ip = thread.ips[j];
+          __vala_rt_record_put (w, &ip, sizeof (ip));
+        }
+    }
+  __vala_rt_record_flush (w);
+  if (framed)
+    {
+      __vala_rt_record_flush (w);
+    }
+  return w->failed ? -1 : 0;
+}
+
+// Returns 0 if the record was written, -1 if crash records are not enabled
+// or it was not possible to write one.
+int
+__vala_rt_write_crash_record (int                                signum,
+                              const siginfo_t                   *info,
+                              const struct vala_rt_folded_stack *stack,
+                              int                                n_threads)
+{
+  const char *directory = __vala_rt_crash_record_directory;
+  if (!directory[0])
+    {
+      directory = getenv ("VALA_RT_CRASH_RECORD_DIR");
+    }
+  if (!directory || !directory[0] || strlen (directory) > PATH_MAX - 64)
+    {
+      return -1;
+    }
+  char  path[PATH_MAX] = { 0 };
+  char *ptr = path;
+  memcpy (ptr, directory, strlen (directory));
+  ptr += strlen (directory);
+  memcpy (ptr, "/vala-rt-", strlen ("/vala-rt-"));
+  ptr += strlen ("/vala-rt-");
+  ptr = __vala_rt_append_decimal (ptr, getpid ());
+  memcpy (ptr, ".crash", strlen (".crash"));
+  // Written under a temporary name, so there is never a truncated record with
+  // the final name.
+  char tmp_path[PATH_MAX] = { 0 };
+  memcpy (tmp_path, path, strlen (path));
+  memcpy (&tmp_path[strlen (path)], ".tmp", strlen (".tmp"));
+  int fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  int ret = __vala_rt_send_crash_record (fd, 0, 1, signum, info, stack, n_threads);
+  if (close (fd))
+    {
+      ret = -1;
+    }
+  if (ret || rename (tmp_path, path))
+    {
+      unlink (tmp_path);
+      return -1;
+    }
+  __vala_rt_report_crash_record (signum, path);
+  return 0;
+}
+
+struct record_reader
+{
+  const uint8_t *data;
+  size_t         size;
+  size_t         offset;
+  int            failed;
+};
+
+static const void *
+__vala_rt_record_get (struct record_reader *r, size_t len)
+{
+  if (r->failed || r->size - r->offset < len)
+    {
+      r->failed = 1;
+      return NULL;
+    }
+  const void *ret = &r->data[r->offset];
+  r->offset += len;
+  return ret;
+}
+
+static uint32_t
+__vala_rt_record_get_u32 (struct record_reader *r)
+{
+  uint32_t    ret = 0;
+  const void *ptr = __vala_rt_record_get (r, sizeof (ret));
+  if (ptr)
+    {
+      memcpy (&ret, ptr, sizeof (ret));
+    }
+  return ret;
+}
+
+static const char *
+__vala_rt_record_get_string (struct record_reader *r)
+{
+  uint32_t len = __vala_rt_record_get_u32 (r);
+  if (!len)
+    {
+      return NULL;
+    }
+  const char *ret = __vala_rt_record_get (r, len);
+  if (ret && ret[len - 1])
+    {
+      r->failed = 1;
+      return NULL;
+    }
+  return ret;
+}
+
+static int
+__vala_rt_read_file (const char *path, uint8_t **data, size_t *size)
+{
+  FILE *fp = fopen (path, "rb");
+  if (!fp)
+    {
+      return -1;
+    }
+  struct stat st;
+  if (fstat (fileno (fp), &st) || st.st_size <= 0)
+    {
+      fclose (fp);
+      return -1;
+    }
+  *size = 0;
+  *data = malloc (st.st_size);
+  if (!*data)
+    {
+      fclose (fp);
+      return -1;
+    }
+  *size = fread (*data, 1, st.st_size, fp);
+  fclose (fp);
+  return *size == (size_t)st.st_size ? 0 : -1;
+}
+
+// Loads a record written by __vala_rt_write_crash_record. The signal mappings
+// in it are registered, as if the libraries had done it.
+int
+__vala_rt_load_crash_record (const char *path, struct vala_rt_crash_record *record)
+{
+  uint8_t *data = NULL;
+  size_t   size = 0;
+  if (__vala_rt_read_file (path, &data, &size))
+    {
+      free (data);
+      return -1;
+    }
+  return __vala_rt_parse_crash_record (data, size, record);
+}
+
+// Takes ownership of data, which has to be allocated using malloc.
+int
+__vala_rt_parse_crash_record (uint8_t *data, size_t size, struct vala_rt_crash_record *record)
+{
+  memset (record, 0, sizeof (*record));
+  record->data = data;
+  record->size = size;
+  struct record_reader               r = { record->data, record->size, 0, 0 };
+  const struct vala_rt_crash_header *header = __vala_rt_record_get (&r, sizeof (struct vala_rt_crash_header));
+  if (!header || memcmp (header->magic, CRASH_RECORD_MAGIC, sizeof (header->magic))
+      || header->version != CRASH_RECORD_VERSION || header->n_frames > MAX_BACKTRACE_DEPTH)
+    {
+      __vala_rt_free_crash_record (record);
+      return -1;
+    }
+  record->signum = header->signum;
+  record->pid = header->pid;
+  memcpy (&record->info,
+          header->siginfo,
+          sizeof (header->siginfo) < sizeof (record->info) ? sizeof (header->siginfo) : sizeof (record->info));
+  record->stack = calloc (1, sizeof (struct vala_rt_folded_stack));
+  record->threads = calloc (header->n_threads + 1, sizeof (struct vala_rt_thread_stack));
+  record->modules = calloc (header->n_modules + 1, sizeof (struct vala_rt_crash_module));
+  record->extra_debug_directories = calloc (header->n_extra_debug_directories + 1, sizeof (char *));
+  if (!record->stack || !record->threads || !record->modules || !record->extra_debug_directories)
+    {
+      __vala_rt_free_crash_record (record);
+      return -1;
+    }
+  record->stack->n = header->n_frames;
+  record->stack->n_dropped = header->n_dropped;
+  for (uint32_t i = 0; i < header->n_frames; i++)
+    {
+      struct vala_rt_folded_frame *frame = &record->stack->frames[i];
+      uint64_t                     ip = 0;
+      const void                  *ptr = __vala_rt_record_get (&r, sizeof (ip));
+      if (ptr)
+        {
+          memcpy (&ip, ptr, sizeof (ip));
+        }
+      frame->ip = ip;
+      frame->cycle_len = __vala_rt_record_get_u32 (&r);
+      frame->count = __vala_rt_record_get_u32 (&r);
+      // A cycle can't extend past the end of the stack, and runs at least once
+      if (frame->cycle_len > header->n_frames - i || (frame->cycle_len && !frame->count))
+        {
+          r.failed = 1;
+        }
+      record->stack->n_frames += frame->ip ? 1 : frame->count;
+      record->stack->n_frames += frame->cycle_len ? frame->cycle_len * (frame->count - 1) : 0;
+    }
+  record->debug_prefix = __vala_rt_record_get_string (&r);
+  for (uint32_t i = 0; i < header->n_extra_debug_directories; i++)
+    {
+      record->extra_debug_directories[i] = __vala_rt_record_get_string (&r);
+    }
+  for (uint32_t i = 0; i < header->n_modules && !r.failed; i++)
+    {
+      struct vala_rt_crash_module *module = &record->modules[record->n_modules];
+      const void                  *ptr = __vala_rt_record_get (&r, sizeof (module->base));
+      if (ptr)
+        {
+          memcpy (&module->base, ptr, sizeof (module->base));
+        }
+      module->build_id_len = __vala_rt_record_get_u32 (&r);
+      module->build_id = __vala_rt_record_get (&r, module->build_id_len);
+      module->path = __vala_rt_record_get_string (&r);
+      if (module->path)
+        {
+          record->n_modules++;
+        }
+    }
+  for (uint32_t i = 0; i < header->n_signal_libraries && !r.failed; i++)
+    {
+      const char *library = __vala_rt_record_get_string (&r);
+      uint32_t    n_mappings = __vala_rt_record_get_u32 (&r);
+      if (r.failed || n_mappings > (r.size - r.offset) / (2 * sizeof (uint32_t)))
+        {
+          r.failed = 1;
+          break;
+        }
+      struct vala_signal_mappings *mappings = calloc (n_mappings + 1, sizeof (struct vala_signal_mappings));
+      if (!mappings)
+        {
+          r.failed = 1;
+          break;
+        }
+      for (uint32_t j = 0; j < n_mappings; j++)
+        {
+          const char *c_name = __vala_rt_record_get_string (&r);
+          const char *signal = __vala_rt_record_get_string (&r);
+          if (c_name && signal)
+            {
+              strncpy ((char *)mappings[j].c_function_name, c_name, sizeof (mappings[j].c_function_name) - 1);
+              strncpy ((char *)mappings[j].demangled_signal_name, signal, sizeof (mappings[j].demangled_signal_name) - 1);
+            }
+        }
+      if (library && !r.failed)
+        {
+          __vala_register_signal_mappings (library, mappings, n_mappings);
+        }
+      else
+        {
+          free (mappings);
+        }
+    }
+  for (uint32_t i = 0; i < header->n_threads && !r.failed; i++)
+    {
+      struct vala_rt_thread_stack *thread = &record->threads[record->n_threads++];
+      thread->tid = __vala_rt_record_get_u32 (&r);
+      thread->status = __vala_rt_record_get_u32 (&r);
+      thread->n_frames = __vala_rt_record_get_u32 (&r);
+      if (r.failed || thread->n_frames > MAX_BACKTRACE_DEPTH)
+        {
+          r.failed = 1;
+          break;
+        }
+      uintptr_t *ips = calloc (thread->n_frames + 1, sizeof (uintptr_t));
+      if (!ips)
+        {
+          r.failed = 1;
+          break;
+        }
+      thread->ips = ips;
+      for (uint32_t j = 0; j < thread->n_frames; j++)
+        {
+          uint64_t    ip = 0;
+          const void *ptr = __vala_rt_record_get (&r, sizeof (ip));
+          if (ptr)
+            {
+              memcpy (&ip, ptr, sizeof (ip));
+            }
+          ips[j] = ip;
+        }
+    }
+  if (r.failed)
+    {
+      __vala_rt_free_crash_record (record);
+      return -1;
+    }
+  return 0;
+}
+
+void
+__vala_rt_free_crash_record (struct vala_rt_crash_record *record)
+{
+  free (record->data);
+  free (record->stack);
+  for (uint32_t i = 0; i < record->n_threads; i++)
+    {
+      free ((void *)record->threads[i].ips);
+    }
+  free (record->threads);
+  free (record->modules);
+  free (record->extra_debug_directories);
+  memset (record, 0, sizeof (*record));
+}
@@ -0,0 +1,677 @@
+/* demangle.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <gelf.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// A miss checks for new modules at most this often
+#define DEMANGLE_REFRESH_INTERVAL_NS (100 * 1000 * 1000ULL)
+
+/*
+ * The index behind vala_rt_demangle, independent of the session of the crash
+ * handler. It is a snapshot of the names of all loaded modules, built on the
+ * first call and never modified afterwards, so readers only need to load the
+ * pointer and no lock at all. If a lookup misses and modules were loaded or
+ * unloaded since, a new snapshot is built under a mutex, reusing the modules
+ * that are still loaded, and published. It is only replaced if dlopen or
+ * dlclose was called in the meantime. Readers may still use the old one, so it
+ * is put on a list of retired snapshots, which are freed by the last reader to
+ * leave. Readers are counted before they load the pointer, so once the count
+ * drops to zero, nobody can still see a retired snapshot.
+ *
+ * Every snapshot has a hash table of all the names of its modules and of the
+ * search directories, so a lookup is a hash probe per suffix stripped, no
+ * matter how many modules are loaded. The first name inserted wins. Without
+ * knowing the module of a name, the order of the crash handler is approximated:
+ * The .vdbg files found by build-id, then the files of the search directories,
+ * which the handler checks for modules without one, then the sections.
+ */
+
+// The names of one loaded module, shared by all snapshots containing it and
+// never freed.
+struct demangle_module
+{
+  char          *name;
+  uintptr_t      base;
+  uintptr_t      start;
+  uintptr_t      end;
+  // Found by build-id
+  const uint8_t *vdbg;
+  size_t         vdbg_size;
+  // A decompressed copy of .debug_info_vala
+  const uint8_t *section;
+  size_t         section_size;
+  const uint8_t *addr_index;
+  size_t         addr_index_size;
+};
+
+// The packs and .vdbg files of the search directories
+struct demangle_file
+{
+  int            is_pack;
+  const uint8_t *data;
+  size_t         size;
+};
+
+// An entry of the hash table of a snapshot. The strings belong to the modules
+// and files.
+struct demangle_name
+{
+  uint32_t    hash;
+  const char *c_name;
+  const char *vala_name;
+};
+
+struct demangle_index
+{
+  // dlpi_adds and dlpi_subs when it was built
+  unsigned long long      adds;
+  unsigned long long      subs;
+  // The next older retired snapshot
+  struct demangle_index  *retired;
+  // Open addressing with linear probing, NULL if it could not be allocated
+  struct demangle_name   *names;
+  size_t                  names_size;
+  size_t                  n_modules;
+  struct demangle_module *modules[];
+};
+
+// A loaded object, as seen by dl_iterate_phdr
+struct demangle_object
+{
+  char     *name;
+  uintptr_t base;
+  uintptr_t start;
+  uintptr_t end;
+  uint8_t   build_id[MAX_BUILD_ID_LEN];
+  int       build_id_len;
+};
+
+struct demangle_objects
+{
+  struct demangle_object *objects;
+  size_t                  n_objects;
+  size_t                  capacity;
+};
+
+static struct demangle_index *__vala_rt_demangle_index = NULL;
+// Replaced snapshots still in use, protected by the lock
+static struct demangle_index *__vala_rt_demangle_retired = NULL;
+static unsigned long          __vala_rt_demangle_readers = 0;
+static pthread_mutex_t        __vala_rt_demangle_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long     __vala_rt_demangle_last_check = 0;
+// Loaded with the first snapshot, so loading the index covers them.
+static struct demangle_file  *__vala_rt_demangle_files = NULL;
+static size_t                 __vala_rt_demangle_n_files = 0;
+
+static int
+__vala_rt_demangle_counters (struct dl_phdr_info *info, __attribute__ ((unused)) size_t size, void *data)
+{
+  unsigned long long *counters = data;
+  counters[0] = info->dlpi_adds;
+  counters[1] = info->dlpi_subs;
+  // The counters are the same for every object
+  return 1;
+}
+
+// Only copies what is needed, the files are read once dl_iterate_phdr has
+// released the loader lock.
+static int
+__vala_rt_demangle_collect (struct dl_phdr_info *info, __attribute__ ((unused)) size_t size, void *data)
+{
+  struct demangle_objects *objects = data;
+  if (objects->n_objects == objects->capacity)
+    {
+      size_t                  capacity = objects->capacity ? objects->capacity * 2 : 64;
+      struct demangle_object *grown = realloc (objects->objects, capacity * sizeof (struct demangle_object));
+      if (!grown)
+        {
+          return 1;
+        }
+      objects->objects = grown;
+      objects->capacity = capacity;
+    }
+  struct demangle_object *object = &objects->objects[objects->n_objects];
+  memset (object, 0, sizeof (*object));
+  object->start = UINTPTR_MAX;
+  for (ElfW (Half) i = 0; i < info->dlpi_phnum; i++)
+    {
+      const ElfW (Phdr) *phdr = &info->dlpi_phdr[i];
+      uintptr_t          start = info->dlpi_addr + phdr->p_vaddr;
+      if (phdr->p_type == PT_LOAD)
+        {
+          object->start = start < object->start ? start : object->start;
+          object->end = start + phdr->p_memsz > object->end ? start + phdr->p_memsz : object->end;
+        }
+    }
+  object->name = strdup (info->dlpi_name ? info->dlpi_name : "");
+  if (!object->name)
+    {
+      return 1;
+    }
+  object->base = info->dlpi_addr;
+  const uint8_t *id = NULL;
+  int            id_len = __vala_rt_phdr_build_id (info, &id);
+  if (id_len > 0 && id_len <= MAX_BUILD_ID_LEN)
+    {
+      memcpy (object->build_id, id, id_len);
+      object->build_id_len = id_len;
+    }
+  objects->n_objects++;
+  return 0;
+}
+
+// Returns a copy of the section, decompressed if needed.
+static const uint8_t *
+__vala_rt_demangle_read_section (Elf *elf, const char *sname, int gnu_compressed, size_t *size)
+{
+  size_t num_sections = 0;
+  size_t shstrndx;
+  if (elf_getshdrnum (elf, &num_sections) || elf_getshdrstrndx (elf, &shstrndx))
+    {
+      return NULL;
+    }
+  for (size_t i = 0; i < num_sections; i++)
+    {
+      Elf_Scn  *scn = elf_getscn (elf, i);
+      GElf_Shdr shdr;
+      if (!gelf_getshdr (scn, &shdr) || shdr.sh_type == SHT_NOBITS)
+        {
+          continue;
+        }
+      const char *name = elf_strptr (elf, shstrndx, shdr.sh_name);
+      if (!name || strcmp (sname, name))
+        {
+          continue;
+        }
+      if ((shdr.sh_flags & SHF_COMPRESSED) ? elf_compress (scn, 0, 0) < 0
+                                           : gnu_compressed && elf_compress_gnu (scn, 0, 0) < 0)
+        {
+          return NULL;
+        }
+      Elf_Data *data = elf_getdata (scn, NULL);
+      if (!data || !data->d_size)
+        {
+          return NULL;
+        }
+      uint8_t *copy = malloc (data->d_size);
+      if (copy)
+        {
+          memcpy (copy, data->d_buf, data->d_size);
+          *size = data->d_size;
+        }
+      return copy;
+    }
+  return NULL;
+}
+
+static void
+__vala_rt_demangle_read_elf (struct demangle_module *module)
+{
+  // The name of the executable is empty
+  int fd = open (module->name[0] ? module->name : "/proc/self/exe", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      return;
+    }
+  Elf *elf = elf_begin (fd, ELF_C_READ_MMAP, NULL);
+  if (elf)
+    {
+      module->section = __vala_rt_demangle_read_section (elf, ".debug_info_vala", 0, &module->section_size);
+      if (!module->section)
+        {
+          module->section = __vala_rt_demangle_read_section (elf, ".zdebug_info_vala", 1, &module->section_size);
+        }
+      if (!module->addr_index)
+        {
+          size_t         size = 0;
+          const uint8_t *index = __vala_rt_demangle_read_section (elf, ADDR_INDEX_SECTION_NAME, 0, &size);
+          if (index && __vala_rt_addr_index_valid (index, size))
+            {
+              module->addr_index = index;
+              module->addr_index_size = size;
+            }
+          else
+            {
+              free ((void *)index);
+            }
+        }
+      elf_end (elf);
+    }
+  close (fd);
+}
+
+// Same lookup order as the crash handler: the files found by build-id, then the
+// sections.
+static struct demangle_module *
+__vala_rt_demangle_load (struct demangle_object *object)
+{
+  struct demangle_module *module = calloc (1, sizeof (struct demangle_module));
+  if (!module)
+    {
+      return NULL;
+    }
+  module->name = object->name;
+  object->name = NULL;
+  module->base = object->base;
+  module->start = object->start;
+  module->end = object->end;
+  if (object->build_id_len)
+    {
+      const uint8_t *id = object->build_id;
+      if (__vala_rt_map_by_build_id (id, object->build_id_len, ".vdbg", &module->vdbg, &module->vdbg_size))
+        {
+          module->vdbg = NULL;
+        }
+      const uint8_t *index = NULL;
+      size_t         size = 0;
+      if (__vala_rt_map_by_build_id (id, object->build_id_len, ".vaddr", &index, &size) == 0)
+        {
+          if (__vala_rt_addr_index_valid (index, size))
+            {
+              module->addr_index = index;
+              module->addr_index_size = size;
+            }
+          else
+            {
+              munmap ((void *)index, size);
+            }
+        }
+    }
+  __vala_rt_demangle_read_elf (module);
+  return module;
+}
+
+static void
+__vala_rt_demangle_add_file (int is_pack, const uint8_t *data, size_t size, void *user_data)
+{
+  size_t *capacity = user_data;
+  if (__vala_rt_demangle_n_files == *capacity)
+    {
+      size_t                new_capacity = *capacity ? *capacity * 2 : 16;
+      struct demangle_file *grown = realloc (__vala_rt_demangle_files, new_capacity * sizeof (struct demangle_file));
+      if (!grown)
+        {
+          munmap ((void *)data, size);
+          return;
+        }
+      __vala_rt_demangle_files = grown;
+      *capacity = new_capacity;
+    }
+  struct demangle_file *file = &__vala_rt_demangle_files[__vala_rt_demangle_n_files++];
+  file->is_pack = is_pack;
+  file->data = data;
+  file->size = size;
+}
+
+static struct demangle_module *
+__vala_rt_demangle_find_loaded (const struct demangle_index *index, const struct demangle_object *object)
+{
+  for (size_t i = 0; index && i < index->n_modules; i++)
+    {
+      struct demangle_module *module = index->modules[i];
+      if (module->base == object->base && module->start == object->start && !strcmp (module->name, object->name))
+        {
+          return module;
+        }
+    }
+  return NULL;
+}
+
+static void
+__vala_rt_demangle_foreach_name (const struct demangle_index *index, name_pair_func func, void *user_data)
+{
+  for (size_t i = 0; i < index->n_modules; i++)
+    {
+      const struct demangle_module *module = index->modules[i];
+      if (module->vdbg)
+        {
+          __vala_rt_vdbg_foreach (module->vdbg, module->vdbg_size, func, user_data);
+        }
+    }
+  for (size_t i = 0; i < __vala_rt_demangle_n_files; i++)
+    {
+      const struct demangle_file *file = &__vala_rt_demangle_files[i];
+      if (file->is_pack)
+        {
+          __vala_rt_pack_foreach (file->data, file->size, func, user_data);
+        }
+      else
+        {
+          __vala_rt_vdbg_foreach (file->data, file->size, func, user_data);
+        }
+    }
+  for (size_t i = 0; i < index->n_modules; i++)
+    {
+      const struct demangle_module *module = index->modules[i];
+      if (module->section)
+        {
+          __vala_rt_section_foreach (module->section, module->section_size, func, user_data);
+        }
+    }
+}
+
+static void
+__vala_rt_demangle_count_name (__attribute__ ((unused)) const char *c_name,
+                               __attribute__ ((unused)) const char *vala_name,
+                               void                               *user_data)
+{
+  (*(size_t *)user_data)++;
+}
+
+static void
+__vala_rt_demangle_insert_name (const char *c_name, const char *vala_name, void *user_data)
+{
+  struct demangle_index *index = user_data;
+  uint32_t               hash = __vala_rt_hash_name (c_name, strlen (c_name));
+  size_t                 mask = index->names_size - 1;
+  size_t                 i = hash & mask;
+  for (; index->names[i].c_name; i = (i + 1) & mask)
+    {
+      if (index->names[i].hash == hash && !strcmp (index->names[i].c_name, c_name))
+        {
+          return;
+        }
+    }
+  index->names[i].hash = hash;
+  index->names[i].c_name = c_name;
+  index->names[i].vala_name = vala_name;
+}
+
+static void
+__vala_rt_demangle_build_names (struct demangle_index *index)
+{
+  size_t n_names = 0;
+  __vala_rt_demangle_foreach_name (index, __vala_rt_demangle_count_name, &n_names);
+  // Keep the load factor below 1/2
+  index->names_size = 16;
+  while (index->names_size < n_names * 2)
+    {
+      index->names_size *= 2;
+    }
+  index->names = calloc (index->names_size, sizeof (struct demangle_name));
+  if (index->names)
+    {
+      __vala_rt_demangle_foreach_name (index, __vala_rt_demangle_insert_name, index);
+    }
+}
+
+// Publishes a new snapshot if modules were loaded or unloaded since the current
+// one was built. Returns the current snapshot.
+static const struct demangle_index *
+__vala_rt_demangle_refresh (void)
+{
+  pthread_mutex_lock (&__vala_rt_demangle_lock);
+  struct demangle_index *current = __vala_rt_demangle_index;
+  unsigned long long     counters[2] = { 0, 0 };
+  dl_iterate_phdr (__vala_rt_demangle_counters, counters);
+  if (current && current->adds == counters[0] && current->subs == counters[1])
+    {
+      pthread_mutex_unlock (&__vala_rt_demangle_lock);
+      return current;
+    }
+  if (!current)
+    {
+      elf_version (EV_CURRENT);
+      size_t capacity = 0;
+      __vala_rt_map_search_directories (__vala_rt_demangle_add_file, &capacity);
+    }
+  struct demangle_objects objects = { NULL, 0, 0 };
+  dl_iterate_phdr (__vala_rt_demangle_collect, &objects);
+  struct demangle_index *index
+      = malloc (sizeof (struct demangle_index) + objects.n_objects * sizeof (struct demangle_module *));
+  if (index)
+    {
+      index->adds = counters[0];
+      index->subs = counters[1];
+      index->retired = NULL;
+      index->n_modules = 0;
+      for (size_t i = 0; i < objects.n_objects; i++)
+        {
+          struct demangle_module *module = __vala_rt_demangle_find_loaded (current, &objects.objects[i]);
+          module = module ? module : __vala_rt_demangle_load (&objects.objects[i]);
+          if (module)
+            {
+              index->modules[index->n_modules++] = module;
+            }
+        }
+      __vala_rt_demangle_build_names (index);
+      __atomic_store_n (&__vala_rt_demangle_index, index, __ATOMIC_SEQ_CST);
+      if (current)
+        {
+          current->retired = __vala_rt_demangle_retired;
+          __atomic_store_n (&__vala_rt_demangle_retired, current, __ATOMIC_RELAXED);
+        }
+      current = index;
+    }
+  for (size_t i = 0; i < objects.n_objects; i++)
+    {
+      free (objects.objects[i].name);
+    }
+  free (objects.objects);
+  pthread_mutex_unlock (&__vala_rt_demangle_lock);
+  return current;
+}
+
+// Returns the current snapshot, which stays valid until __vala_rt_demangle_leave,
+// like any newer one returned in the meantime.
+static const struct demangle_index *
+__vala_rt_demangle_enter (void)
+{
+  __atomic_add_fetch (&__vala_rt_demangle_readers, 1, __ATOMIC_SEQ_CST);
+  const struct demangle_index *index = __atomic_load_n (&__vala_rt_demangle_index, __ATOMIC_SEQ_CST);
+  return index ? index : __vala_rt_demangle_refresh ();
+}
+
+// Frees the retired snapshots, if no reader is left that could still use them.
+// The modules are shared with the current snapshot, so they stay.
+static void
+__vala_rt_demangle_reclaim (void)
+{
+  if (pthread_mutex_trylock (&__vala_rt_demangle_lock))
+    {
+      return;
+    }
+  struct demangle_index *retired = NULL;
+  if (!__atomic_load_n (&__vala_rt_demangle_readers, __ATOMIC_SEQ_CST))
+    {
+      retired = __vala_rt_demangle_retired;
+      __atomic_store_n (&__vala_rt_demangle_retired, NULL, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&__vala_rt_demangle_lock);
+  while (retired)
+    {
+      struct demangle_index *next = retired->retired;
+      free (retired->names);
+      free (retired);
+      retired = next;
+    }
+}
+
+static void
+__vala_rt_demangle_leave (void)
+{
+  if (__atomic_sub_fetch (&__vala_rt_demangle_readers, 1, __ATOMIC_SEQ_CST) == 0
+      && __atomic_load_n (&__vala_rt_demangle_retired, __ATOMIC_RELAXED))
+    {
+      __vala_rt_demangle_reclaim ();
+    }
+}
+
+// Returns a newer snapshot after a miss, or NULL if there is none. Only one
+// thread per interval gets to check, so misses for C functions don't all end up
+// waiting for the loader lock.
+static const struct demangle_index *
+__vala_rt_demangle_newer (const struct demangle_index *index)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  unsigned long long now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  unsigned long long last = __atomic_load_n (&__vala_rt_demangle_last_check, __ATOMIC_RELAXED);
+  if (now - last < DEMANGLE_REFRESH_INTERVAL_NS
+      || !__atomic_compare_exchange_n (
+          &__vala_rt_demangle_last_check, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      return NULL;
+    }
+  const struct demangle_index *newer = __vala_rt_demangle_refresh ();
+  return newer != index ? newer : NULL;
+}
+
+static const char *
+__vala_rt_demangle_in_module (const struct demangle_module *module, const char *c_name)
+{
+  const char *name = module->vdbg ? __vala_rt_vdbg_lookup (module->vdbg, module->vdbg_size, c_name) : NULL;
+  if (!name && module->section)
+    {
+      name = __vala_rt_find_function_internal_section (c_name, module->section, module->section_size);
+    }
+  return name;
+}
+
+static const char *
+__vala_rt_demangle_search (const struct demangle_index *index, const char *key, size_t key_len)
+{
+  uint32_t hash = __vala_rt_hash_name (key, key_len);
+  size_t   mask = index->names_size - 1;
+  for (size_t i = hash & mask; index->names[i].c_name; i = (i + 1) & mask)
+    {
+      const struct demangle_name *name = &index->names[i];
+      if (name->hash == hash && !strncmp (name->c_name, key, key_len) && !name->c_name[key_len])
+        {
+          return name->vala_name;
+        }
+    }
+  return NULL;
+}
+
+// Like the backends, "foo.constprop.0" matches "foo", if there is no entry for
+// the full name.
+static const char *
+__vala_rt_demangle_lookup (const struct demangle_index *index, const char *c_name)
+{
+  if (!index->names)
+    {
+      return NULL;
+    }
+  size_t len = strlen (c_name);
+  while (1)
+    {
+      const char *name = __vala_rt_demangle_search (index, c_name, len);
+      if (name)
+        {
+          return name;
+        }
+      while (len && c_name[len - 1] != '.')
+        {
+          len--;
+        }
+      if (len < 2)
+        {
+          return NULL;
+        }
+      len--;
+    }
+}
+
+// Like snprintf
+static int
+__vala_rt_demangle_copy (const char *name, char *out, size_t len)
+{
+  size_t name_len = strlen (name);
+  if (len)
+    {
+      size_t n = name_len < len - 1 ? name_len : len - 1;
+      memcpy (out, name, n);
+      out[n] = '\0';
+    }
+  return name_len > INT_MAX ? INT_MAX : (int)name_len;
+}
+
+int
+vala_rt_demangle (const char *c_name, char *out, size_t len)
+{
+  if (!c_name)
+    {
+      return -1;
+    }
+  const struct demangle_index *index = __vala_rt_demangle_enter ();
+  const char                  *name = index ? __vala_rt_demangle_lookup (index, c_name) : NULL;
+  if (!name && index && (index = __vala_rt_demangle_newer (index)))
+    {
+      name = __vala_rt_demangle_lookup (index, c_name);
+    }
+  // The names belong to the modules, not to the snapshot
+  __vala_rt_demangle_leave ();
+  return name ? __vala_rt_demangle_copy (name, out, len) : -1;
+}
+
+static const struct demangle_module *
+__vala_rt_demangle_module_for (const struct demangle_index *index, uintptr_t addr)
+{
+  for (size_t i = 0; i < index->n_modules; i++)
+    {
+      if (addr >= index->modules[i]->start && addr < index->modules[i]->end)
+        {
+          return index->modules[i];
+        }
+    }
+  return NULL;
+}
+
+int
+vala_rt_demangle_address (const void *addr, char *out, size_t len)
+{
+  const struct demangle_index  *index = __vala_rt_demangle_enter ();
+  const struct demangle_module *module = index ? __vala_rt_demangle_module_for (index, (uintptr_t)addr) : NULL;
+  if (!module && index && (index = __vala_rt_demangle_newer (index)))
+    {
+      module = __vala_rt_demangle_module_for (index, (uintptr_t)addr);
+    }
+  __vala_rt_demangle_leave ();
+  if (!module)
+    {
+      return -1;
+    }
+  struct vala_rt_resolved_frame resolved;
+  if (module->addr_index
+      && __vala_rt_addr_index_lookup (module->addr_index, (uintptr_t)addr - module->base, &resolved) == 0)
+    {
+      return __vala_rt_demangle_copy (resolved.function_name, out, len);
+    }
+  // Without an address index, only the dynamic symbols are known
+  Dl_info info;
+  if (!dladdr (addr, &info) || !info.dli_sname)
+    {
+      return -1;
+    }
+  const char *name = __vala_rt_demangle_in_module (module, info.dli_sname);
+  return name ? __vala_rt_demangle_copy (name, out, len) : -1;
+}
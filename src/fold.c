@@ -0,0 +1,200 @@
+/* fold.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vala-rt-internal.h"
+#include <string.h>
+
+/*
+ * Folds the frames of a stack while it is unwound, so runaway recursion
+ * neither fills the backtrace with copies of the same frames nor hides where
+ * it started. Once the last 2 * n frames are the same cycle of n frames twice
+ * (n <= MAX_CYCLE_LENGTH), the second copy is dropped and every further
+ * repetition only increments the count of the first one. If the frames still
+ * don't fit, the first FOLDED_TOP_FRAMES are kept and the rest goes through
+ * a ring of FOLDED_TAIL_FRAMES, so the outermost frames up to main are always
+ * there. The frames dropped from the ring are replaced by a placeholder.
+ * Everything is static, it runs in signal handlers.
+ */
+
+static struct vala_rt_folded_frame *
+__vala_rt_fold_at (struct vala_rt_folded_stack *stack, int i)
+{
+  if (i < stack->n_top)
+    {
+      return &stack->top[i];
+    }
+  return &stack->tail[(stack->tail_start + i - stack->n_top) % FOLDED_TAIL_FRAMES];
+}
+
+// Drops the oldest frame of the ring, or all frames of its cycle.
+static void
+__vala_rt_fold_drop (struct vala_rt_folded_stack *stack)
+{
+  const struct vala_rt_folded_frame *oldest = &stack->tail[stack->tail_start];
+  int                                n = oldest->cycle_len ? oldest->cycle_len : 1;
+  stack->n_dropped += oldest->cycle_len ? oldest->cycle_len * oldest->count : 1;
+  stack->tail_start = (stack->tail_start + n) % FOLDED_TAIL_FRAMES;
+  stack->n_tail -= n;
+  // Indices within the ring moved down by n
+  if (stack->plain_start > stack->n_top)
+    {
+      stack->plain_start = stack->plain_start - n > stack->n_top ? stack->plain_start - n : stack->n_top;
+    }
+}
+
+static void
+__vala_rt_fold_append (struct vala_rt_folded_stack *stack, uintptr_t ip)
+{
+  struct vala_rt_folded_frame *frame;
+  if (stack->n_top < FOLDED_TOP_FRAMES)
+    {
+      frame = &stack->top[stack->n_top++];
+    }
+  else
+    {
+      if (stack->n_tail == FOLDED_TAIL_FRAMES)
+        {
+          __vala_rt_fold_drop (stack);
+        }
+      frame = &stack->tail[(stack->tail_start + stack->n_tail++) % FOLDED_TAIL_FRAMES];
+    }
+  frame->ip = ip;
+  frame->cycle_len = 0;
+  frame->count = 1;
+}
+
+// Checks whether the last frames end the second copy of a cycle.
+static void
+__vala_rt_fold_find_cycle (struct vala_rt_folded_stack *stack)
+{
+  int n = stack->n_top + stack->n_tail;
+  for (int len = 1; len <= MAX_CYCLE_LENGTH && n - 2 * len >= stack->plain_start; len++)
+    {
+      // A cycle can't start in the top and end in the ring, dropping frames from
+      // the ring would cut it in half.
+      if (n - 2 * len < FOLDED_TOP_FRAMES && n - len > FOLDED_TOP_FRAMES)
+        {
+          continue;
+        }
+      int i = 0;
+      while (i < len && __vala_rt_fold_at (stack, n - 2 * len + i)->ip == __vala_rt_fold_at (stack, n - len + i)->ip)
+        {
+          i++;
+        }
+      if (i < len)
+        {
+          continue;
+        }
+      // Removes the second copy, the ring is only used once the top is full.
+      for (i = 0; i < len; i++)
+        {
+          if (stack->n_tail)
+            {
+              stack->n_tail--;
+            }
+          else
+            {
+              stack->n_top--;
+            }
+        }
+      struct vala_rt_folded_frame *first = __vala_rt_fold_at (stack, n - 2 * len);
+      first->cycle_len = len;
+      first->count = 2;
+      stack->run = n - 2 * len;
+      stack->run_pos = 0;
+      return;
+    }
+}
+
+// Ends the current cycle, the frames matching only a part of it are plain
+// frames again.
+static void
+__vala_rt_fold_end_run (struct vala_rt_folded_stack *stack)
+{
+  uintptr_t matched[MAX_CYCLE_LENGTH];
+  int       n_matched = stack->run_pos;
+  for (int i = 0; i < n_matched; i++)
+    {
+      matched[i] = __vala_rt_fold_at (stack, stack->run + i)->ip;
+    }
+  stack->plain_start = stack->n_top + stack->n_tail;
+  stack->run = -1;
+  stack->run_pos = 0;
+  for (int i = 0; i < n_matched; i++)
+    {
+      __vala_rt_fold_append (stack, matched[i]);
+    }
+}
+
+void
+__vala_rt_fold_begin (struct vala_rt_folded_stack *stack)
+{
+  stack->n_top = 0;
+  stack->tail_start = 0;
+  stack->n_tail = 0;
+  stack->n_dropped = 0;
+  stack->n_frames = 0;
+  stack->run = -1;
+  stack->run_pos = 0;
+  stack->plain_start = 0;
+  stack->n = 0;
+}
+
+void
+__vala_rt_fold_push (struct vala_rt_folded_stack *stack, uintptr_t ip)
+{
+  stack->n_frames++;
+  if (stack->run >= 0)
+    {
+      struct vala_rt_folded_frame *first = __vala_rt_fold_at (stack, stack->run);
+      if (__vala_rt_fold_at (stack, stack->run + stack->run_pos)->ip == ip)
+        {
+          if (++stack->run_pos == (int)first->cycle_len)
+            {
+              first->count++;
+              stack->run_pos = 0;
+            }
+          return;
+        }
+      __vala_rt_fold_end_run (stack);
+    }
+  __vala_rt_fold_append (stack, ip);
+  __vala_rt_fold_find_cycle (stack);
+}
+
+// Puts the frames in order into stack->frames.
+void
+__vala_rt_fold_finish (struct vala_rt_folded_stack *stack)
+{
+  if (stack->run >= 0)
+    {
+      __vala_rt_fold_end_run (stack);
+    }
+  memcpy (stack->frames, stack->top, stack->n_top * sizeof (struct vala_rt_folded_frame));
+  stack->n = stack->n_top;
+  if (stack->n_dropped)
+    {
+      stack->frames[stack->n].ip = 0;
+      stack->frames[stack->n].cycle_len = 0;
+      stack->frames[stack->n].count = stack->n_dropped;
+      stack->n++;
+    }
+  for (int i = 0; i < stack->n_tail; i++)
+    {
+      stack->frames[stack->n++] = stack->tail[(stack->tail_start + i) % FOLDED_TAIL_FRAMES];
+    }
+}
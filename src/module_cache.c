@@ -0,0 +1,500 @@
+/* module_cache.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define GNU_ZLIB_HEADER_LEN 12
+#ifndef ELFCOMPRESS_ZSTD
+#define ELFCOMPRESS_ZSTD 2
+#endif
+
+/*
+ * One Dwfl session is used for the whole crash report. All per-module work
+ * (Opening the ELF/DWARF, searching the vala sections, probing the build-id
+ * directories) is done the first time a frame hits a module and is reused for
+ * every other frame in the same module. Compressed sections are inflated at
+ * that point, too, and the .vdbg file named after the build-id is mapped.
+ * Signal mappings in a .vala_signal_mappings section are found the same way,
+ * so they cost nothing unless the process crashes. If the module has an address
+ * index, the DWARF and the Vala names are only loaded once a frame misses it.
+ * The crash session is only started by the crash handler, so it always has the
+ * modules loaded at the time of the crash.
+ */
+
+static Elf_Scn *
+__vala_rt_find_section_in_elf (Elf *, const char *, const void **, size_t *);
+static int
+__vala_rt_find_debuginfo_by_id (const unsigned char *, int, const char *);
+static void
+__vala_rt_module_fill (struct vala_rt_module *, Dwfl_Module *);
+static void
+__vala_rt_module_release (struct vala_rt_module *);
+
+static char                 *__vala_rt_debuginfo_path = NULL;
+static const Dwfl_Callbacks  __vala_rt_callbacks = {
+   .find_elf = dwfl_linux_proc_find_elf,
+   .find_debuginfo = dwfl_standard_find_debuginfo,
+   .debuginfo_path = &__vala_rt_debuginfo_path,
+};
+static const Dwfl_Callbacks  __vala_rt_offline_callbacks = {
+   .find_elf = dwfl_build_id_find_elf,
+   .find_debuginfo = dwfl_standard_find_debuginfo,
+   .section_address = dwfl_offline_section_address,
+   .debuginfo_path = &__vala_rt_debuginfo_path,
+};
+struct vala_rt_session        __vala_rt_crash_session = VALA_RT_SESSION_INIT;
+
+Dwfl *
+__vala_rt_session_begin (struct vala_rt_session *session)
+{
+  if (session->dwfl)
+    {
+      return session->dwfl;
+    }
+  session->dwfl = dwfl_begin (&__vala_rt_callbacks);
+  if (!session->dwfl)
+    {
+      return NULL;
+    }
+  dwfl_linux_proc_report (session->dwfl, getpid ());
+  dwfl_report_end (session->dwfl, NULL, NULL);
+  return session->dwfl;
+}
+
+static int
+__vala_rt_elf_has_build_id (int fd, const struct vala_rt_crash_module *crashed)
+{
+  elf_version (EV_CURRENT);
+  Elf        *elf = elf_begin (fd, ELF_C_READ_MMAP, NULL);
+  const void *id = NULL;
+  ssize_t     len = elf ? dwelf_elf_gnu_build_id (elf, &id) : -1;
+  int         matches = len > 0 && (uint32_t)len == crashed->build_id_len && !memcmp (id, crashed->build_id, len);
+  if (elf)
+    {
+      elf_end (elf);
+    }
+  return matches;
+}
+
+// Starts a session for the modules of a crash record instead of the
+// current process.
+Dwfl *
+__vala_rt_session_begin_offline (struct vala_rt_session *session, const struct vala_rt_crash_record *record)
+{
+  __vala_rt_session_end (session);
+  session->dwfl = dwfl_begin (&__vala_rt_offline_callbacks);
+  if (!session->dwfl)
+    {
+      return NULL;
+    }
+  __vala_rt_symbol_cache_use_record (record);
+  dwfl_report_begin (session->dwfl);
+  for (uint32_t i = 0; i < record->n_modules; i++)
+    {
+      const struct vala_rt_crash_module *crashed = &record->modules[i];
+      // Use the same names as /proc/pid/maps, like a live session does.
+      char        real_path[PATH_MAX] = { 0 };
+      const char *path = realpath (crashed->path, real_path) ? real_path : crashed->path;
+      int         fd = open (path, O_RDONLY | O_CLOEXEC);
+      // The file may have been replaced by another build since the crash. Its
+      // names would be wrong and end up in the symbol cache, so the crashed build
+      // is looked up by build-id instead, or the module is left out.
+      if (fd >= 0 && crashed->build_id_len && !__vala_rt_elf_has_build_id (fd, crashed))
+        {
+          close (fd);
+          fd = __vala_rt_find_debuginfo_by_id (crashed->build_id, crashed->build_id_len, "");
+          if (fd >= 0 && !__vala_rt_elf_has_build_id (fd, crashed))
+            {
+              close (fd);
+              fd = -1;
+            }
+        }
+      if (fd < 0)
+        {
+          continue;
+        }
+      // Takes ownership of the fd, unless it fails
+      if (!dwfl_report_elf (session->dwfl, path, path, fd, crashed->base, false))
+        {
+          close (fd);
+        }
+    }
+  dwfl_report_end (session->dwfl, NULL, NULL);
+  return session->dwfl;
+}
+
+void
+__vala_rt_session_end (struct vala_rt_session *session)
+{
+  for (size_t i = 0; i < session->n_modules; i++)
+    {
+      __vala_rt_module_release (&session->modules[i]);
+    }
+  __vala_rt_module_release (&session->overflow_module);
+  session->n_modules = 0;
+  __vala_rt_section_arena_reset (&session->arena);
+  if (session == &__vala_rt_crash_session)
+    {
+      __vala_rt_symbol_cache_use_record (NULL);
+    }
+  if (session->dwfl)
+    {
+      dwfl_end (session->dwfl);
+      session->dwfl = NULL;
+    }
+}
+
+struct vala_rt_module *
+__vala_rt_module_for_address (struct vala_rt_session *session, Dwarf_Addr addr)
+{
+  if (!session->dwfl)
+    {
+      return NULL;
+    }
+  Dwfl_Module *module = dwfl_addrmodule (session->dwfl, addr);
+  if (!module)
+    {
+      return NULL;
+    }
+  for (size_t i = 0; i < session->n_modules; i++)
+    {
+      if (session->modules[i].module == module)
+        {
+          return &session->modules[i];
+        }
+    }
+  struct vala_rt_module *entry = NULL;
+  if (session->n_modules == MAX_CACHED_MODULES)
+    {
+      entry = &session->overflow_module;
+      __vala_rt_module_release (entry);
+    }
+  else
+    {
+      entry = &session->modules[session->n_modules++];
+    }
+  __vala_rt_module_fill (entry, module);
+  return entry;
+}
+
+// Only finds modules a frame was in, which are all that the crash handler
+// needs signal mappings for.
+struct vala_rt_module *
+__vala_rt_module_by_name (struct vala_rt_session *session, const char *name)
+{
+  for (size_t i = 0; i < session->n_modules; i++)
+    {
+      if (session->modules[i].name && !strcmp (session->modules[i].name, name))
+        {
+          return &session->modules[i];
+        }
+    }
+  if (session->overflow_module.name && !strcmp (session->overflow_module.name, name))
+    {
+      return &session->overflow_module;
+    }
+  return NULL;
+}
+
+// Sections compressed using SHF_COMPRESSED start with a Chdr
+static void
+__vala_rt_decompress_elf_section (struct vala_rt_section_arena *arena,
+                                  struct vala_rt_module        *entry,
+                                  Elf                          *elf,
+                                  Elf_Scn                      *scn)
+{
+  GElf_Chdr chdr;
+  if (!gelf_getchdr (scn, &chdr))
+    {
+      entry->section_data = NULL;
+      return;
+    }
+  size_t header_len = gelf_getclass (elf) == ELFCLASS32 ? sizeof (Elf32_Chdr) : sizeof (Elf64_Chdr);
+  int    compression = -1;
+  if (chdr.ch_type == ELFCOMPRESS_ZLIB)
+    {
+      compression = VALA_RT_SECTION_ZLIB;
+    }
+  else if (chdr.ch_type == ELFCOMPRESS_ZSTD)
+    {
+      compression = VALA_RT_SECTION_ZSTD;
+    }
+  if (compression == -1 || entry->section_size < header_len)
+    {
+      entry->section_data = NULL;
+      return;
+    }
+  entry->section_data = __vala_rt_section_decompress (arena,
+                                                      compression,
+                                                      (const uint8_t *)entry->section_data + header_len,
+                                                      entry->section_size - header_len,
+                                                      chdr.ch_size);
+  entry->section_size = chdr.ch_size;
+}
+
+// .zdebug sections start with "ZLIB" and the big endian uncompressed size.
+static void
+__vala_rt_decompress_gnu_section (struct vala_rt_section_arena *arena, struct vala_rt_module *entry)
+{
+  const uint8_t *data = entry->section_data;
+  if (entry->section_size < GNU_ZLIB_HEADER_LEN || memcmp (data, "ZLIB", 4))
+    {
+      entry->section_data = NULL;
+      return;
+    }
+  uint64_t size;
+  memcpy (&size, &data[4], sizeof (size));
+  size = be64toh (size);
+  entry->section_data = __vala_rt_section_decompress (
+      arena, VALA_RT_SECTION_ZLIB, &data[GNU_ZLIB_HEADER_LEN], entry->section_size - GNU_ZLIB_HEADER_LEN, size);
+  entry->section_size = size;
+}
+
+static void
+__vala_rt_find_vala_section (struct vala_rt_section_arena *arena, struct vala_rt_module *entry, Elf *elf)
+{
+  Elf_Scn *scn = __vala_rt_find_section_in_elf (elf, ".debug_info_vala", &entry->section_data, &entry->section_size);
+  if (entry->section_data)
+    {
+      GElf_Shdr shdr;
+      if (gelf_getshdr (scn, &shdr) && (shdr.sh_flags & SHF_COMPRESSED))
+        {
+          __vala_rt_decompress_elf_section (arena, entry, elf, scn);
+        }
+      return;
+    }
+  __vala_rt_find_section_in_elf (elf, ".zdebug_info_vala", &entry->section_data, &entry->section_size);
+  if (entry->section_data)
+    {
+      __vala_rt_decompress_gnu_section (arena, entry);
+    }
+}
+
+// An address index is either embedded or installed next to the .vdbg files.
+static void
+__vala_rt_find_addr_index (struct vala_rt_module *entry)
+{
+  const void *data = NULL;
+  size_t      size = 0;
+  if (entry->elf)
+    {
+      __vala_rt_find_section_in_elf (entry->elf, ADDR_INDEX_SECTION_NAME, &data, &size);
+    }
+  if (data && __vala_rt_addr_index_valid (data, size))
+    {
+      entry->addr_index_data = data;
+      entry->addr_index_size = size;
+      return;
+    }
+  if (entry->build_id_len <= 0 || entry->build_id_len > MAX_BUILD_ID_LEN)
+    {
+      return;
+    }
+  const uint8_t *mapped = NULL;
+  if (__vala_rt_map_by_build_id (entry->build_id, entry->build_id_len, ".vaddr", &mapped, &size))
+    {
+      return;
+    }
+  if (!__vala_rt_addr_index_valid (mapped, size))
+    {
+      munmap ((void *)mapped, size);
+      return;
+    }
+  entry->addr_index_data = mapped;
+  entry->addr_index_size = size;
+  entry->addr_index_mapped = 1;
+}
+
+// Only does what is needed for the address index and the signal mappings, the
+// rest is done by __vala_rt_module_load_debug_info.
+static void
+__vala_rt_module_fill (struct vala_rt_module *entry, Dwfl_Module *module)
+{
+  memset (entry, 0, sizeof (*entry));
+  entry->module = module;
+  entry->debug_fd = -1;
+  entry->name = dwfl_module_info (module, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  entry->elf = dwfl_module_getelf (module, &entry->bias);
+  GElf_Addr build_id_addr = 0;
+  entry->build_id_len = dwfl_module_build_id (module, &entry->build_id, &build_id_addr);
+  if (entry->elf)
+    {
+      __vala_rt_find_section_in_elf (entry->elf, SIGNAL_SECTION_NAME, &entry->signal_data, &entry->signal_size);
+    }
+  __vala_rt_find_addr_index (entry);
+}
+
+// Loads the DWARF and searches every backend for the Vala names. Only needed
+// for frames that are not in the address index.
+void
+__vala_rt_module_load_debug_info (struct vala_rt_session *session, struct vala_rt_module *entry)
+{
+  if (entry->debug_info_loaded)
+    {
+      return;
+    }
+  entry->debug_info_loaded = 1;
+  Dwarf_Addr bias;
+  entry->dwarf = dwfl_module_getdwarf (entry->module, &bias);
+  entry->alt_dwarf = entry->dwarf ? dwarf_getalt (entry->dwarf) : NULL;
+  if (entry->build_id_len > 0 && entry->build_id_len <= MAX_BUILD_ID_LEN)
+    {
+      __vala_rt_map_by_build_id (entry->build_id, entry->build_id_len, ".vdbg", &entry->vdbg_data, &entry->vdbg_size);
+    }
+  if (entry->elf)
+    {
+      __vala_rt_find_vala_section (&session->arena, entry, entry->elf);
+    }
+  if (!entry->section_data && entry->alt_dwarf)
+    {
+      Elf *alt_elf = dwarf_getelf (entry->alt_dwarf);
+      if (alt_elf)
+        {
+          __vala_rt_find_vala_section (&session->arena, entry, alt_elf);
+        }
+    }
+  if (!entry->section_data)
+    {
+      entry->debug_fd = __vala_rt_find_debuginfo_by_id (entry->build_id, entry->build_id_len, ".debug");
+      if (entry->debug_fd >= 0)
+        {
+          entry->debug_elf = elf_begin (entry->debug_fd, ELF_C_READ, NULL);
+          if (entry->debug_elf)
+            {
+              __vala_rt_find_vala_section (&session->arena, entry, entry->debug_elf);
+            }
+        }
+    }
+}
+
+static void
+__vala_rt_module_release (struct vala_rt_module *entry)
+{
+  if (entry->debug_elf)
+    {
+      elf_end (entry->debug_elf);
+    }
+  if (entry->debug_fd >= 0)
+    {
+      close (entry->debug_fd);
+    }
+  if (entry->vdbg_data)
+    {
+      munmap ((void *)entry->vdbg_data, entry->vdbg_size);
+    }
+  if (entry->addr_index_mapped)
+    {
+      munmap ((void *)entry->addr_index_data, entry->addr_index_size);
+    }
+  memset (entry, 0, sizeof (*entry));
+  entry->debug_fd = -1;
+}
+
+static Elf_Scn *
+__vala_rt_find_section_in_elf (Elf *elf, const char *sname, const void **ptr, size_t *len)
+{
+  size_t num_sections = 0;
+  elf_getshdrnum (elf, &num_sections);
+  size_t shstrndx;
+  elf_getshdrstrndx (elf, &shstrndx);
+  for (size_t i = 0; i < num_sections; i++)
+    {
+      Elf_Scn  *scn = elf_getscn (elf, i);
+      GElf_Shdr shdr;
+      if (!gelf_getshdr (scn, &shdr))
+        {
+          continue;
+        }
+      const char *name = elf_strptr (elf, shstrndx, shdr.sh_name);
+      if (name && !strcmp (sname, name))
+        {
+          Elf_Data *data = NULL;
+          data = elf_rawdata (scn, data);
+          if (data)
+            {
+              *ptr = data->d_buf;
+              *len = data->d_size;
+            }
+          return scn;
+        }
+    }
+  return NULL;
+}
+
+// Writes "xx/yyyy..." for the build-id, the layout used by all .build-id directories.
+void
+__vala_rt_format_build_id (char *into, const unsigned char *id, int len)
+{
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 0; i < len; i++)
+    {
+      *into++ = digits[id[i] >> 4 & 0xf];
+      *into++ = digits[id[i] & 0xf];
+      if (i == 0)
+        {
+          *into++ = '/';
+        }
+    }
+  *into = '\0';
+}
+
+// Last resort, guessing and hoping the best. Without an extension, the link to
+// the binary itself is opened.
+static int
+__vala_rt_find_debuginfo_by_id (const unsigned char *id, int len, const char *extension)
+{
+  if (len <= 0 || len > MAX_BUILD_ID_LEN)
+    {
+      return -1;
+    }
+  __vala_rt_init_debuginfod_locations ();
+  char        path[512];
+  const char *prefixes_to_try[6]
+      = { "/usr/lib/debug/.build-id/",       "/usr/local/lib/debug/.build-id/", "/app/lib/debug/.build-id/",
+          "/app/local/lib/debug/.build-id/", __vala_rt_debuginfod_location1,    __vala_rt_debuginfod_location2 };
+
+  for (size_t i = 0; i < sizeof (prefixes_to_try) / sizeof (prefixes_to_try[0]); i++)
+    {
+      if (!prefixes_to_try[i][0])
+        {
+          continue;
+        }
+      memset (path, 0, sizeof (path));
+      strcat (path, prefixes_to_try[i]);
+      __vala_rt_format_build_id (&path[strlen (path)], id, len);
+      strcat (path, extension);
+      int fd = open (path, O_RDONLY);
+      if (fd < 0)
+        {
+          continue;
+        }
+      return fd;
+    }
+  return -1;
+}
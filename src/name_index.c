@@ -0,0 +1,168 @@
+/* name_index.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include <string.h>
+
+/*
+ * Lookup in a sorted table of (C name, Vala name) string offsets, as used by the
+ * indexed formats.
+ */
+
+static int
+__vala_rt_compare_prefix (const char *key, size_t key_len, const char *str)
+{
+  int ret = strncmp (key, str, key_len);
+  if (ret)
+    {
+      return ret;
+    }
+  return str[key_len] ? -1 : 0;
+}
+
+static const char *
+__vala_rt_name_index_search (const struct vala_rt_name_index *index, const char *key, size_t key_len)
+{
+  size_t lo = 0;
+  size_t hi = index->n_entries;
+  while (lo < hi)
+    {
+      size_t         mid = lo + (hi - lo) / 2;
+      const uint8_t *entry = index->entries + mid * sizeof (struct vala_rt_name_index_entry);
+      uint32_t       c_name = __vala_rt_read_be32 (entry);
+      if (c_name >= index->strings_size)
+        {
+          return NULL;
+        }
+      int cmp = __vala_rt_compare_prefix (key, key_len, &index->strings[c_name]);
+      if (cmp == 0)
+        {
+          uint32_t vala_name = __vala_rt_read_be32 (entry + sizeof (uint32_t));
+          return vala_name < index->strings_size ? &index->strings[vala_name] : NULL;
+        }
+      if (cmp < 0)
+        {
+          hi = mid;
+        }
+      else
+        {
+          lo = mid + 1;
+        }
+    }
+  return NULL;
+}
+
+int
+__vala_rt_name_index_init (struct vala_rt_name_index *index,
+                           const uint8_t             *base,
+                           size_t                     len,
+                           uint32_t                   n_entries,
+                           uint32_t                   index_offset,
+                           uint32_t                   strings_offset,
+                           uint32_t                   strings_size)
+{
+  size_t index_size = (size_t)n_entries * sizeof (struct vala_rt_name_index_entry);
+  if (index_offset > len || index_size > len - index_offset)
+    {
+      return 0;
+    }
+  if (strings_offset > len || strings_size > len - strings_offset)
+    {
+      return 0;
+    }
+  // The blob has to end with a NUL, so no lookup can run past it.
+  if (!strings_size || base[strings_offset + strings_size - 1])
+    {
+      return 0;
+    }
+  index->entries = base + index_offset;
+  index->n_entries = n_entries;
+  index->strings = (const char *)base + strings_offset;
+  index->strings_size = strings_size;
+  return 1;
+}
+
+// Like the linear formats, "foo.constprop.0" or "foo.isra.0" will match "foo",
+// if there is no entry for the full name.
+const char *
+__vala_rt_name_index_find (const struct vala_rt_name_index *index, const char *function)
+{
+  size_t len = strlen (function);
+  while (1)
+    {
+      const char *r = __vala_rt_name_index_search (index, function, len);
+      if (r)
+        {
+          return r;
+        }
+      while (len && function[len - 1] != '.')
+        {
+          len--;
+        }
+      if (len < 2)
+        {
+          return NULL;
+        }
+      len--;
+    }
+}
+
+// Calls func for every entry, in the order of the index.
+void
+__vala_rt_name_index_foreach (const struct vala_rt_name_index *index, name_pair_func func, void *user_data)
+{
+  for (uint32_t i = 0; i < index->n_entries; i++)
+    {
+      const uint8_t *entry = index->entries + (size_t)i * sizeof (struct vala_rt_name_index_entry);
+      uint32_t       c_name = __vala_rt_read_be32 (entry);
+      uint32_t       vala_name = __vala_rt_read_be32 (entry + sizeof (uint32_t));
+      if (c_name < index->strings_size && vala_name < index->strings_size)
+        {
+          func (&index->strings[c_name], &index->strings[vala_name], user_data);
+        }
+    }
+}
+
+// Looks up a signal handler in a .vala_signal_mappings section.
+const char *
+__vala_rt_signal_section_lookup (const uint8_t *data, size_t size, const char *function)
+{
+  if (size < sizeof (struct vala_rt_signal_section_header))
+    {
+      return NULL;
+    }
+  const struct vala_rt_signal_section_header *header = (const struct vala_rt_signal_section_header *)data;
+  if (memcmp (header->magic, SIGNAL_SECTION_MAGIC, sizeof (header->magic))
+      || header->version != SIGNAL_SECTION_VERSION)
+    {
+      return NULL;
+    }
+  struct vala_rt_name_index index;
+  if (!__vala_rt_name_index_init (&index,
+                                  data,
+                                  size,
+                                  __vala_rt_read_be32 (&header->n_entries),
+                                  __vala_rt_read_be32 (&header->index_offset),
+                                  __vala_rt_read_be32 (&header->strings_offset),
+                                  __vala_rt_read_be32 (&header->strings_size)))
+    {
+      return NULL;
+    }
+  return __vala_rt_name_index_find (&index, function);
+}
@@ -0,0 +1,430 @@
+/* profiler.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define MAX_PROFILED_THREADS 64
+#define MAX_PROFILE_DEPTH 64
+#define PROFILE_RING_SIZE 1024
+#define PROFILE_FLUSH_INTERVAL_MS 100
+#define DEFAULT_PROFILE_FREQUENCY 99
+#define MAX_PROFILE_FREQUENCY 10000
+
+/*
+ * The SIGPROF handler only unwinds into a ring buffer owned by the interrupted
+ * thread. Rings are claimed from a preallocated pool the first time a thread
+ * is sampled and have a single producer (the thread) and a single consumer
+ * (the flusher thread), so no locks are needed. When the thread exits, its ring
+ * is retired and returned to the pool once the flusher has drained it. The flusher aggregates the
+ * samples by stack, and when profiling stops, every distinct address is
+ * symbolized once and the stacks are written as folded stacks
+ * ("main;Foo.Bar.do_thing;g_main_loop_run 42"), as used by flamegraph.pl.
+ */
+
+struct profile_sample
+{
+  uint32_t  n_frames;
+  uintptr_t ips[MAX_PROFILE_DEPTH];
+};
+
+enum profile_ring_state
+{
+  PROFILE_RING_FREE,
+  // Owned by a thread
+  PROFILE_RING_CLAIMED,
+  // The thread exited, freed by the flusher after draining it
+  PROFILE_RING_RETIRED,
+};
+
+struct profile_ring
+{
+  int state;
+  // Written by the sampled thread
+  size_t                head;
+  // Written by the flusher
+  size_t                tail;
+  struct profile_sample samples[PROFILE_RING_SIZE];
+};
+
+struct folded_stack
+{
+  uint64_t   hash;
+  uint32_t   n_frames;
+  uint64_t   count;
+  uintptr_t *ips;
+};
+
+static struct profile_ring *__vala_rt_profile_rings = NULL;
+static size_t               __vala_rt_profile_dropped = 0;
+static int                  __vala_rt_profiling = 0;
+static char                *__vala_rt_profile_path = NULL;
+static pthread_t            __vala_rt_profile_flusher;
+static struct folded_stack *__vala_rt_folded_stacks = NULL;
+static size_t               __vala_rt_folded_stacks_size = 0;
+static size_t               __vala_rt_folded_stacks_used = 0;
+static pthread_once_t       __vala_rt_profile_key_once = PTHREAD_ONCE_INIT;
+// Its destructor retires the ring of an exiting thread
+static pthread_key_t        __vala_rt_profile_key;
+static int                  __vala_rt_profile_key_created = 0;
+static __thread struct profile_ring *__vala_rt_profile_ring __attribute__ ((tls_model ("initial-exec"))) = NULL;
+
+static void
+__vala_rt_retire_ring (void *data)
+{
+  // A sample after this would claim a new ring
+  sigset_t set;
+  sigemptyset (&set);
+  sigaddset (&set, SIGPROF);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+  struct profile_ring *ring = data;
+  __vala_rt_profile_ring = NULL;
+  __atomic_store_n (&ring->state, PROFILE_RING_RETIRED, __ATOMIC_RELEASE);
+}
+
+static void
+__vala_rt_create_profile_key (void)
+{
+  __vala_rt_profile_key_created = pthread_key_create (&__vala_rt_profile_key, __vala_rt_retire_ring) == 0;
+}
+
+// Takes the first free ring, so at most MAX_PROFILED_THREADS attempts.
+static struct profile_ring *
+__vala_rt_claim_ring (void)
+{
+  for (int i = 0; i < MAX_PROFILED_THREADS; i++)
+    {
+      struct profile_ring *ring = &__vala_rt_profile_rings[i];
+      int                  expected = PROFILE_RING_FREE;
+      if (__atomic_load_n (&ring->state, __ATOMIC_RELAXED) == PROFILE_RING_FREE
+          && __atomic_compare_exchange_n (
+              &ring->state, &expected, PROFILE_RING_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+          return ring;
+        }
+    }
+  return NULL;
+}
+
+static void
+__vala_rt_handle_sigprof (__attribute__ ((unused)) int        signum,
+                          __attribute__ ((unused)) siginfo_t *info,
+                          void                               *_ctx)
+{
+  if (!__atomic_load_n (&__vala_rt_profiling, __ATOMIC_ACQUIRE))
+    {
+      return;
+    }
+  struct profile_ring *ring = __vala_rt_profile_ring;
+  if (!ring)
+    {
+      ring = __vala_rt_claim_ring ();
+      if (!ring)
+        {
+          __atomic_fetch_add (&__vala_rt_profile_dropped, 1, __ATOMIC_RELAXED);
+          return;
+        }
+      // The keys of glibc below PTHREAD_KEY_2NDLEVEL_SIZE never allocate
+      pthread_setspecific (__vala_rt_profile_key, ring);
+      __vala_rt_profile_ring = ring;
+    }
+  size_t head = ring->head;
+  if (head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) == PROFILE_RING_SIZE)
+    {
+      __atomic_fetch_add (&__vala_rt_profile_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  struct profile_sample *sample = &ring->samples[head % PROFILE_RING_SIZE];
+  sample->n_frames = __vala_rt_capture_frames (_ctx, sample->ips, MAX_PROFILE_DEPTH);
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t
+__vala_rt_hash_stack (const uintptr_t *ips, uint32_t n_frames)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < n_frames; i++)
+    {
+      hash ^= ips[i];
+      hash *= 1099511628211ULL;
+    }
+  return hash ? hash : 1;
+}
+
+static int
+__vala_rt_folded_stacks_grow (void)
+{
+  size_t               new_size = __vala_rt_folded_stacks_size ? __vala_rt_folded_stacks_size * 2 : 1024;
+  struct folded_stack *new_stacks = calloc (new_size, sizeof (struct folded_stack));
+  if (!new_stacks)
+    {
+      return -1;
+    }
+  for (size_t i = 0; i < __vala_rt_folded_stacks_size; i++)
+    {
+      if (!__vala_rt_folded_stacks[i].hash)
+        {
+          continue;
+        }
+      size_t j = __vala_rt_folded_stacks[i].hash & (new_size - 1);
+      while (new_stacks[j].hash)
+        {
+          j = (j + 1) & (new_size - 1);
+        }
+      new_stacks[j] = __vala_rt_folded_stacks[i];
+    }
+  free (__vala_rt_folded_stacks);
+  __vala_rt_folded_stacks = new_stacks;
+  __vala_rt_folded_stacks_size = new_size;
+  return 0;
+}
+
+static void
+__vala_rt_fold_sample (const struct profile_sample *sample)
+{
+  if (!sample->n_frames)
+    {
+      return;
+    }
+  if ((__vala_rt_folded_stacks_used + 1) * 2 > __vala_rt_folded_stacks_size && __vala_rt_folded_stacks_grow ())
+    {
+      return;
+    }
+  uint64_t hash = __vala_rt_hash_stack (sample->ips, sample->n_frames);
+  size_t   mask = __vala_rt_folded_stacks_size - 1;
+  size_t   i = hash & mask;
+  for (; __vala_rt_folded_stacks[i].hash; i = (i + 1) & mask)
+    {
+      struct folded_stack *stack = &__vala_rt_folded_stacks[i];
+      if (stack->hash == hash && stack->n_frames == sample->n_frames
+          && !memcmp (stack->ips, sample->ips, sample->n_frames * sizeof (uintptr_t)))
+        {
+          stack->count++;
+          return;
+        }
+    }
+  uintptr_t *ips = malloc (sample->n_frames * sizeof (uintptr_t));
+  if (!ips)
+    {
+      return;
+    }
+  memcpy (ips, sample->ips, sample->n_frames * sizeof (uintptr_t));
+  __vala_rt_folded_stacks[i].hash = hash;
+  __vala_rt_folded_stacks[i].n_frames = sample->n_frames;
+  __vala_rt_folded_stacks[i].count = 1;
+  __vala_rt_folded_stacks[i].ips = ips;
+  __vala_rt_folded_stacks_used++;
+}
+
+static void
+__vala_rt_drain_rings (void)
+{
+  for (int i = 0; i < MAX_PROFILED_THREADS; i++)
+    {
+      struct profile_ring *ring = &__vala_rt_profile_rings[i];
+      int                  state = __atomic_load_n (&ring->state, __ATOMIC_ACQUIRE);
+      if (state == PROFILE_RING_FREE)
+        {
+          continue;
+        }
+      size_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+      for (size_t tail = ring->tail; tail != head; tail++)
+        {
+          __vala_rt_fold_sample (&ring->samples[tail % PROFILE_RING_SIZE]);
+        }
+      __atomic_store_n (&ring->tail, head, __ATOMIC_RELEASE);
+      // Nothing is written to a retired ring anymore, so it is empty now
+      if (state == PROFILE_RING_RETIRED)
+        {
+          __atomic_store_n (&ring->state, PROFILE_RING_FREE, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void *
+__vala_rt_profile_flush_loop (__attribute__ ((unused)) void *data)
+{
+  struct timespec interval = { 0, PROFILE_FLUSH_INTERVAL_MS * 1000 * 1000 };
+  while (__atomic_load_n (&__vala_rt_profiling, __ATOMIC_ACQUIRE))
+    {
+      __vala_rt_drain_rings ();
+      nanosleep (&interval, NULL);
+    }
+  return NULL;
+}
+
+static void
+__vala_rt_write_frame (FILE *file, const struct vala_rt_frame *frame)
+{
+  const char *name = frame->function_name;
+  if (name)
+    {
+      // ';' separates frames and the last space the count
+      for (const char *c = name; *c; c++)
+        {
+          fputc (*c == ';' || *c == ' ' ? '_' : *c, file);
+        }
+    }
+  else if (frame->library_name)
+    {
+      const char *slash = strrchr (frame->library_name, '/');
+      fprintf (file, "[%s]", slash ? slash + 1 : frame->library_name);
+    }
+  else
+    {
+      fprintf (file, "0x%lx", (unsigned long)frame->ip);
+    }
+}
+
+static int
+__vala_rt_write_folded_stacks (const char *path)
+{
+  FILE *file = fopen (path, "we");
+  if (!file)
+    {
+      return -1;
+    }
+  struct vala_rt_frame frames[MAX_PROFILE_DEPTH];
+  for (size_t i = 0; i < __vala_rt_folded_stacks_size; i++)
+    {
+      const struct folded_stack *stack = &__vala_rt_folded_stacks[i];
+      if (!stack->hash || !stack->n_frames)
+        {
+          continue;
+        }
+      vala_rt_backtrace_symbolize ((void *const *)stack->ips, stack->n_frames, frames);
+      // Folded stacks start at the root
+      for (int j = stack->n_frames - 1; j >= 0; j--)
+        {
+          __vala_rt_write_frame (file, &frames[j]);
+          fputc (j ? ';' : ' ', file);
+        }
+      fprintf (file, "%lu\n", (unsigned long)stack->count);
+    }
+  return fclose (file);
+}
+
+int
+vala_rt_profiler_start (const char *path, int frequency)
+{
+  if (__vala_rt_profiling || !path)
+    {
+      return -1;
+    }
+  if (frequency <= 0)
+    {
+      frequency = DEFAULT_PROFILE_FREQUENCY;
+    }
+  frequency = frequency < MAX_PROFILE_FREQUENCY ? frequency : MAX_PROFILE_FREQUENCY;
+  if (!__vala_rt_profile_rings)
+    {
+      void *rings = mmap (NULL, MAX_PROFILED_THREADS * sizeof (struct profile_ring), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (rings == MAP_FAILED)
+        {
+          return -1;
+        }
+      __vala_rt_profile_rings = rings;
+    }
+  pthread_once (&__vala_rt_profile_key_once, __vala_rt_create_profile_key);
+  if (!__vala_rt_profile_key_created)
+    {
+      return -1;
+    }
+  char *profile_path = strdup (path);
+  if (!profile_path)
+    {
+      return -1;
+    }
+  free (__vala_rt_profile_path);
+  __vala_rt_profile_path = profile_path;
+  __atomic_store_n (&__vala_rt_profiling, 1, __ATOMIC_RELEASE);
+  if (pthread_create (&__vala_rt_profile_flusher, NULL, __vala_rt_profile_flush_loop, NULL))
+    {
+      __atomic_store_n (&__vala_rt_profiling, 0, __ATOMIC_RELEASE);
+      return -1;
+    }
+  struct sigaction action;
+  memset (&action, 0, sizeof action);
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigfillset (&action.sa_mask);
+  action.sa_sigaction = __vala_rt_handle_sigprof;
+  sigaction (SIGPROF, &action, NULL);
+  struct itimerval timer = { { 0, 1000000 / frequency }, { 0, 1000000 / frequency } };
+  setitimer (ITIMER_PROF, &timer, NULL);
+  return 0;
+}
+
+int
+vala_rt_profiler_stop (void)
+{
+  if (!__vala_rt_profiling)
+    {
+      return -1;
+    }
+  struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+  setitimer (ITIMER_PROF, &timer, NULL);
+  __atomic_store_n (&__vala_rt_profiling, 0, __ATOMIC_RELEASE);
+  pthread_join (__vala_rt_profile_flusher, NULL);
+  __vala_rt_drain_rings ();
+  int ret = __vala_rt_write_folded_stacks (__vala_rt_profile_path);
+  for (size_t i = 0; i < __vala_rt_folded_stacks_size; i++)
+    {
+      free (__vala_rt_folded_stacks[i].ips);
+    }
+  free (__vala_rt_folded_stacks);
+  __vala_rt_folded_stacks = NULL;
+  __vala_rt_folded_stacks_size = 0;
+  __vala_rt_folded_stacks_used = 0;
+  size_t dropped = __atomic_exchange_n (&__vala_rt_profile_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped)
+    {
+      fprintf (stderr, "vala-rt: Dropped %lu samples while profiling\n", (unsigned long)dropped);
+    }
+  return ret;
+}
+
+static void
+__vala_rt_profiler_atexit (void)
+{
+  vala_rt_profiler_stop ();
+}
+
+// Started by __vala_init if VALA_RT_PROFILE is set
+void
+__vala_rt_profiler_start_from_env (void)
+{
+  const char *path = getenv ("VALA_RT_PROFILE");
+  if (!path || !path[0])
+    {
+      return;
+    }
+  const char *frequency = getenv ("VALA_RT_PROFILE_FREQUENCY");
+  if (vala_rt_profiler_start (path, frequency ? atoi (frequency) : 0) == 0)
+    {
+      atexit (__vala_rt_profiler_atexit);
+    }
+}
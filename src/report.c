@@ -0,0 +1,605 @@
+/* report.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define REPORT_BUFFER_SIZE (64 * 1024)
+#define REPORT_MAX_IOVECS 1024
+#define SPACES_SIZE 256
+// Shorter padding is copied, as a separate iovec would cost more.
+#define MIN_SHARED_PADDING 16
+#define FINGERPRINT_BASIS 14695981039346656037ULL
+
+/*
+ * Crash reports are formatted into a preallocated buffer, without stdio or
+ * malloc, and written using writev when the report is complete, so a report
+ * costs a few syscalls instead of several per frame and isn't interleaved
+ * with the output of other threads. The buffer is described by a list of
+ * iovecs, so long padding can point to a block of spaces instead of being
+ * copied. If the buffer or the list is full, it is flushed early.
+ *
+ * There is a single buffer, as only the crashing thread (or the crash helper)
+ * writes reports.
+ *
+ * Besides the text for humans, reports can be written as JSON Lines or as
+ * binary records (see vala-rt-format.h) for crash aggregation. Both end with
+ * a fingerprint of the stack, an FNV-1a hash over the library basenames and
+ * function names of all frames that aren't skipped, so crashes can be
+ * deduplicated without symbolizing them again. It doesn't depend on addresses,
+ * so it is the same across runs and machines for the same build.
+ */
+
+static char         __vala_rt_report_buffer[REPORT_BUFFER_SIZE];
+static size_t       __vala_rt_report_used = 0;
+static struct iovec __vala_rt_report_iovecs[REPORT_MAX_IOVECS];
+static int          __vala_rt_report_n_iovecs = 0;
+static char         __vala_rt_spaces[SPACES_SIZE];
+static int          __vala_rt_report_fd = STDERR_FILENO;
+static int          __vala_rt_report_owns_fd = 0;
+// Opened when the first report is written
+static char         __vala_rt_report_path[PATH_MAX] = { 0 };
+static uint64_t     __vala_rt_report_fingerprint = FINGERPRINT_BASIS;
+static int          __vala_rt_report_n_frames = 0;
+int                 __vala_rt_report_format = VALA_RT_REPORT_TEXT;
+
+void
+vala_rt_set_report_fd (int fd)
+{
+  if (__vala_rt_report_owns_fd)
+    {
+      close (__vala_rt_report_fd);
+    }
+  __vala_rt_report_owns_fd = 0;
+  __vala_rt_report_path[0] = '\0';
+  __vala_rt_report_fd = fd < 0 ? STDERR_FILENO : fd;
+}
+
+void
+vala_rt_set_report_file (const char *path)
+{
+  vala_rt_set_report_fd (-1);
+  if (path)
+    {
+      strncpy (__vala_rt_report_path, path, sizeof (__vala_rt_report_path) - 1);
+      __vala_rt_report_fd = -1;
+    }
+}
+
+// VALA_RT_REPORT_FILE and VALA_RT_REPORT_FORMAT, read by __vala_init and
+// vala-rt-symbolize.
+void
+__vala_rt_report_settings_from_env (void)
+{
+  const char *report_file = getenv ("VALA_RT_REPORT_FILE");
+  if (report_file)
+    {
+      vala_rt_set_report_file (report_file);
+    }
+  const char *report_format = getenv ("VALA_RT_REPORT_FORMAT");
+  if (report_format && !strcmp (report_format, "json"))
+    {
+      vala_rt_set_report_format (VALA_RT_REPORT_JSON);
+    }
+  else if (report_format && !strcmp (report_format, "binary"))
+    {
+      vala_rt_set_report_format (VALA_RT_REPORT_BINARY);
+    }
+}
+
+// The descriptor the report is written to, -1 if a report file is set but not
+// opened yet.
+int
+__vala_rt_report_get_fd (void)
+{
+  return __vala_rt_report_fd;
+}
+
+static int
+__vala_rt_report_open (void)
+{
+  if (__vala_rt_report_fd < 0)
+    {
+      __vala_rt_report_fd = open (__vala_rt_report_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+      __vala_rt_report_owns_fd = __vala_rt_report_fd >= 0;
+    }
+  return __vala_rt_report_fd < 0 ? STDERR_FILENO : __vala_rt_report_fd;
+}
+
+// Writes everything appended so far.
+void
+__vala_rt_report_flush (void)
+{
+  int           fd = __vala_rt_report_open ();
+  struct iovec *iov = __vala_rt_report_iovecs;
+  int           n = __vala_rt_report_n_iovecs;
+  while (n > 0)
+    {
+      ssize_t written = writev (fd, iov, n);
+      if (written < 0 && errno == EINTR)
+        {
+          continue;
+        }
+      if (written <= 0)
+        {
+          break;
+        }
+      // A partial write may end within an iovec
+      while (n && (size_t)written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          iov++;
+          n--;
+        }
+      if (n)
+        {
+          iov->iov_base = (char *)iov->iov_base + written;
+          iov->iov_len -= written;
+        }
+    }
+  __vala_rt_report_used = 0;
+  __vala_rt_report_n_iovecs = 0;
+}
+
+// There must be room for another iovec.
+static void
+__vala_rt_report_add_iovec (const char *data, size_t len)
+{
+  if (__vala_rt_report_n_iovecs)
+    {
+      struct iovec *last = &__vala_rt_report_iovecs[__vala_rt_report_n_iovecs - 1];
+      if ((const char *)last->iov_base + last->iov_len == data)
+        {
+          last->iov_len += len;
+          return;
+        }
+    }
+  __vala_rt_report_iovecs[__vala_rt_report_n_iovecs].iov_base = (void *)data;
+  __vala_rt_report_iovecs[__vala_rt_report_n_iovecs].iov_len = len;
+  __vala_rt_report_n_iovecs++;
+}
+
+void
+__vala_rt_report_append (const char *data, size_t len)
+{
+  while (len)
+    {
+      if (__vala_rt_report_used == REPORT_BUFFER_SIZE || __vala_rt_report_n_iovecs == REPORT_MAX_IOVECS)
+        {
+          __vala_rt_report_flush ();
+        }
+      size_t n = REPORT_BUFFER_SIZE - __vala_rt_report_used;
+      n = n < len ? n : len;
+      char *into = &__vala_rt_report_buffer[__vala_rt_report_used];
+      memcpy (into, data, n);
+      __vala_rt_report_used += n;
+      __vala_rt_report_add_iovec (into, n);
+      data += n;
+      len -= n;
+    }
+}
+
+void
+__vala_rt_report_string (const char *str)
+{
+  __vala_rt_report_append (str, strlen (str));
+}
+
+// Appends n spaces.
+void
+__vala_rt_report_pad (size_t n)
+{
+  if (!__vala_rt_spaces[0])
+    {
+      memset (__vala_rt_spaces, ' ', sizeof (__vala_rt_spaces));
+    }
+  if (n < MIN_SHARED_PADDING)
+    {
+      __vala_rt_report_append (__vala_rt_spaces, n);
+      return;
+    }
+  while (n)
+    {
+      if (__vala_rt_report_n_iovecs == REPORT_MAX_IOVECS)
+        {
+          __vala_rt_report_flush ();
+        }
+      size_t chunk = n < SPACES_SIZE ? n : SPACES_SIZE;
+      __vala_rt_report_add_iovec (__vala_rt_spaces, chunk);
+      n -= chunk;
+    }
+}
+
+// Returns the number of characters appended.
+size_t
+__vala_rt_report_decimal (long value)
+{
+  char          tmp[24];
+  char         *ptr = &tmp[sizeof (tmp)];
+  int           negative = value < 0;
+  unsigned long v = negative ? -(unsigned long)value : (unsigned long)value;
+  do
+    {
+      *--ptr = '0' + v % 10;
+      v /= 10;
+    }
+  while (v);
+  if (negative)
+    {
+      *--ptr = '-';
+    }
+  size_t len = &tmp[sizeof (tmp)] - ptr;
+  __vala_rt_report_append (ptr, len);
+  return len;
+}
+
+// Appends value as hexadecimal number, padded with zeros to width digits.
+void
+__vala_rt_report_hex (uint64_t value, int width)
+{
+  char  tmp[16];
+  char *ptr = &tmp[sizeof (tmp)];
+  do
+    {
+      *--ptr = "0123456789abcdef"[value & 0xf];
+      value >>= 4;
+      width--;
+    }
+  while (value || (width > 0 && ptr > tmp));
+  __vala_rt_report_append (ptr, &tmp[sizeof (tmp)] - ptr);
+}
+
+static const char *
+__vala_rt_signal_description (int signum, const char **name)
+{
+  switch (signum)
+    {
+    case SIGSEGV:
+      *name = "SIGSEGV";
+      return "Segmentation fault";
+    case SIGILL:
+      *name = "SIGILL";
+      return "Illegal instruction";
+    case SIGFPE:
+      *name = "SIGFPE";
+      return "Floating point exception";
+    case SIGABRT:
+      *name = "SIGABRT";
+      return "Aborted";
+    case SIGBUS:
+      *name = "SIGBUS";
+      return "Bus error";
+    default:
+      *name = NULL;
+      return NULL;
+    }
+}
+
+static void
+__vala_rt_report_be (uint64_t value, int size)
+{
+  char bytes[8];
+  for (int i = size - 1; i >= 0; i--)
+    {
+      bytes[i] = value & 0xff;
+      value >>= 8;
+    }
+  __vala_rt_report_append (bytes, size);
+}
+
+static size_t
+__vala_rt_binary_string_size (const char *str)
+{
+  size_t len = str ? strlen (str) : 0;
+  return 2 + (len < REPORT_NULL_STRING ? len : REPORT_NULL_STRING - 1);
+}
+
+static void
+__vala_rt_report_binary_string (const char *str)
+{
+  if (!str)
+    {
+      __vala_rt_report_be (REPORT_NULL_STRING, 2);
+      return;
+    }
+  size_t len = strlen (str);
+  len = len < REPORT_NULL_STRING ? len : REPORT_NULL_STRING - 1;
+  __vala_rt_report_be (len, 2);
+  __vala_rt_report_append (str, len);
+}
+
+static void
+__vala_rt_report_binary_record (uint8_t type, size_t len)
+{
+  __vala_rt_report_append ((const char *)&type, 1);
+  __vala_rt_report_be (len, 4);
+}
+
+// Appends a JSON string literal, or null.
+static void
+__vala_rt_report_json_string (const char *str)
+{
+  if (!str)
+    {
+      __vala_rt_report_string ("null");
+      return;
+    }
+  __vala_rt_report_append ("\"", 1);
+  const char *start = str;
+  for (; *str; str++)
+    {
+      unsigned char c = *str;
+      if (c >= 0x20 && c != '"' && c != '\\')
+        {
+          continue;
+        }
+      __vala_rt_report_append (start, str - start);
+      start = str + 1;
+      if (c == '"' || c == '\\')
+        {
+          char escaped[2] = { '\\', c };
+          __vala_rt_report_append (escaped, 2);
+        }
+      else
+        {
+          __vala_rt_report_string ("\\u00");
+          __vala_rt_report_hex (c, 2);
+        }
+    }
+  __vala_rt_report_append (start, str - start);
+  __vala_rt_report_append ("\"", 1);
+}
+
+static void
+__vala_rt_report_json_key (const char *key)
+{
+  __vala_rt_report_string (",\"");
+  __vala_rt_report_string (key);
+  __vala_rt_report_string ("\":");
+}
+
+// Strips the directory, so the fingerprint doesn't depend on where the
+// libraries are installed.
+static const char *
+__vala_rt_basename (const char *path)
+{
+  const char *slash = path ? strrchr (path, '/') : NULL;
+  return slash ? slash + 1 : path;
+}
+
+// FNV-1a, 64 bit
+static void
+__vala_rt_fingerprint_add (const char *str)
+{
+  for (; str && *str; str++)
+    {
+      __vala_rt_report_fingerprint ^= (uint8_t)*str;
+      __vala_rt_report_fingerprint *= 1099511628211ULL;
+    }
+  // Separates the strings, so "ab" + "c" differs from "a" + "bc"
+  __vala_rt_report_fingerprint *= 1099511628211ULL;
+}
+
+void
+vala_rt_set_report_format (enum vala_rt_report_format format)
+{
+  __vala_rt_report_format = format;
+}
+
+// Starts the report of a crash caused by signum, or, if signum is 0, the
+// backtrace of the thread id during a thread dump.
+void
+__vala_rt_report_begin (int signum, int id)
+{
+  __vala_rt_report_fingerprint = FINGERPRINT_BASIS;
+  __vala_rt_report_n_frames = 0;
+  const char *name;
+  const char *description = __vala_rt_signal_description (signum, &name);
+  switch (__vala_rt_report_format)
+    {
+    case VALA_RT_REPORT_JSON:
+      __vala_rt_report_string (signum ? "{\"type\":\"crash\"" : "{\"type\":\"thread\"");
+      __vala_rt_report_json_key (signum ? "pid" : "tid");
+      __vala_rt_report_decimal (id);
+      if (signum)
+        {
+          __vala_rt_report_json_key ("signal");
+          __vala_rt_report_decimal (signum);
+          __vala_rt_report_json_key ("signal_name");
+          __vala_rt_report_json_string (name);
+          __vala_rt_report_json_key ("description");
+          __vala_rt_report_json_string (description);
+        }
+      __vala_rt_report_string ("}\n");
+      break;
+    case VALA_RT_REPORT_BINARY:
+      __vala_rt_report_binary_record (REPORT_RECORD_BEGIN, 4 + 1 + 4 + 4 + __vala_rt_binary_string_size (name));
+      __vala_rt_report_append (REPORT_MAGIC, 4);
+      __vala_rt_report_be (REPORT_VERSION, 1);
+      __vala_rt_report_be (signum, 4);
+      __vala_rt_report_be (id, 4);
+      __vala_rt_report_binary_string (name);
+      break;
+    default:
+      if (!signum)
+        {
+          __vala_rt_report_string ("\nThread ");
+          __vala_rt_report_decimal (id);
+          __vala_rt_report_string (":\n");
+        }
+      else if (description)
+        {
+          // Like psignal, which uses stdio
+          __vala_rt_report_string ("Received signal: ");
+          __vala_rt_report_string (description);
+          __vala_rt_report_append ("\n", 1);
+        }
+      else
+        {
+          __vala_rt_report_string ("Received signal: Unknown signal ");
+          __vala_rt_report_decimal (signum);
+          __vala_rt_report_append ("\n", 1);
+        }
+      break;
+    }
+}
+
+// Appends a frame in one of the machine readable formats. Every frame that
+// isn't skipped is part of the fingerprint, the placeholder of omitted frames is
+// not, so the fingerprint doesn't depend on the depth of the stack.
+void
+__vala_rt_report_frame (const struct vala_rt_report_frame *frame)
+{
+  if (!(frame->flags & VALA_RT_REPORT_FRAME_SKIPPED) && !frame->omitted)
+    {
+      __vala_rt_fingerprint_add (__vala_rt_basename (frame->library_name));
+      __vala_rt_fingerprint_add (frame->function_name);
+    }
+  if (__vala_rt_report_format == VALA_RT_REPORT_BINARY)
+    {
+      __vala_rt_report_binary_record (REPORT_RECORD_FRAME,
+                                      8 + 1 + __vala_rt_binary_string_size (frame->library_name)
+                                          + __vala_rt_binary_string_size (frame->function_name)
+                                          + __vala_rt_binary_string_size (frame->signal_name)
+                                          + __vala_rt_binary_string_size (frame->filename) + 4 + 4 + 4 + 4);
+      __vala_rt_report_be (frame->ip, 8);
+      __vala_rt_report_be (frame->flags, 1);
+      __vala_rt_report_binary_string (frame->library_name);
+      __vala_rt_report_binary_string (frame->function_name);
+      __vala_rt_report_binary_string (frame->signal_name);
+      __vala_rt_report_binary_string (frame->filename);
+      __vala_rt_report_be ((uint32_t)frame->lineno, 4);
+      __vala_rt_report_be (frame->cycle_len, 4);
+      __vala_rt_report_be (frame->repeats, 4);
+      __vala_rt_report_be (frame->omitted, 4);
+    }
+  else
+    {
+      __vala_rt_report_string ("{\"type\":\"frame\"");
+      __vala_rt_report_json_key ("index");
+      __vala_rt_report_decimal (__vala_rt_report_n_frames);
+      __vala_rt_report_json_key ("ip");
+      __vala_rt_report_string ("\"0x");
+      __vala_rt_report_hex (frame->ip, 16);
+      __vala_rt_report_append ("\"", 1);
+      __vala_rt_report_json_key ("library");
+      __vala_rt_report_json_string (frame->library_name);
+      __vala_rt_report_json_key ("function");
+      __vala_rt_report_json_string (frame->function_name);
+      __vala_rt_report_json_key ("file");
+      __vala_rt_report_json_string (frame->filename);
+      __vala_rt_report_json_key ("line");
+      if (frame->lineno == -1)
+        {
+          __vala_rt_report_string ("null");
+        }
+      else
+        {
+          __vala_rt_report_decimal (frame->lineno);
+        }
+      __vala_rt_report_json_key ("skipped");
+      __vala_rt_report_string (frame->flags & VALA_RT_REPORT_FRAME_SKIPPED ? "true" : "false");
+      __vala_rt_report_json_key ("collapsed");
+      __vala_rt_report_string (frame->flags & VALA_RT_REPORT_FRAME_COLLAPSED ? "true" : "false");
+      __vala_rt_report_json_key ("signal");
+      __vala_rt_report_json_string (frame->signal_name);
+      __vala_rt_report_json_key ("cycle");
+      __vala_rt_report_decimal (frame->cycle_len);
+      __vala_rt_report_json_key ("repeats");
+      __vala_rt_report_decimal (frame->repeats);
+      __vala_rt_report_json_key ("omitted");
+      __vala_rt_report_decimal (frame->omitted);
+      __vala_rt_report_string ("}\n");
+    }
+  __vala_rt_report_n_frames++;
+}
+
+// Ends the report started by __vala_rt_report_begin, including the fingerprint
+// of the frames, and writes it.
+void
+__vala_rt_report_end (enum vala_rt_report_status status)
+{
+  static const char *const status_names[] = { "ok", "no_response", "exited" };
+  static const char *const status_messages[] = { NULL, "Did not respond\n", "Exited\n" };
+  switch (__vala_rt_report_format)
+    {
+    case VALA_RT_REPORT_JSON:
+      __vala_rt_report_string ("{\"type\":\"end\"");
+      __vala_rt_report_json_key ("status");
+      __vala_rt_report_json_string (status_names[status]);
+      __vala_rt_report_json_key ("frames");
+      __vala_rt_report_decimal (__vala_rt_report_n_frames);
+      __vala_rt_report_json_key ("fingerprint");
+      __vala_rt_report_append ("\"", 1);
+      __vala_rt_report_hex (__vala_rt_report_fingerprint, 16);
+      __vala_rt_report_string ("\"}\n");
+      break;
+    case VALA_RT_REPORT_BINARY:
+      __vala_rt_report_binary_record (REPORT_RECORD_END, 1 + 4 + 8);
+      __vala_rt_report_be (status, 1);
+      __vala_rt_report_be (__vala_rt_report_n_frames, 4);
+      __vala_rt_report_be (__vala_rt_report_fingerprint, 8);
+      break;
+    default:
+      if (status_messages[status])
+        {
+          __vala_rt_report_string (status_messages[status]);
+        }
+      break;
+    }
+  __vala_rt_report_flush ();
+}
+
+// Tells that the crash handler wrote a crash record instead of a report.
+void
+__vala_rt_report_crash_record (int signum, const char *path)
+{
+  switch (__vala_rt_report_format)
+    {
+    case VALA_RT_REPORT_JSON:
+      __vala_rt_report_string ("{\"type\":\"crash_record\"");
+      __vala_rt_report_json_key ("signal");
+      __vala_rt_report_decimal (signum);
+      __vala_rt_report_json_key ("path");
+      __vala_rt_report_json_string (path);
+      __vala_rt_report_string ("}\n");
+      break;
+    case VALA_RT_REPORT_BINARY:
+      __vala_rt_report_binary_record (REPORT_RECORD_CRASH_RECORD, 4 + __vala_rt_binary_string_size (path));
+      __vala_rt_report_be (signum, 4);
+      __vala_rt_report_binary_string (path);
+      break;
+    default:
+      __vala_rt_report_string ("Received signal ");
+      __vala_rt_report_decimal (signum);
+      __vala_rt_report_string (", crash record written to ");
+      __vala_rt_report_string (path);
+      __vala_rt_report_string ("\n");
+      break;
+    }
+  __vala_rt_report_flush ();
+}
@@ -0,0 +1,104 @@
+/* string_pool.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include <string.h>
+
+#define STRING_POOL_SIZE (32 * 1024)
+// More than the strings of MAX_BACKTRACE_DEPTH frames and their labels
+#define STRING_POOL_SLOTS 1024
+
+/*
+ * The strings of the frames of the backtrace being printed. Every string is
+ * stored once, so all frames of a module share the library name, a recursion
+ * shares the function name and comparing two strings is comparing their ids.
+ * An id is the offset in the pool, 0 is the empty string and stands for
+ * unknown. It is reset for every backtrace and never allocates, it is used by
+ * the crash handler.
+ */
+
+static char     __vala_rt_string_pool[STRING_POOL_SIZE];
+static uint32_t __vala_rt_string_pool_used = 1;
+// Ids by hash, using linear probing
+static uint32_t __vala_rt_string_pool_slots[STRING_POOL_SLOTS];
+
+void
+__vala_rt_string_pool_reset (void)
+{
+  __vala_rt_string_pool_used = 1;
+  memset (__vala_rt_string_pool_slots, 0, sizeof (__vala_rt_string_pool_slots));
+}
+
+// Concatenates the parts (NULL ones are skipped) and returns the id of the
+// result. Returns 0 if the pool is full.
+string_id
+__vala_rt_string_pool_add_parts (const char *const *parts, int n_parts)
+{
+  // Built right after the used part, so it only has to be kept if it is new.
+  uint32_t start = __vala_rt_string_pool_used;
+  size_t   len = 0;
+  for (int i = 0; i < n_parts; i++)
+    {
+      if (!parts[i])
+        {
+          continue;
+        }
+      size_t part_len = strlen (parts[i]);
+      if (part_len >= STRING_POOL_SIZE - start - len)
+        {
+          return 0;
+        }
+      memcpy (&__vala_rt_string_pool[start + len], parts[i], part_len);
+      len += part_len;
+    }
+  if (!len)
+    {
+      return 0;
+    }
+  __vala_rt_string_pool[start + len] = '\0';
+  const char *string = &__vala_rt_string_pool[start];
+  uint32_t    slot = __vala_rt_hash_name (string, len) & (STRING_POOL_SLOTS - 1);
+  for (uint32_t probe = 0; probe < STRING_POOL_SLOTS; probe++)
+    {
+      uint32_t *id = &__vala_rt_string_pool_slots[(slot + probe) & (STRING_POOL_SLOTS - 1)];
+      if (!*id)
+        {
+          *id = start;
+          __vala_rt_string_pool_used += len + 1;
+          return start;
+        }
+      if (!strcmp (&__vala_rt_string_pool[*id], string))
+        {
+          return *id;
+        }
+    }
+  return 0;
+}
+
+string_id
+__vala_rt_string_pool_add (const char *string)
+{
+  return __vala_rt_string_pool_add_parts (&string, 1);
+}
+
+const char *
+__vala_rt_string_pool_get (string_id id)
+{
+  return &__vala_rt_string_pool[id];
+}
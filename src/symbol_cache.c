@@ -0,0 +1,517 @@
+/* symbol_cache.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <fcntl.h>
+#include <link.h>
+#include <linux/limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SYMBOL_CACHE_FILENAME "symbols.cache"
+#define SYMBOL_CACHE_BUCKETS 4096
+// Once the file reaches this size, it is started over, dropping the entries of
+// old builds.
+#define SYMBOL_CACHE_MAX_SIZE (32 * 1024 * 1024)
+#define MAX_CACHED_STRING 1024
+#define MAX_CACHED_SIGNALS 64
+
+/*
+ * Resolved frames are remembered across runs in an append-only hash file,
+ * keyed by the build-id of the module and the offset in it, so repeated
+ * crashes of the same build are symbolized without opening any DWARF or
+ * .vdbg file (see vala-rt-format.h for the layout). A new build has a new
+ * build-id, so its frames miss and are added.
+ *
+ * Entries are appended under flock and only published by updating the head of
+ * their bucket afterwards, so the file is always consistent for readers,
+ * which map it read-only and never take the lock. The file is never
+ * truncated, but replaced by renaming a new one over it, so existing mappings
+ * stay valid. Only syscalls are used, so it works in the crash handler.
+ *
+ * A frame that hits doesn't load its module, so the signal handlers found in
+ * the .vala_signal_mappings section of the module are stored with the frame.
+ */
+
+struct module_key
+{
+  const uint8_t *build_id;
+  uint32_t       build_id_len;
+  uint64_t       offset;
+};
+
+struct cached_signal
+{
+  const char *library_name;
+  const char *function_name;
+  const char *signal_name;
+};
+
+struct key_search
+{
+  uintptr_t          ip;
+  struct module_key *key;
+  int                found;
+};
+
+static int                                __vala_rt_symbol_cache_enabled = -1;
+static char                               __vala_rt_symbol_cache_path[PATH_MAX] = { 0 };
+static const uint8_t                     *__vala_rt_symbol_cache_data = NULL;
+static size_t                             __vala_rt_symbol_cache_size = 0;
+static const struct vala_rt_crash_record *__vala_rt_symbol_cache_record = NULL;
+// Signal handlers of the frames that hit, oldest ones are overwritten
+static struct cached_signal               __vala_rt_cached_signals[MAX_CACHED_SIGNALS];
+static size_t                             __vala_rt_n_cached_signals = 0;
+
+static void
+__vala_rt_symbol_cache_unmap (void)
+{
+  if (__vala_rt_symbol_cache_data)
+    {
+      munmap ((void *)__vala_rt_symbol_cache_data, __vala_rt_symbol_cache_size);
+    }
+  __vala_rt_symbol_cache_data = NULL;
+  __vala_rt_symbol_cache_size = 0;
+}
+
+void
+vala_rt_set_symbol_cache_directory (const char *directory)
+{
+  __vala_rt_symbol_cache_unmap ();
+  __vala_rt_symbol_cache_enabled = 0;
+  if (!directory || strlen (directory) + sizeof ("/" SYMBOL_CACHE_FILENAME) > sizeof (__vala_rt_symbol_cache_path))
+    {
+      return;
+    }
+  mkdir (directory, 0700);
+  strcpy (__vala_rt_symbol_cache_path, directory);
+  strcat (__vala_rt_symbol_cache_path, "/" SYMBOL_CACHE_FILENAME);
+  __vala_rt_symbol_cache_enabled = 1;
+}
+
+// VALA_RT_SYMBOL_CACHE is either a directory, or anything else for
+// $XDG_CACHE_HOME/vala-rt (Or ~/.cache/vala-rt).
+static int
+__vala_rt_symbol_cache_init (void)
+{
+  if (__vala_rt_symbol_cache_enabled != -1)
+    {
+      return __vala_rt_symbol_cache_enabled;
+    }
+  __vala_rt_symbol_cache_enabled = 0;
+  const char *env = getenv ("VALA_RT_SYMBOL_CACHE");
+  if (!env || !env[0])
+    {
+      return 0;
+    }
+  if (env[0] == '/')
+    {
+      vala_rt_set_symbol_cache_directory (env);
+      return __vala_rt_symbol_cache_enabled;
+    }
+  char        directory[PATH_MAX] = { 0 };
+  const char *xdg = getenv ("XDG_CACHE_HOME");
+  const char *home = getenv ("HOME");
+  if (xdg && xdg[0] && strlen (xdg) < PATH_MAX - 64)
+    {
+      strcpy (directory, xdg);
+    }
+  else if (home && home[0] && strlen (home) < PATH_MAX - 64)
+    {
+      strcpy (directory, home);
+      strcat (directory, "/.cache");
+    }
+  else
+    {
+      return 0;
+    }
+  mkdir (directory, 0700);
+  strcat (directory, "/vala-rt");
+  vala_rt_set_symbol_cache_directory (directory);
+  return __vala_rt_symbol_cache_enabled;
+}
+
+// Maps the file again, to see the entries appended since it was mapped. The
+// old mapping is kept, as strings returned by lookups point into it.
+static int
+__vala_rt_symbol_cache_map (void)
+{
+  int fd = open (__vala_rt_symbol_cache_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  struct stat st;
+  if (fstat (fd, &st) || (size_t)st.st_size < sizeof (struct vala_rt_symbol_cache_header))
+    {
+      close (fd);
+      return -1;
+    }
+  void *data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      return -1;
+    }
+  const struct vala_rt_symbol_cache_header *header = data;
+  if (memcmp (header->magic, SYMBOL_CACHE_MAGIC, sizeof (header->magic)) || header->version != SYMBOL_CACHE_VERSION
+      || header->n_buckets != SYMBOL_CACHE_BUCKETS
+      || sizeof (*header) + SYMBOL_CACHE_BUCKETS * sizeof (uint32_t) > (size_t)st.st_size)
+    {
+      munmap (data, st.st_size);
+      return -1;
+    }
+  __vala_rt_symbol_cache_data = data;
+  __vala_rt_symbol_cache_size = st.st_size;
+  return 0;
+}
+
+static int
+__vala_rt_find_module_key (struct dl_phdr_info *info, __attribute__ ((unused)) size_t size, void *data)
+{
+  struct key_search *search = data;
+  for (ElfW (Half) i = 0; i < info->dlpi_phnum; i++)
+    {
+      const ElfW (Phdr) *phdr = &info->dlpi_phdr[i];
+      uintptr_t          start = info->dlpi_addr + phdr->p_vaddr;
+      if (phdr->p_type == PT_LOAD && search->ip >= start && search->ip < start + phdr->p_memsz)
+        {
+          search->key->build_id_len = __vala_rt_phdr_build_id (info, &search->key->build_id);
+          search->key->offset = search->ip - info->dlpi_addr;
+          search->found = 1;
+          return 1;
+        }
+    }
+  return 0;
+}
+
+// Uses the modules of the crash record while symbolizing one, else the ones
+// loaded into this process.
+void
+__vala_rt_symbol_cache_use_record (const struct vala_rt_crash_record *record)
+{
+  __vala_rt_symbol_cache_record = record;
+}
+
+static int
+__vala_rt_module_key (uintptr_t ip, struct module_key *key)
+{
+  memset (key, 0, sizeof (*key));
+  const struct vala_rt_crash_record *record = __vala_rt_symbol_cache_record;
+  if (!record)
+    {
+      struct key_search search = { ip, key, 0 };
+      dl_iterate_phdr (__vala_rt_find_module_key, &search);
+      return search.found && key->build_id_len ? 0 : -1;
+    }
+  // The record has no sizes, so it is the module with the highest base below ip
+  const struct vala_rt_crash_module *best = NULL;
+  for (uint32_t i = 0; i < record->n_modules; i++)
+    {
+      if (record->modules[i].base <= ip && (!best || record->modules[i].base > best->base))
+        {
+          best = &record->modules[i];
+        }
+    }
+  if (!best || !best->build_id_len)
+    {
+      return -1;
+    }
+  key->build_id = best->build_id;
+  key->build_id_len = best->build_id_len;
+  key->offset = ip - best->base;
+  return 0;
+}
+
+static uint32_t
+__vala_rt_symbol_cache_bucket (const struct module_key *key)
+{
+  uint32_t hash = __vala_rt_hash_name ((const char *)key->build_id, key->build_id_len);
+  hash ^= __vala_rt_hash_name ((const char *)&key->offset, sizeof (key->offset));
+  return hash & (SYMBOL_CACHE_BUCKETS - 1);
+}
+
+static uint32_t
+__vala_rt_symbol_cache_head (uint32_t bucket)
+{
+  const uint32_t *buckets = (const uint32_t *)(__vala_rt_symbol_cache_data + sizeof (struct vala_rt_symbol_cache_header));
+  return __atomic_load_n (&buckets[bucket], __ATOMIC_ACQUIRE);
+}
+
+static size_t
+__vala_rt_symbol_cache_entry_size (const struct vala_rt_symbol_cache_entry *entry)
+{
+  size_t size = sizeof (*entry) + entry->build_id_len + entry->library_len + entry->symbol_len + entry->function_len
+                + entry->filename_len + entry->signal_len;
+  return (size + 7) & ~(size_t)7;
+}
+
+// The strings include their NUL, a length of 0 is a NULL string.
+static const char *
+__vala_rt_symbol_cache_string (const char **ptr, uint16_t len)
+{
+  const char *str = *ptr;
+  *ptr += len;
+  return len && !str[len - 1] ? str : NULL;
+}
+
+// On success, the strings point into the mapped file and stay valid.
+int
+__vala_rt_symbol_cache_lookup (uintptr_t ip, struct vala_rt_resolved_frame *resolved)
+{
+  struct module_key key;
+  if (!__vala_rt_symbol_cache_init () || __vala_rt_module_key (ip, &key))
+    {
+      return -1;
+    }
+  if (!__vala_rt_symbol_cache_data && __vala_rt_symbol_cache_map ())
+    {
+      return -1;
+    }
+  uint32_t bucket = __vala_rt_symbol_cache_bucket (&key);
+  uint32_t offset = __vala_rt_symbol_cache_head (bucket);
+  // Appended by another process since it was mapped
+  if (offset >= __vala_rt_symbol_cache_size)
+    {
+      if (__vala_rt_symbol_cache_map ())
+        {
+          return -1;
+        }
+      offset = __vala_rt_symbol_cache_head (bucket);
+    }
+  // Entries only link to older ones, which are at lower offsets.
+  while (offset && offset + sizeof (struct vala_rt_symbol_cache_entry) <= __vala_rt_symbol_cache_size)
+    {
+      const struct vala_rt_symbol_cache_entry *entry
+          = (const struct vala_rt_symbol_cache_entry *)(__vala_rt_symbol_cache_data + offset);
+      if (offset + __vala_rt_symbol_cache_entry_size (entry) > __vala_rt_symbol_cache_size)
+        {
+          return -1;
+        }
+      const char *ptr = (const char *)(entry + 1);
+      if (entry->offset == key.offset && entry->build_id_len == key.build_id_len
+          && !memcmp (ptr, key.build_id, key.build_id_len))
+        {
+          ptr += entry->build_id_len;
+          memset (resolved, 0, sizeof (*resolved));
+          resolved->library_name = __vala_rt_symbol_cache_string (&ptr, entry->library_len);
+          resolved->symbol = __vala_rt_symbol_cache_string (&ptr, entry->symbol_len);
+          resolved->function_name = __vala_rt_symbol_cache_string (&ptr, entry->function_len);
+          resolved->filename = __vala_rt_symbol_cache_string (&ptr, entry->filename_len);
+          resolved->lineno = entry->lineno;
+          const char *signal = __vala_rt_symbol_cache_string (&ptr, entry->signal_len);
+          if (signal && resolved->function_name)
+            {
+              struct cached_signal *cached = &__vala_rt_cached_signals[__vala_rt_n_cached_signals++ % MAX_CACHED_SIGNALS];
+              cached->library_name = resolved->library_name;
+              cached->function_name = resolved->function_name;
+              cached->signal_name = signal;
+            }
+          return 0;
+        }
+      if (entry->next >= offset)
+        {
+          return -1;
+        }
+      offset = entry->next;
+    }
+  return -1;
+}
+
+// Finds the signal handlers of frames that were found in the cache.
+const char *
+__vala_rt_symbol_cache_find_signal (const char *library_name, const char *function_name)
+{
+  size_t n = __vala_rt_n_cached_signals < MAX_CACHED_SIGNALS ? __vala_rt_n_cached_signals : MAX_CACHED_SIGNALS;
+  for (size_t i = 0; i < n; i++)
+    {
+      const struct cached_signal *cached = &__vala_rt_cached_signals[i];
+      if (!strcmp (cached->library_name, library_name) && !strcmp (cached->function_name, function_name))
+        {
+          return cached->signal_name;
+        }
+    }
+  return NULL;
+}
+
+static int
+__vala_rt_write_all (int fd, const void *data, size_t len, off_t offset)
+{
+  const uint8_t *ptr = data;
+  while (len)
+    {
+      ssize_t n = pwrite (fd, ptr, len, offset);
+      if (n <= 0)
+        {
+          return -1;
+        }
+      ptr += n;
+      len -= n;
+      offset += n;
+    }
+  return 0;
+}
+
+// Writes an empty cache to a temporary file and renames it over the old one.
+static int
+__vala_rt_symbol_cache_create (void)
+{
+  // Named after the pid, as other processes may do the same
+  char  tmp_path[PATH_MAX + 32] = { 0 };
+  char *ptr = stpcpy (tmp_path, __vala_rt_symbol_cache_path);
+  *ptr++ = '.';
+  for (unsigned int pid = getpid (); pid; pid /= 16)
+    {
+      *ptr++ = "0123456789abcdef"[pid % 16];
+    }
+  int fd = open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  struct vala_rt_symbol_cache_header header = { 0 };
+  memcpy (header.magic, SYMBOL_CACHE_MAGIC, sizeof (header.magic));
+  header.version = SYMBOL_CACHE_VERSION;
+  header.n_buckets = SYMBOL_CACHE_BUCKETS;
+  int ret = __vala_rt_write_all (fd, &header, sizeof (header), 0);
+  if (!ret)
+    {
+      ret = ftruncate (fd, sizeof (header) + SYMBOL_CACHE_BUCKETS * sizeof (uint32_t));
+    }
+  close (fd);
+  if (ret || rename (tmp_path, __vala_rt_symbol_cache_path))
+    {
+      unlink (tmp_path);
+      return -1;
+    }
+  return 0;
+}
+
+static int
+__vala_rt_symbol_cache_open_locked (void)
+{
+  for (int attempt = 0; attempt < 2; attempt++)
+    {
+      int fd = open (__vala_rt_symbol_cache_path, O_RDWR | O_CLOEXEC);
+      if (fd >= 0)
+        {
+          flock (fd, LOCK_EX);
+          struct stat on_disk;
+          struct stat locked;
+          // It may have been replaced while waiting for the lock
+          if (stat (__vala_rt_symbol_cache_path, &on_disk) == 0 && fstat (fd, &locked) == 0
+              && on_disk.st_ino == locked.st_ino && on_disk.st_dev == locked.st_dev)
+            {
+              return fd;
+            }
+          close (fd);
+          continue;
+        }
+      if (__vala_rt_symbol_cache_create ())
+        {
+          return -1;
+        }
+    }
+  return -1;
+}
+
+// Copies str, including the NUL, unless it is NULL or too long.
+static uint16_t
+__vala_rt_symbol_cache_put_string (uint8_t **ptr, const char *str)
+{
+  size_t len = str ? strlen (str) + 1 : 0;
+  if (len > MAX_CACHED_STRING)
+    {
+      return 0;
+    }
+  memcpy (*ptr, str ? str : "", len);
+  *ptr += len;
+  return len;
+}
+
+// Remembers a frame resolved using libdw. Unresolved frames are not stored, as
+// they may be resolvable once debuginfo is installed.
+void
+__vala_rt_symbol_cache_store (uintptr_t ip, const struct vala_rt_resolved_frame *resolved)
+{
+  struct module_key key;
+  if (!resolved->library_name || !resolved->function_name || !__vala_rt_symbol_cache_init ()
+      || __vala_rt_module_key (ip, &key) || key.build_id_len > MAX_BUILD_ID_LEN)
+    {
+      return;
+    }
+  // The module was just loaded to resolve the frame
+  const struct vala_rt_module *module = __vala_rt_module_by_name (&__vala_rt_crash_session, resolved->library_name);
+  const char                  *signal = NULL;
+  if (module && module->signal_data)
+    {
+      signal = __vala_rt_signal_section_lookup (module->signal_data, module->signal_size, resolved->function_name);
+    }
+  struct vala_rt_symbol_cache_entry entry = { 0 };
+  uint8_t  buffer[sizeof (entry) + MAX_BUILD_ID_LEN + 5 * MAX_CACHED_STRING + 8] = { 0 };
+  uint8_t *ptr = buffer + sizeof (entry);
+  entry.build_id_len = key.build_id_len;
+  entry.offset = key.offset;
+  entry.lineno = resolved->lineno;
+  memcpy (ptr, key.build_id, key.build_id_len);
+  ptr += key.build_id_len;
+  entry.library_len = __vala_rt_symbol_cache_put_string (&ptr, resolved->library_name);
+  entry.symbol_len = __vala_rt_symbol_cache_put_string (&ptr, resolved->symbol);
+  entry.function_len = __vala_rt_symbol_cache_put_string (&ptr, resolved->function_name);
+  entry.filename_len = __vala_rt_symbol_cache_put_string (&ptr, resolved->filename);
+  entry.signal_len = __vala_rt_symbol_cache_put_string (&ptr, signal);
+  size_t      size = __vala_rt_symbol_cache_entry_size (&entry);
+  struct stat st;
+  int         fd = __vala_rt_symbol_cache_open_locked ();
+  if (fd >= 0 && !fstat (fd, &st) && (size_t)st.st_size + size > SYMBOL_CACHE_MAX_SIZE)
+    {
+      close (fd);
+      __vala_rt_symbol_cache_create ();
+      fd = __vala_rt_symbol_cache_open_locked ();
+    }
+  if (fd < 0 || fstat (fd, &st))
+    {
+      if (fd >= 0)
+        {
+          close (fd);
+        }
+      return;
+    }
+  uint32_t bucket = __vala_rt_symbol_cache_bucket (&key);
+  off_t    bucket_offset = sizeof (struct vala_rt_symbol_cache_header) + bucket * sizeof (uint32_t);
+  uint32_t head = 0;
+  off_t    entry_offset = (st.st_size + 7) & ~(off_t)7;
+  if (pread (fd, &head, sizeof (head), bucket_offset) == sizeof (head) && (uint64_t)entry_offset + size <= UINT32_MAX)
+    {
+      entry.next = head;
+      memcpy (buffer, &entry, sizeof (entry));
+      uint32_t new_head = entry_offset;
+      // The entry has to be complete before it is published
+      if (__vala_rt_write_all (fd, buffer, size, entry_offset) == 0)
+        {
+          __vala_rt_write_all (fd, &new_head, sizeof (new_head), bucket_offset);
+        }
+    }
+  close (fd);
+}
@@ -0,0 +1,217 @@
+/* thread_dump.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DUMPED_THREADS 64
+#define THREAD_DUMP_TIMEOUT_MS 500
+#define THREAD_DUMP_SIGNAL (SIGRTMIN + 3)
+#define TASK_BUF_SIZE 1024
+
+/*
+ * On a fatal signal, the crashing thread sends THREAD_DUMP_SIGNAL to every
+ * other thread listed in /proc/self/task. Each of them unwinds itself into
+ * a preallocated slot and then stays parked in the handler, so the stacks
+ * don't change until the process is aborted. The crashing thread waits
+ * for them, but gives up on threads blocking the signal after a timeout.
+ */
+
+struct thread_slot
+{
+  pid_t     tid;
+  int       done;
+  int       n_frames;
+  uintptr_t ips[MAX_BACKTRACE_DEPTH];
+};
+
+static int                __vala_rt_dump_all_threads = 0;
+static struct thread_slot __vala_rt_thread_slots[MAX_DUMPED_THREADS];
+static int                __vala_rt_n_thread_slots = 0;
+
+static void
+__vala_rt_handle_dump_signal (__attribute__ ((unused)) int        signum,
+                              __attribute__ ((unused)) siginfo_t *info,
+                              void                               *_ctx)
+{
+  pid_t tid = syscall (SYS_gettid);
+  int   n_slots = __atomic_load_n (&__vala_rt_n_thread_slots, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n_slots; i++)
+    {
+      struct thread_slot *slot = &__vala_rt_thread_slots[i];
+      if (slot->tid != tid)
+        {
+          continue;
+        }
+      slot->n_frames = __vala_rt_capture_frames (_ctx, slot->ips, MAX_BACKTRACE_DEPTH);
+      __atomic_store_n (&slot->done, 1, __ATOMIC_RELEASE);
+      // Parked until the crashing thread aborts
+      while (1)
+        {
+          pause ();
+        }
+    }
+}
+
+void
+vala_rt_set_dump_all_threads (int enabled)
+{
+  __vala_rt_dump_all_threads = enabled;
+  if (!enabled)
+    {
+      return;
+    }
+  struct sigaction action;
+  memset (&action, 0, sizeof action);
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+  sigfillset (&action.sa_mask);
+  action.sa_sigaction = __vala_rt_handle_dump_signal;
+  sigaction (THREAD_DUMP_SIGNAL, &action, NULL);
+}
+
+static int
+__vala_rt_all_threads_done (int n_slots)
+{
+  for (int i = 0; i < n_slots; i++)
+    {
+      if (!__atomic_load_n (&__vala_rt_thread_slots[i].done, __ATOMIC_ACQUIRE))
+        {
+          return 0;
+        }
+    }
+  return 1;
+}
+
+// Interrupts all other threads and waits until they captured their
+// frames. Returns the number of threads, to be passed to
+// __vala_rt_print_other_threads.
+int
+__vala_rt_interrupt_other_threads (void)
+{
+  if (!__vala_rt_dump_all_threads)
+    {
+      return 0;
+    }
+  int fd = open ("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      return 0;
+    }
+  pid_t self = syscall (SYS_gettid);
+  int   n_slots = 0;
+  while (n_slots < MAX_DUMPED_THREADS)
+    {
+      char buf[TASK_BUF_SIZE];
+      int  nread = syscall (SYS_getdents, fd, buf, TASK_BUF_SIZE);
+      if (nread <= 0)
+        {
+          break;
+        }
+      for (long bpos = 0; bpos < nread && n_slots < MAX_DUMPED_THREADS;)
+        {
+          struct linux_dirent *d = (struct linux_dirent *)(buf + bpos);
+          pid_t                tid = 0;
+          for (const char *c = d->d_name; *c >= '0' && *c <= '9'; c++)
+            {
+              tid = tid * 10 + (*c - '0');
+            }
+          if (tid > 0 && tid != self)
+            {
+              __vala_rt_thread_slots[n_slots].tid = tid;
+              __vala_rt_thread_slots[n_slots].done = 0;
+              __vala_rt_thread_slots[n_slots].n_frames = 0;
+              n_slots++;
+            }
+          bpos += d->d_reclen;
+        }
+    }
+  close (fd);
+  __atomic_store_n (&__vala_rt_n_thread_slots, n_slots, __ATOMIC_RELEASE);
+  pid_t pid = getpid ();
+  for (int i = 0; i < n_slots; i++)
+    {
+      // The thread exited in the meantime
+      if (syscall (SYS_tgkill, pid, __vala_rt_thread_slots[i].tid, THREAD_DUMP_SIGNAL))
+        {
+          __vala_rt_thread_slots[i].n_frames = -1;
+          __atomic_store_n (&__vala_rt_thread_slots[i].done, 1, __ATOMIC_RELEASE);
+        }
+    }
+  struct timespec interval = { 0, 1000 * 1000 };
+  for (int waited = 0; waited < THREAD_DUMP_TIMEOUT_MS && !__vala_rt_all_threads_done (n_slots); waited++)
+    {
+      nanosleep (&interval, NULL);
+    }
+  return n_slots;
+}
+
+// Returns the i-th thread captured by __vala_rt_interrupt_other_threads, for
+// printing it or putting it in a crash record.
+void
+__vala_rt_get_other_thread (int i, struct vala_rt_thread_stack *thread)
+{
+  const struct thread_slot *slot = &__vala_rt_thread_slots[i];
+  memset (thread, 0, sizeof (*thread));
+  thread->tid = slot->tid;
+  if (!__atomic_load_n (&slot->done, __ATOMIC_ACQUIRE))
+    {
+      thread->status = VALA_RT_REPORT_STATUS_NO_RESPONSE;
+    }
+  else if (slot->n_frames == -1)
+    {
+      thread->status = VALA_RT_REPORT_STATUS_EXITED;
+    }
+  else
+    {
+      thread->status = VALA_RT_REPORT_STATUS_OK;
+      thread->ips = slot->ips;
+      thread->n_frames = slot->n_frames;
+    }
+}
+
+// Prints one thread of a thread dump, either of this process or of a crash
+// record. Uses the current session, so every module is only loaded once.
+void
+__vala_rt_print_thread_stack (const struct vala_rt_thread_stack *thread)
+{
+  __vala_rt_report_begin (0, thread->tid);
+  if (thread->status != VALA_RT_REPORT_STATUS_OK)
+    {
+      __vala_rt_report_end (thread->status);
+      return;
+    }
+  __vala_rt_print_backtrace (thread->ips, thread->n_frames);
+}
+
+// Prints the frames captured by __vala_rt_interrupt_other_threads.
+void
+__vala_rt_print_other_threads (int n_slots)
+{
+  for (int i = 0; i < n_slots; i++)
+    {
+      struct vala_rt_thread_stack thread;
+      __vala_rt_get_other_thread (i, &thread);
+      __vala_rt_print_thread_stack (&thread);
+    }
+}
@@ -0,0 +1,339 @@
+/* unwind_fp.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#define MAX_EXECUTABLE_RANGES 1024
+#define END_OF_CHAIN 4096
+// A rejected unwind checks for new modules at most this often
+#define RANGES_REFRESH_INTERVAL_NS (100 * 1000 * 1000ULL)
+
+/*
+ * Walks the chain of saved frame pointers (RBP on x86_64, x29 on aarch64),
+ * where each frame starts with the frame pointer of the caller, followed by
+ * the return address. As a frame pointer may be garbage if a function was
+ * compiled without them, every frame has to be inside the stack of the
+ * thread, above the previous one, and return into an executable segment of
+ * a loaded module. If any frame fails this, the unwind is rejected and the
+ * caller uses libunwind instead.
+ *
+ * The stack bounds are only known for threads that captured a backtrace
+ * outside of a signal handler before (pthread_getattr_np is not
+ * async-signal-safe), so other threads always use libunwind.
+ */
+
+struct executable_range
+{
+  uintptr_t start;
+  uintptr_t end;
+};
+
+struct executable_ranges
+{
+  // dlpi_adds and dlpi_subs when it was built
+  unsigned long long      adds;
+  unsigned long long      subs;
+  size_t                  n_ranges;
+  struct executable_range ranges[MAX_EXECUTABLE_RANGES];
+};
+
+int                              __vala_rt_use_frame_pointers = 0;
+// Replaced, but never freed, if modules are loaded, as signal handlers may use them.
+static struct executable_ranges *__vala_rt_executable_ranges = NULL;
+static pthread_mutex_t           __vala_rt_executable_ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long        __vala_rt_executable_ranges_last_check = 0;
+static __thread uintptr_t        __vala_rt_stack_low __attribute__ ((tls_model ("initial-exec"))) = 0;
+static __thread uintptr_t        __vala_rt_stack_high __attribute__ ((tls_model ("initial-exec"))) = 0;
+
+static int
+__vala_rt_add_executable_ranges (struct dl_phdr_info *info, __attribute__ ((unused)) size_t size, void *data)
+{
+  struct executable_ranges *ranges = data;
+  ranges->adds = info->dlpi_adds;
+  ranges->subs = info->dlpi_subs;
+  for (ElfW (Half) i = 0; i < info->dlpi_phnum && ranges->n_ranges < MAX_EXECUTABLE_RANGES; i++)
+    {
+      const ElfW (Phdr) *phdr = &info->dlpi_phdr[i];
+      if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X))
+        {
+          ranges->ranges[ranges->n_ranges].start = info->dlpi_addr + phdr->p_vaddr;
+          ranges->ranges[ranges->n_ranges].end = info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz;
+          ranges->n_ranges++;
+        }
+    }
+  return 0;
+}
+
+static int
+__vala_rt_compare_ranges (const void *a, const void *b)
+{
+  const struct executable_range *r1 = a;
+  const struct executable_range *r2 = b;
+  return r1->start < r2->start ? -1 : r1->start > r2->start;
+}
+
+static int
+__vala_rt_read_counters (struct dl_phdr_info *info, __attribute__ ((unused)) size_t size, void *data)
+{
+  unsigned long long *counters = data;
+  counters[0] = info->dlpi_adds;
+  counters[1] = info->dlpi_subs;
+  return 1;
+}
+
+static int
+__vala_rt_ranges_current (const struct executable_ranges *ranges, const unsigned long long *counters)
+{
+  return ranges && ranges->adds == counters[0] && ranges->subs == counters[1];
+}
+
+// Rebuilds the table of executable segments if modules were loaded or unloaded
+// since it was built. Returns 1 if it was rebuilt. Not usable from signal
+// handlers.
+int
+__vala_rt_refresh_executable_ranges (void)
+{
+  unsigned long long counters[2] = { 0, 0 };
+  dl_iterate_phdr (__vala_rt_read_counters, counters);
+  if (__vala_rt_ranges_current (__atomic_load_n (&__vala_rt_executable_ranges, __ATOMIC_ACQUIRE), counters))
+    {
+      return 0;
+    }
+  int rebuilt = 0;
+  pthread_mutex_lock (&__vala_rt_executable_ranges_lock);
+  // Another thread may have been faster
+  if (!__vala_rt_ranges_current (__atomic_load_n (&__vala_rt_executable_ranges, __ATOMIC_ACQUIRE), counters))
+    {
+      struct executable_ranges *ranges = calloc (1, sizeof (struct executable_ranges));
+      if (ranges)
+        {
+          dl_iterate_phdr (__vala_rt_add_executable_ranges, ranges);
+          qsort (ranges->ranges, ranges->n_ranges, sizeof (struct executable_range), __vala_rt_compare_ranges);
+          __atomic_store_n (&__vala_rt_executable_ranges, ranges, __ATOMIC_RELEASE);
+          rebuilt = 1;
+        }
+    }
+  pthread_mutex_unlock (&__vala_rt_executable_ranges_lock);
+  return rebuilt;
+}
+
+// Like __vala_rt_refresh_executable_ranges, for unwinds that were rejected. A
+// chain can be rejected for good reasons, like code without frame pointers, so
+// only one thread per interval gets to check, instead of every capture taking
+// the loader lock.
+int
+__vala_rt_refresh_executable_ranges_throttled (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  unsigned long long now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  unsigned long long last = __atomic_load_n (&__vala_rt_executable_ranges_last_check, __ATOMIC_RELAXED);
+  if (now - last < RANGES_REFRESH_INTERVAL_NS
+      || !__atomic_compare_exchange_n (
+          &__vala_rt_executable_ranges_last_check, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      return 0;
+    }
+  return __vala_rt_refresh_executable_ranges ();
+}
+
+static int
+__vala_rt_is_executable (uintptr_t addr)
+{
+  const struct executable_ranges *ranges = __atomic_load_n (&__vala_rt_executable_ranges, __ATOMIC_ACQUIRE);
+  if (!ranges)
+    {
+      return 0;
+    }
+  size_t low = 0;
+  size_t high = ranges->n_ranges;
+  while (low < high)
+    {
+      size_t mid = low + (high - low) / 2;
+      if (addr < ranges->ranges[mid].start)
+        {
+          high = mid;
+        }
+      else if (addr >= ranges->ranges[mid].end)
+        {
+          low = mid + 1;
+        }
+      else
+        {
+          return 1;
+        }
+    }
+  return 0;
+}
+
+// Remembers the stack bounds of the calling thread. Not usable from signal
+// handlers.
+void
+__vala_rt_init_stack_bounds (void)
+{
+  if (__vala_rt_stack_high)
+    {
+      return;
+    }
+  pthread_attr_t attr;
+  if (pthread_getattr_np (pthread_self (), &attr))
+    {
+      return;
+    }
+  void  *addr;
+  size_t size;
+  if (pthread_attr_getstack (&attr, &addr, &size) == 0)
+    {
+      __vala_rt_stack_low = (uintptr_t)addr;
+      __vala_rt_stack_high = (uintptr_t)addr + size;
+    }
+  pthread_attr_destroy (&attr);
+}
+
+// Steps from the frame at *fp to the one of its caller, storing its return
+// address in *ret. Returns 0 at the end of the chain, -1 if a frame looks
+// invalid.
+static int
+__vala_rt_fp_step (uintptr_t *fp, uintptr_t *low, uintptr_t high, uintptr_t *ret)
+{
+  // The outermost frame has a frame pointer of 0, but as the startup code of
+  // the C library may be compiled without frame pointers, anything that can't
+  // be an address ends the chain, too.
+  if (*fp < END_OF_CHAIN)
+    {
+      return 0;
+    }
+  if (*fp < *low || *fp > high - 2 * sizeof (uintptr_t) || *fp % sizeof (uintptr_t))
+    {
+      return -1;
+    }
+  uintptr_t next = ((const uintptr_t *)*fp)[0];
+  *ret = ((const uintptr_t *)*fp)[1];
+  if (!*ret)
+    {
+      return 0;
+    }
+  if (!__vala_rt_is_executable (*ret) || (next >= END_OF_CHAIN && next <= *fp))
+    {
+      return -1;
+    }
+  *low = *fp;
+  *fp = next;
+  return 1;
+}
+
+// Collects the return addresses starting at the frame fp, sp being the current
+// stack pointer. Returns -1 if a frame looks invalid.
+int
+__vala_rt_unwind_fp (uintptr_t fp, uintptr_t sp, uintptr_t *ips, int max)
+{
+  // Below the stack pointer, the stack may not be mapped.
+  uintptr_t low = sp > __vala_rt_stack_low ? sp : __vala_rt_stack_low;
+  uintptr_t high = __vala_rt_stack_high;
+  if (!high)
+    {
+      return -1;
+    }
+  int n = 0;
+  int ret = 1;
+  while (n < max && (ret = __vala_rt_fp_step (&fp, &low, high, &ips[n])) == 1)
+    {
+      n++;
+    }
+  return ret < 0 ? -1 : n;
+}
+
+static int
+__vala_rt_context_registers (const void *context, uintptr_t *pc, uintptr_t *fp, uintptr_t *sp)
+{
+  const ucontext_t *uc = context;
+#if defined(__x86_64__)
+  *pc = uc->uc_mcontext.gregs[REG_RIP];
+  *fp = uc->uc_mcontext.gregs[REG_RBP];
+  *sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  *pc = uc->uc_mcontext.pc;
+  *fp = uc->uc_mcontext.regs[29];
+  *sp = uc->uc_mcontext.sp;
+#else
+  (void)uc;
+  *pc = 0;
+#endif
+  return *pc && __vala_rt_is_executable (*pc) ? 0 : -1;
+}
+
+// Like __vala_rt_unwind_fp, but starting at the interrupted instruction
+// of a signal context.
+int
+__vala_rt_unwind_fp_context (const void *context, uintptr_t *ips, int max)
+{
+  uintptr_t pc = 0;
+  uintptr_t fp = 0;
+  uintptr_t sp = 0;
+  if (max <= 0 || __vala_rt_context_registers (context, &pc, &fp, &sp))
+    {
+      return -1;
+    }
+  ips[0] = pc;
+  int n = __vala_rt_unwind_fp (fp, sp, &ips[1], max - 1);
+  return n < 0 ? -1 : n + 1;
+}
+
+// Like __vala_rt_unwind_fp_context, but folding all frames into stack, up to
+// MAX_UNWIND_DEPTH. Returns -1 if a frame looks invalid, stack has to be
+// started again then.
+int
+__vala_rt_unwind_fp_context_folded (const void *context, struct vala_rt_folded_stack *stack)
+{
+  uintptr_t pc = 0;
+  uintptr_t fp = 0;
+  uintptr_t sp = 0;
+  uintptr_t high = __vala_rt_stack_high;
+  if (!high || __vala_rt_context_registers (context, &pc, &fp, &sp))
+    {
+      return -1;
+    }
+  uintptr_t low = sp > __vala_rt_stack_low ? sp : __vala_rt_stack_low;
+  __vala_rt_fold_begin (stack);
+  __vala_rt_fold_push (stack, pc);
+  int       ret = 0;
+  uintptr_t ip;
+  while (stack->n_frames < MAX_UNWIND_DEPTH && (ret = __vala_rt_fp_step (&fp, &low, high, &ip)) == 1)
+    {
+      __vala_rt_fold_push (stack, ip);
+    }
+  return ret < 0 ? -1 : 0;
+}
+
+void
+vala_rt_set_unwinder (enum vala_rt_unwinder unwinder)
+{
+  if (unwinder == VALA_RT_UNWINDER_FRAME_POINTER)
+    {
+      __vala_rt_refresh_executable_ranges ();
+      __vala_rt_init_stack_bounds ();
+    }
+  __vala_rt_use_frame_pointers = unwinder == VALA_RT_UNWINDER_FRAME_POINTER;
+}
@@ -0,0 +1,321 @@
+/* vala-rt-format.h
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#pragma once
+
+/*
+ * On-disk formats shared between the runtime and the tools.
+ *
+ * VDBG version 1 (Linear):
+ *   "VDBG" u8:version u32be:n_functions
+ *   n_functions * (u16be:len char[len + 1]:c_name u16be:len char[len + 1]:vala_name)
+ *
+ * VDBG version 2 (Indexed):
+ *   struct vala_rt_vdbg2_header
+ *   n_entries * struct vala_rt_name_index_entry, sorted by the C name (strcmp)
+ *   Blob of NUL-terminated strings, the index entries point into it.
+ *
+ * .debug_info_vala version 1 (Linear, may be preceded by padding):
+ *   "VALA_DEBUG_INFO1" u64:version u64be:n_mappings
+ *   n_mappings * (u8:len char[len]:c_name u8 u8 u8:len char[len]:vala_name u8 u8)
+ *
+ * .debug_info_vala version 2 (Indexed, starts at the beginning of the section):
+ *   struct vala_rt_section2_header
+ *   n_entries * struct vala_rt_name_index_entry, sorted by the C name (strcmp)
+ *   Blob of NUL-terminated strings, the index entries point into it.
+ *
+ * .vala_signal_mappings (Should be SHF_ALLOC, so it survives strip):
+ *   struct vala_rt_signal_section_header
+ *   n_entries * struct vala_rt_name_index_entry (C name, signal name), sorted by
+ *   the C name (strcmp)
+ *   Blob of NUL-terminated strings, the index entries point into it.
+ *
+ * Address index (.vala_addr_index section, or .build-id/xx/yyyy.vaddr next to
+ * the .vdbg files, written by vala-rt-addr-index):
+ *   struct vala_rt_addr_index_header
+ *   n_ranges * struct vala_rt_addr_range, sorted by start, not overlapping
+ *   n_lines * struct vala_rt_addr_line, the lines of each range are sorted by
+ *   their offset
+ *   Blob of NUL-terminated strings, the ranges and lines point into it.
+ *   Addresses are the virtual addresses of the ELF file, so the load bias has to
+ *   be subtracted. Only functions with a Vala name are part of the index.
+ *
+ * Pack (vala-debug.vpack, one per debug directory):
+ *   struct vala_rt_vpack_header
+ *   n_buckets * struct vala_rt_name_index_entry, an open addressing hash table
+ *   keyed by __vala_rt_hash_name of the C name, using linear probing. Empty
+ *   buckets have VPACK_EMPTY_BUCKET as C name.
+ *   Blob of NUL-terminated strings, the buckets point into it.
+ *
+ * Crash record (vala-rt-<pid>.crash, written by the signal handler):
+ *   struct vala_rt_crash_header
+ *   n_frames * (u64:ip u32:cycle_len u32:count), the stack as folded by the
+ *     crash handler (See struct vala_rt_folded_frame). On the first frame of a
+ *     cycle, its length and how often it ran. On the placeholder of the frames
+ *     dropped from a deep stack, an ip of 0 and the number of frames
+ *   string:debug_prefix
+ *   n_extra_debug_directories * string:directory
+ *   n_modules * (u64:base u32:build_id_len u8[build_id_len]:build_id string:path)
+ *   n_signal_libraries * (string:path u32:n_mappings n_mappings * (string:c_name string:signal))
+ *   n_threads * (i32:tid u32:status u32:n_frames n_frames * u64:ip), the other
+ *     threads if all threads were dumped, status is a vala_rt_report_status
+ *   A string is u32:len followed by len bytes, the last one being a NUL. A len
+ *   of zero is a NULL string. The record is only read on the machine that wrote
+ *   it, so all integers are in native byte order.
+ *
+ * Symbol cache ($XDG_CACHE_HOME/vala-rt/symbols.cache):
+ *   struct vala_rt_symbol_cache_header
+ *   n_buckets * u32:offset of the newest entry in the bucket, 0 if empty
+ *   Entries, each aligned to 8 bytes:
+ *     struct vala_rt_symbol_cache_entry
+ *     u8[build_id_len]:build_id char[library_len]:library char[symbol_len]:symbol
+ *     char[function_len]:function char[filename_len]:filename
+ *     char[signal_len]:signal, the handled signal, if found in the
+ *     .vala_signal_mappings section of the module
+ *   Buckets are chosen by the hash of the build-id and the offset. Each entry
+ *   links to the previous head of its bucket. The strings include their NUL,
+ *   a length of 0 is a NULL string. The cache never leaves the machine that
+ *   wrote it, so all integers are in native byte order.
+ *
+ * Binary crash report (VALA_RT_REPORT_BINARY, written by the crash handler):
+ *   A stream of records, each u8:type u32:len followed by len bytes, so unknown
+ *   types can be skipped. Every report is a begin record, its frames and an
+ *   end record.
+ *   REPORT_RECORD_BEGIN: "VREP" u8:version i32:signum (0 for other threads
+ *     of a thread dump) i32:id (the pid, or the tid for other threads)
+ *     string:signal_name
+ *   REPORT_RECORD_FRAME: u64:ip u8:flags (VALA_RT_REPORT_FRAME_*)
+ *     string:library string:function string:signal string:filename i32:line
+ *     u32:cycle_len u32:repeats u32:omitted (Since version 2. On the first frame
+ *     of a folded cycle, its length and how often it ran. On the placeholder of
+ *     frames dropped from a deep stack, an ip of 0, the number of frames)
+ *   REPORT_RECORD_END: u8:status (enum vala_rt_report_status) u32:n_frames
+ *     u64:fingerprint
+ *   REPORT_RECORD_CRASH_RECORD: i32:signum string:path
+ *   A string is u16:len followed by len bytes, a len of REPORT_NULL_STRING is a
+ *   NULL string. A line of -1 is unknown.
+ *
+ * All integers are big endian, unless noted otherwise.
+ */
+
+#define VDBG_MAGIC "VDBG"
+#define VDBG_VERSION_LINEAR 1
+#define VDBG_VERSION_INDEXED 2
+
+struct vala_rt_vdbg2_header
+{
+  char     magic[4];
+  uint8_t  version;
+  uint8_t  reserved[3];
+  uint32_t n_entries;
+  uint32_t index_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+};
+
+#define SECTION_MAGIC_LINEAR "VALA_DEBUG_INFO1"
+#define SECTION_MAGIC_INDEXED "VALA_DEBUG_INFO2"
+
+// Offsets are relative to the start of the section.
+struct vala_rt_section2_header
+{
+  char     magic[16];
+  uint32_t n_entries;
+  uint32_t index_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+};
+
+#define SIGNAL_SECTION_NAME ".vala_signal_mappings"
+#define SIGNAL_SECTION_MAGIC "VSIG"
+#define SIGNAL_SECTION_VERSION 1
+
+// Offsets are relative to the start of the section.
+struct vala_rt_signal_section_header
+{
+  char     magic[4];
+  uint8_t  version;
+  uint8_t  reserved[3];
+  uint32_t n_entries;
+  uint32_t index_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+};
+
+#define ADDR_INDEX_SECTION_NAME ".vala_addr_index"
+#define ADDR_INDEX_MAGIC "VADR"
+#define ADDR_INDEX_VERSION 1
+
+// Offsets are relative to the start of the index.
+struct vala_rt_addr_index_header
+{
+  char     magic[4];
+  uint8_t  version;
+  uint8_t  reserved[3];
+  uint32_t n_ranges;
+  uint32_t ranges_offset;
+  uint32_t n_lines;
+  uint32_t lines_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+};
+
+// A function, or a part of it. symbol and function point into the string blob,
+// first_line and n_lines select its lines.
+struct vala_rt_addr_range
+{
+  uint64_t start;
+  uint32_t size;
+  uint32_t symbol;
+  uint32_t function;
+  uint32_t first_line;
+  uint32_t n_lines;
+  uint32_t reserved;
+};
+
+// Valid from offset (Relative to the start of its range) up to the next line.
+struct vala_rt_addr_line
+{
+  uint32_t offset;
+  uint32_t filename;
+  int32_t  lineno;
+};
+
+#define VPACK_MAGIC "VPAK"
+#define VPACK_VERSION 1
+#define VPACK_FILENAME "vala-debug.vpack"
+#define VPACK_EMPTY_BUCKET 0xffffffffu
+
+// Offsets are relative to the start of the file, n_buckets is a power of two.
+struct vala_rt_vpack_header
+{
+  char     magic[4];
+  uint8_t  version;
+  uint8_t  reserved[3];
+  uint32_t n_entries;
+  uint32_t n_buckets;
+  uint32_t buckets_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+};
+
+#define CRASH_RECORD_MAGIC "VCRS"
+#define CRASH_RECORD_VERSION 3
+
+struct vala_rt_crash_header
+{
+  char     magic[4];
+  uint32_t version;
+  int32_t  signum;
+  int32_t  pid;
+  uint32_t n_frames;
+  uint32_t n_modules;
+  uint32_t n_extra_debug_directories;
+  uint32_t n_signal_libraries;
+  // Frames dropped from the middle of a deep stack
+  uint32_t n_dropped;
+  uint32_t n_threads;
+  // siginfo_t
+  uint8_t siginfo[128];
+};
+
+#define SYMBOL_CACHE_MAGIC "VSYC"
+#define SYMBOL_CACHE_VERSION 1
+
+struct vala_rt_symbol_cache_header
+{
+  char     magic[4];
+  uint8_t  version;
+  uint8_t  reserved[3];
+  uint32_t n_buckets;
+  uint32_t reserved2;
+};
+
+struct vala_rt_symbol_cache_entry
+{
+  uint32_t next;
+  uint8_t  build_id_len;
+  uint8_t  reserved;
+  uint16_t library_len;
+  // Relative to the load address of the module
+  uint64_t offset;
+  int32_t  lineno;
+  uint16_t symbol_len;
+  uint16_t function_len;
+  uint16_t filename_len;
+  uint16_t signal_len;
+  uint8_t  reserved2[4];
+};
+
+#define REPORT_MAGIC "VREP"
+#define REPORT_VERSION 2
+#define REPORT_NULL_STRING 0xffff
+
+enum vala_rt_report_record_type
+{
+  REPORT_RECORD_BEGIN = 1,
+  REPORT_RECORD_FRAME = 2,
+  REPORT_RECORD_END = 3,
+  REPORT_RECORD_CRASH_RECORD = 4,
+};
+
+// Offsets are relative to the start of the string blob.
+struct vala_rt_name_index_entry
+{
+  uint32_t c_name;
+  uint32_t vala_name;
+};
+
+static inline uint32_t
+__vala_rt_read_be32 (const void *ptr)
+{
+  uint32_t ret;
+  memcpy (&ret, ptr, sizeof (ret));
+  return be32toh (ret);
+}
+
+static inline uint64_t
+__vala_rt_read_be64 (const void *ptr)
+{
+  uint64_t ret;
+  memcpy (&ret, ptr, sizeof (ret));
+  return be64toh (ret);
+}
+
+static inline uint16_t
+__vala_rt_read_be16 (const void *ptr)
+{
+  uint16_t ret;
+  memcpy (&ret, ptr, sizeof (ret));
+  return be16toh (ret);
+}
+
+// FNV-1a
+static inline uint32_t
+__vala_rt_hash_name (const char *name, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    {
+      hash ^= (uint8_t)name[i];
+      hash *= 16777619u;
+    }
+  return hash;
+}
@@ -1,10 +1,496 @@
 #define _GNU_SOURCE
+#include "vala-rt.h"
 #include <elfutils/libdwelf.h>
 #include <elfutils/libdwfl.h>
+#include <libunwind.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #pragma once
 
+#define DEBUGINFOD_BUFFER_SIZE 256
+#define MAX_BACKTRACE_DEPTH 150
+#define MAX_BUILD_ID_LEN 64
+// Of a Vala name copied out of a .vdbg
+#define MAX_FUNCTION_NAME_LEN 1024
+#define MAX_CACHED_MODULES 128
+// Unwinding a runaway recursion stops here
+#define MAX_UNWIND_DEPTH (1 << 20)
+#define MAX_CYCLE_LENGTH 8
+#define FOLDED_TOP_FRAMES 100
+// One frame is left for the placeholder of the dropped frames
+#define FOLDED_TAIL_FRAMES (MAX_BACKTRACE_DEPTH - FOLDED_TOP_FRAMES - 1)
+
+// Everything the crash handler needs to know about a module. It is
+// resolved once per module and shared by all frames within that module.
+struct vala_rt_module
+{
+  Dwfl_Module *module;
+  const char  *name;
+  Elf         *elf;
+  Dwarf       *dwarf;
+  Dwarf       *alt_dwarf;
+  // Owned by libdwfl
+  const unsigned char *build_id;
+  int                  build_id_len;
+  // $dir/.build-id/xx/yyyy.vdbg, if installed
+  const uint8_t *vdbg_data;
+  size_t         vdbg_size;
+  // ELF found via the build-id, only used if the module itself has no section.
+  Elf        *debug_elf;
+  int         debug_fd;
+  // Already decompressed, if the section was compressed.
+  const void *section_data;
+  size_t      section_size;
+  // .vala_signal_mappings, if the module has one
+  const void *signal_data;
+  size_t      signal_size;
+  // .vala_addr_index or $dir/.build-id/xx/yyyy.vaddr, if valid
+  const uint8_t *addr_index_data;
+  size_t         addr_index_size;
+  int            addr_index_mapped;
+  // Subtracted from an address before looking it up in the address index
+  GElf_Addr bias;
+  // Everything below addr_index is only loaded once a frame misses the
+  // address index, see __vala_rt_module_load_debug_info
+  int debug_info_loaded;
+};
+
+// Decompressed sections of the modules of a session
+struct vala_rt_section_arena
+{
+  uint8_t *data;
+  size_t   used;
+};
+
+// A Dwfl and the modules resolved in it. The crash handler, the crash helper
+// and vala-rt-symbolize use __vala_rt_crash_session, vala_rt_backtrace_symbolize
+// has its own, so they never share any state.
+struct vala_rt_session
+{
+  Dwfl                 *dwfl;
+  struct vala_rt_module modules[MAX_CACHED_MODULES];
+  size_t                n_modules;
+  // Used if there are more modules than cache entries. Released by every
+  // session end, even if it was never filled, so it must not own fd 0.
+  struct vala_rt_module        overflow_module;
+  struct vala_rt_section_arena arena;
+  // Vala names copied out of the files in the search directories
+  char function_buffer[MAX_FUNCTION_NAME_LEN];
+};
+
+#define VALA_RT_SESSION_INIT { .overflow_module = { .debug_fd = -1 } }
+
+enum vala_rt_section_compression
+{
+  VALA_RT_SECTION_ZLIB,
+  VALA_RT_SECTION_ZSTD,
+};
+
+// A sorted table of C name/Vala name pairs, see vala-rt-format.h
+struct vala_rt_name_index
+{
+  const uint8_t *entries;
+  uint32_t       n_entries;
+  const char    *strings;
+  uint32_t       strings_size;
+};
+
+struct vala_rt_crash_module
+{
+  uint64_t       base;
+  const char    *path;
+  const uint8_t *build_id;
+  uint32_t       build_id_len;
+};
+
+// A loaded crash record, all pointers point into data.
+struct vala_rt_crash_record
+{
+  uint8_t                     *data;
+  size_t                       size;
+  int                          signum;
+  int                          pid;
+  siginfo_t                    info;
+  struct vala_rt_folded_stack *stack;
+  // The other threads, if all threads were dumped
+  struct vala_rt_thread_stack *threads;
+  uint32_t                     n_threads;
+  struct vala_rt_crash_module *modules;
+  uint32_t                     n_modules;
+  const char                  *debug_prefix;
+  const char                 **extra_debug_directories;
+};
+
+// A symbolized frame, every field may be NULL if it could not be resolved.
+struct vala_rt_resolved_frame
+{
+  // As in the symbol table
+  const char *symbol;
+  const char *function_name;
+  const char *library_name;
+  const char *filename;
+  int         lineno;
+};
+
+// An offset in the string pool, see string_pool.c
+typedef uint32_t string_id;
+
+// A frame of a backtrace as printed. The names are in the string pool, an id
+// of 0 is unknown.
+struct stack_frame
+{
+  string_id  function_name;
+  string_id  library_name;
+  string_id  filename;
+  int        lineno;
+  unw_word_t ip;
+  int        skip : 2;
+  int        collapsed : 2;
+  // Set if collapsed by a signal rule
+  const char *signal_name;
+  // On the first frame of a cycle, the number of frames in it and how often it
+  // was repeated in total, see fold.c
+  uint32_t cycle_len;
+  uint32_t repeats;
+  // Set on the placeholder of frames dropped from a deep stack
+  uint32_t omitted;
+};
+
+// A frame of a folded stack. An ip of 0 is the placeholder of count dropped
+// frames.
+struct vala_rt_folded_frame
+{
+  uintptr_t ip;
+  // Set on the first frame of a cycle, count is the number of repetitions then.
+  uint32_t cycle_len;
+  uint32_t count;
+};
+
+// A stack as folded by __vala_rt_fold_push, see fold.c
+struct vala_rt_folded_stack
+{
+  struct vala_rt_folded_frame top[FOLDED_TOP_FRAMES];
+  struct vala_rt_folded_frame tail[FOLDED_TAIL_FRAMES];
+  int                         n_top;
+  int                         tail_start;
+  int                         n_tail;
+  uint32_t                    n_dropped;
+  // Including the repetitions and the dropped frames
+  uint32_t n_frames;
+  // The first frame of the cycle that is still repeating, or -1
+  int run;
+  int run_pos;
+  // Frames before this one are part of a cycle
+  int plain_start;
+  // Set by __vala_rt_fold_finish
+  struct vala_rt_folded_frame frames[MAX_BACKTRACE_DEPTH];
+  int                         n;
+};
+
+#define VALA_RT_REPORT_FRAME_SKIPPED 1
+// Replaced by the signal that called it
+#define VALA_RT_REPORT_FRAME_COLLAPSED 2
+
+// A frame of a report in one of the machine readable formats
+struct vala_rt_report_frame
+{
+  uintptr_t   ip;
+  const char *library_name;
+  const char *function_name;
+  // The name of the signal, if collapsed
+  const char *signal_name;
+  const char *filename;
+  int         lineno;
+  int         flags;
+  // Like in struct stack_frame
+  uint32_t cycle_len;
+  uint32_t repeats;
+  uint32_t omitted;
+};
+
+enum vala_rt_report_status
+{
+  VALA_RT_REPORT_STATUS_OK,
+  // Only for thread dumps
+  VALA_RT_REPORT_STATUS_NO_RESPONSE,
+  VALA_RT_REPORT_STATUS_EXITED,
+};
+
+// A thread interrupted by __vala_rt_interrupt_other_threads. Only a status of
+// VALA_RT_REPORT_STATUS_OK has frames.
+struct vala_rt_thread_stack
+{
+  pid_t                      tid;
+  enum vala_rt_report_status status;
+  const uintptr_t           *ips;
+  uint32_t                   n_frames;
+};
+
+// As returned by the getdents syscall
+struct linux_dirent
+{
+  unsigned long  d_ino;
+  unsigned long  d_off;
+  unsigned short d_reclen;
+  char           d_name[];
+};
+
+// Either mappings or, if registered using __vala_register_signal_mappings2,
+// strings and mappings2 are set.
+struct mapping_holder
+{
+  char                               *library_path;
+  const struct vala_signal_mappings  *mappings;
+  const char                         *strings;
+  const struct vala_signal_mappings2 *mappings2;
+  size_t                              n_mappings;
+};
+
+static inline const char *
+__vala_rt_mapping_c_name (const struct mapping_holder *holder, size_t i)
+{
+  return holder->mappings2 ? &holder->strings[holder->mappings2[i].c_function_name]
+                           : holder->mappings[i].c_function_name;
+}
+
+static inline const char *
+__vala_rt_mapping_signal_name (const struct mapping_holder *holder, size_t i)
+{
+  return holder->mappings2 ? &holder->strings[holder->mappings2[i].demangled_signal_name]
+                           : holder->mappings[i].demangled_signal_name;
+}
+
+extern struct mapping_holder *__vala_rt_signal_mappings;
+extern size_t                 __vala_rt_n_signal_mappings;
+
+extern char __vala_rt_debuginfod_location1[DEBUGINFOD_BUFFER_SIZE];
+extern char __vala_rt_debuginfod_location2[DEBUGINFOD_BUFFER_SIZE];
+
+void
+__vala_rt_init_debuginfod_locations (void);
+
+// Called with 1 for a pack and 0 for a .vdbg
+typedef void (*mapped_names_func) (int, const uint8_t *, size_t, void *);
+// Called with the C name and the Vala name of every entry of a table
+typedef void (*name_pair_func) (const char *, const char *, void *);
+
+const char *
+__vala_rt_find_function_internal_file (const char *, char *, size_t);
+void
+__vala_rt_map_search_directories (mapped_names_func, void *);
+int
+__vala_rt_map_by_build_id (const unsigned char *, int, const char *, const uint8_t **, size_t *);
+void
+__vala_rt_format_build_id (char *, const unsigned char *, int);
+const char *
+__vala_rt_find_function_internal_section (const char *, const void *, size_t);
+void
+__vala_rt_section_foreach (const void *, size_t, name_pair_func, void *);
+const void *
+__vala_rt_section_decompress (struct vala_rt_section_arena *, int, const void *, size_t, size_t);
+void
+__vala_rt_section_arena_reset (struct vala_rt_section_arena *);
+
+int
+__vala_rt_name_index_init (struct vala_rt_name_index *, const uint8_t *, size_t, uint32_t, uint32_t, uint32_t, uint32_t);
+const char *
+__vala_rt_name_index_find (const struct vala_rt_name_index *, const char *);
+void
+__vala_rt_name_index_foreach (const struct vala_rt_name_index *, name_pair_func, void *);
+const char *
+__vala_rt_vdbg_lookup (const uint8_t *, size_t, const char *);
+void
+__vala_rt_vdbg_foreach (const uint8_t *, size_t, name_pair_func, void *);
+const char *
+__vala_rt_pack_lookup (const uint8_t *, size_t, const char *);
+void
+__vala_rt_pack_foreach (const uint8_t *, size_t, name_pair_func, void *);
+const char *
+__vala_rt_signal_section_lookup (const uint8_t *, size_t, const char *);
+int
+__vala_rt_addr_index_valid (const uint8_t *, size_t);
+int
+__vala_rt_addr_index_lookup (const uint8_t *, uint64_t, struct vala_rt_resolved_frame *);
+
+void
+__vala_rt_resolve_frame (struct vala_rt_session *, uintptr_t, struct vala_rt_resolved_frame *);
+void
+__vala_rt_print_backtrace (const uintptr_t *, int);
+void
+__vala_rt_print_folded_backtrace (const struct vala_rt_folded_stack *);
+void
+__vala_rt_fold_begin (struct vala_rt_folded_stack *);
+void
+__vala_rt_fold_push (struct vala_rt_folded_stack *, uintptr_t);
+void
+__vala_rt_fold_finish (struct vala_rt_folded_stack *);
+const char *
+__vala_rt_find_signal (const char *, const char *);
+int
+__vala_rt_import_remote_signal_mappings (pid_t);
+int
+__vala_rt_send_to_crash_helper (int, const siginfo_t *, const struct vala_rt_folded_stack *, int);
+int
+__vala_rt_interrupt_other_threads (void);
+void
+__vala_rt_get_other_thread (int, struct vala_rt_thread_stack *);
+void
+__vala_rt_print_thread_stack (const struct vala_rt_thread_stack *);
+void
+__vala_rt_print_other_threads (int);
+void
+__vala_rt_profiler_start_from_env (void);
+void
+__vala_rt_report_settings_from_env (void);
+int
+__vala_rt_report_get_fd (void);
+void
+__vala_rt_collapse_rules_from_env (void);
+void
+__vala_rt_collapse_frames (struct stack_frame *, int);
+void
+__vala_rt_string_pool_reset (void);
+string_id
+__vala_rt_string_pool_add_parts (const char *const *, int);
+string_id
+__vala_rt_string_pool_add (const char *);
 const char *
-__vala_rt_find_function_internal_file (const char *);
+__vala_rt_string_pool_get (string_id);
+
+void
+__vala_rt_report_append (const char *, size_t);
+void
+__vala_rt_report_string (const char *);
+void
+__vala_rt_report_pad (size_t);
+size_t
+__vala_rt_report_decimal (long);
+void
+__vala_rt_report_hex (uint64_t, int);
+void
+__vala_rt_report_flush (void);
+void
+__vala_rt_report_begin (int, int);
+void
+__vala_rt_report_frame (const struct vala_rt_report_frame *);
+void
+__vala_rt_report_end (enum vala_rt_report_status);
+void
+__vala_rt_report_crash_record (int, const char *);
+extern int __vala_rt_report_format;
+
+int
+__vala_rt_write_crash_record (int, const siginfo_t *, const struct vala_rt_folded_stack *, int);
+int
+__vala_rt_send_crash_record (int, int, int, int, const siginfo_t *, const struct vala_rt_folded_stack *, int);
+int
+__vala_rt_load_crash_record (const char *, struct vala_rt_crash_record *);
+int
+__vala_rt_parse_crash_record (uint8_t *, size_t, struct vala_rt_crash_record *);
+void
+__vala_rt_free_crash_record (struct vala_rt_crash_record *);
+struct dl_phdr_info;
+int
+__vala_rt_phdr_build_id (const struct dl_phdr_info *, const uint8_t **);
+
+int
+__vala_rt_symbol_cache_lookup (uintptr_t, struct vala_rt_resolved_frame *);
+void
+__vala_rt_symbol_cache_store (uintptr_t, const struct vala_rt_resolved_frame *);
+void
+__vala_rt_symbol_cache_use_record (const struct vala_rt_crash_record *);
 const char *
-__vala_rt_find_function_internal_section (const char *, const void *, size_t, int);
+__vala_rt_symbol_cache_find_signal (const char *, const char *);
+
+extern struct vala_rt_session __vala_rt_crash_session;
+
+Dwfl *
+__vala_rt_session_begin (struct vala_rt_session *);
+Dwfl *
+__vala_rt_session_begin_offline (struct vala_rt_session *, const struct vala_rt_crash_record *);
+void
+__vala_rt_session_end (struct vala_rt_session *);
+struct vala_rt_module *
+__vala_rt_module_for_address (struct vala_rt_session *, Dwarf_Addr);
+struct vala_rt_module *
+__vala_rt_module_by_name (struct vala_rt_session *, const char *);
+void
+__vala_rt_module_load_debug_info (struct vala_rt_session *, struct vala_rt_module *);
+
+extern int __vala_rt_use_frame_pointers;
+
+int
+__vala_rt_refresh_executable_ranges (void);
+int
+__vala_rt_refresh_executable_ranges_throttled (void);
+void
+__vala_rt_init_stack_bounds (void);
+int
+__vala_rt_unwind_fp (uintptr_t, uintptr_t, uintptr_t *, int);
+int
+__vala_rt_unwind_fp_context (const void *, uintptr_t *, int);
+int
+__vala_rt_unwind_fp_context_folded (const void *, struct vala_rt_folded_stack *);
+
+// Unwinds from a signal handler, starting at the interrupted frame, using the
+// frame pointers if selected and valid, else using libunwind. Always inlined,
+// so the context belongs to the signal handler.
+static inline __attribute__ ((always_inline)) int
+__vala_rt_capture_frames (const void *context, uintptr_t *ips, int max)
+{
+  if (__vala_rt_use_frame_pointers && context)
+    {
+      int n = __vala_rt_unwind_fp_context (context, ips, max);
+      if (n >= 0)
+        {
+          return n;
+        }
+    }
+  unw_context_t uc = { 0 };
+  unw_getcontext (&uc);
+  unw_cursor_t cursor = { 0 };
+#ifdef UNW_INIT_SIGNAL_FRAME
+  unw_init_local2 (&cursor, &uc, UNW_INIT_SIGNAL_FRAME);
+#else
+  unw_init_local (&cursor, &uc);
+#endif
+  unw_step (&cursor);
+  int n = 0;
+  while (unw_step (&cursor) > 0 && n < max)
+    {
+      unw_word_t ip;
+      unw_get_reg (&cursor, UNW_REG_IP, &ip);
+      ips[n++] = ip;
+    }
+  return n;
+}
+
+// Like __vala_rt_capture_frames, but without a limit on the number of frames,
+// folding them into stack. Finishes the stack.
+static inline __attribute__ ((always_inline)) void
+__vala_rt_capture_folded (const void *context, struct vala_rt_folded_stack *stack)
+{
+  if (__vala_rt_use_frame_pointers && context && __vala_rt_unwind_fp_context_folded (context, stack) == 0)
+    {
+      __vala_rt_fold_finish (stack);
+      return;
+    }
+  __vala_rt_fold_begin (stack);
+  unw_context_t uc = { 0 };
+  unw_getcontext (&uc);
+  unw_cursor_t cursor = { 0 };
+#ifdef UNW_INIT_SIGNAL_FRAME
+  unw_init_local2 (&cursor, &uc, UNW_INIT_SIGNAL_FRAME);
+#else
+  unw_init_local (&cursor, &uc);
+#endif
+  unw_step (&cursor);
+  while (unw_step (&cursor) > 0 && stack->n_frames < MAX_UNWIND_DEPTH)
+    {
+      unw_word_t ip;
+      unw_get_reg (&cursor, UNW_REG_IP, &ip);
+      __vala_rt_fold_push (stack, ip);
+    }
+  __vala_rt_fold_finish (stack);
+}
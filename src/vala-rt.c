@@ -19,6 +19,7 @@
 #define _GNU_SOURCE
 
 #include "vala-rt.h"
+#include "vala-rt-format.h"
 #include "vala-rt-internal.h"
 #include <dlfcn.h>
 #include <elfutils/libdwfl.h>
@@ -29,13 +30,9 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#define MAX_SIGNAL_MAPPINGS 150
-#define MAX_BACKTRACE_DEPTH 150
-#define MAX_FUNCTIONNAME_LEN 128
-#define DEBUGINFOD_BUFFER_SIZE 256
-#define MAX_NAME_LENGTH 256
 #define MAX(a, b) (a > b ? a : b)
 
 static void
@@ -43,45 +40,49 @@ __vala_rt_handle_signal (int, siginfo_t *, void *);
 static void
 __vala_rt_add_handler (int);
 static const char *
-__vala_rt_find_function (const char *, unw_cursor_t *, void *, size_t, int);
-static const char *
-__vala_rt_find_signal (const char *, const char *);
-static void
-__vala_rt_format_signal_name (char *, const char *);
-static void
-__vala_rt_find_section_in_elf (Elf *, const char *, void **, size_t *);
-static int
-__vala_rt_find_debuginfo_by_id (Dwfl_Module *);
+__vala_rt_find_function (struct vala_rt_session *, const char *, const struct vala_rt_module *);
 
-struct mapping_holder
+// An entry of the hash index over all registered signal mappings, keyed by
+// the canonical library path and the C function name.
+struct signal_slot
 {
-  char                              *library_path;
-  const struct vala_signal_mappings *mappings;
-  size_t                             n_mappings;
+  uint32_t    hash;
+  const char *library_path;
+  const char *c_function_name;
+  const char *demangled_signal_name;
 };
 
-struct stack_frame
+// An entry of the hash index over the sorted tables, keyed by the canonical
+// library path. A library registered more than once has one entry per table.
+struct holder_slot
 {
-  char       function_name[MAX_FUNCTIONNAME_LEN];
-  char       library_name[MAX_NAME_LENGTH];
-  char       filename[MAX_NAME_LENGTH];
-  int        lineno;
-  unw_word_t ip;
-  int        skip : 2;
+  uint32_t hash;
+  size_t   holder;
 };
 
-struct mapping_holder     __vala_rt_signal_mappings[MAX_SIGNAL_MAPPINGS];
-size_t                    __vala_rt_n_signal_mappings = 0;
-static struct stack_frame __vala_rt_saved_stackframes[MAX_BACKTRACE_DEPTH];
-static int                __vala_rt_n_saved_stackframes;
-static int                __vala_rt_handler_triggered = 0;
-static int                __vala_rt_already_initialized = 0;
-static char               __vala_rt_debuginfod_location1[DEBUGINFOD_BUFFER_SIZE] = { 0 };
-static char               __vala_rt_debuginfod_location2[DEBUGINFOD_BUFFER_SIZE] = { 0 };
+struct mapping_holder     *__vala_rt_signal_mappings = NULL;
+size_t                     __vala_rt_n_signal_mappings = 0;
+static size_t              __vala_rt_signal_mappings_capacity = 0;
+static struct signal_slot *__vala_rt_signal_index = NULL;
+static size_t              __vala_rt_signal_index_size = 0;
+static size_t              __vala_rt_signal_index_used = 0;
+static struct holder_slot *__vala_rt_holder_index = NULL;
+static size_t              __vala_rt_holder_index_size = 0;
+static size_t              __vala_rt_holder_index_used = 0;
+static struct stack_frame  __vala_rt_saved_stackframes[MAX_BACKTRACE_DEPTH];
+static int                 __vala_rt_n_saved_stackframes;
+static struct vala_rt_folded_stack __vala_rt_captured_stack;
+static int                 __vala_rt_handler_triggered = 0;
+static int                 __vala_rt_already_initialized = 0;
+static int                 __vala_rt_debuginfod_locations_initialized = 0;
+char                       __vala_rt_debuginfod_location1[DEBUGINFOD_BUFFER_SIZE] = { 0 };
+char                       __vala_rt_debuginfod_location2[DEBUGINFOD_BUFFER_SIZE] = { 0 };
 
 // Initializes the runtime, doing these things:
-//   - Installing signal handlers
-//   - Collecting directories where debuginfo could be cached
+//   - Installing signal handlers and an alternate signal stack
+//   - Starting the profiler and the crash helper, if requested
+// It runs at startup of every Vala program, so everything else is deferred until
+// it is needed.
 void
 __vala_init (void)
 {
@@ -90,10 +91,39 @@ __vala_init (void)
       return;
     }
   __vala_rt_already_initialized = 1;
+  vala_rt_enable_signal_stack ();
   __vala_rt_add_handler (SIGSEGV);
   __vala_rt_add_handler (SIGILL);
   __vala_rt_add_handler (SIGFPE);
   __vala_rt_add_handler (SIGABRT);
+  __vala_rt_report_settings_from_env ();
+  const char *unwinder = getenv ("VALA_RT_UNWINDER");
+  if (unwinder && !strcmp (unwinder, "fp"))
+    {
+      vala_rt_set_unwinder (VALA_RT_UNWINDER_FRAME_POINTER);
+    }
+  if (getenv ("VALA_RT_ALL_THREADS"))
+    {
+      vala_rt_set_dump_all_threads (1);
+    }
+  __vala_rt_collapse_rules_from_env ();
+  __vala_rt_profiler_start_from_env ();
+  if (getenv ("VALA_RT_CRASH_HELPER"))
+    {
+      vala_rt_start_crash_helper ();
+    }
+}
+
+// Collects the directories where debuginfod could have cached debuginfo. Done
+// on first use, as getpwuid may have to ask NSS.
+void
+__vala_rt_init_debuginfod_locations (void)
+{
+  if (__vala_rt_debuginfod_locations_initialized)
+    {
+      return;
+    }
+  __vala_rt_debuginfod_locations_initialized = 1;
   if (getenv ("XDG_CACHE_HOME"))
     {
       snprintf ((char *)__vala_rt_debuginfod_location1, 255, "%s/debuginfod_client/", getenv ("XDG_CACHE_HOME"));
@@ -102,9 +132,13 @@ __vala_init (void)
 
   if ((homedir = getenv ("HOME")) == NULL)
     {
-      homedir = getpwuid (getuid ())->pw_dir;
+      struct passwd *pw = getpwuid (getuid ());
+      homedir = pw ? pw->pw_dir : NULL;
+    }
+  if (homedir)
+    {
+      snprintf ((char *)__vala_rt_debuginfod_location2, 255, "%s/.cache/debuginfod_client/", homedir);
     }
-  snprintf ((char *)__vala_rt_debuginfod_location2, 255, "%s/.cache/debuginfod_client/", homedir);
 }
 
 static void
@@ -122,351 +156,302 @@ __vala_rt_add_handler (int signum)
 static void
 print_initial_part (int curr, unw_word_t ip, int max)
 {
-  // 32 bytes for the address, 5 bytes for #count, 4 bytes for
-  // <0x and >, anything else is a bit of buffer.
-  char data[48] = { 0 };
-  if (max > 100)
+  // Aligns the addresses for up to 999 frames
+  size_t width = max > 100 ? 4 : max > 10 ? 3 : 2;
+  __vala_rt_report_append ("#", 1);
+  size_t len = __vala_rt_report_decimal (curr);
+  __vala_rt_report_pad (len < width ? width - len : 1);
+  __vala_rt_report_append ("<0x", 3);
+  __vala_rt_report_hex ((uint64_t)ip, 16);
+  __vala_rt_report_append ("> ", 2);
+}
+
+static void
+pad_string (const char *s, size_t len)
+{
+  size_t slen = strlen (s);
+  __vala_rt_report_append (s, slen);
+  __vala_rt_report_pad (slen <= len ? len - slen + 1 : 0);
+}
+
+static void
+__vala_rt_handle_signal (int signum, siginfo_t *info, void *_ctx)
+{
+  if (__vala_rt_handler_triggered)
     {
-      if (curr < 10)
-        {
-          sprintf (data, "#%d   ", curr);
-        }
-      else if (curr < 100)
-        {
-          sprintf (data, "#%d  ", curr);
-        }
-      else
-        {
-          sprintf (data, "#%d ", curr);
-        }
+      return;
     }
-  else if (max > 10)
+  __vala_rt_handler_triggered = 1;
+  __vala_rt_capture_folded (_ctx, &__vala_rt_captured_stack);
+  // Before choosing the output, so the other threads are in crash records, too
+  int n_threads = __vala_rt_interrupt_other_threads ();
+  // Symbolization is left to vala-rt-symbolize or the crash helper
+  if (__vala_rt_write_crash_record (signum, info, &__vala_rt_captured_stack, n_threads) == 0
+      || __vala_rt_send_to_crash_helper (signum, info, &__vala_rt_captured_stack, n_threads) == 0)
     {
-      if (curr < 10)
-        {
-          sprintf (data, "#%d  ", curr);
-        }
-      else
+      abort ();
+    }
+  __vala_rt_report_begin (signum, getpid ());
+  __vala_rt_print_folded_backtrace (&__vala_rt_captured_stack);
+  __vala_rt_print_other_threads (n_threads);
+  abort ();
+}
+
+// Resolves a single address using the given session, which has to be started.
+// The strings belong to the session. Frames in the address index of their module
+// don't need libdw.
+void
+__vala_rt_resolve_frame (struct vala_rt_session *session, uintptr_t ip, struct vala_rt_resolved_frame *resolved)
+{
+  memset (resolved, 0, sizeof (*resolved));
+  resolved->lineno = -1;
+  Dwarf_Addr             ipaddr = (uintptr_t)ip;
+  struct vala_rt_module *module = __vala_rt_module_for_address (session, ipaddr);
+  if (!module)
+    {
+      return;
+    }
+  resolved->library_name = module->name;
+  if (module->addr_index_data
+      && __vala_rt_addr_index_lookup (module->addr_index_data, ipaddr - module->bias, resolved) == 0)
+    {
+      return;
+    }
+  __vala_rt_module_load_debug_info (session, module);
+  resolved->symbol = dwfl_module_addrname (module->module, ipaddr);
+  resolved->function_name = __vala_rt_find_function (session, resolved->symbol, module);
+  Dwfl_Line *line = resolved->function_name ? dwfl_getsrc (session->dwfl, ipaddr) : NULL;
+  if (line)
+    {
+      int         nline;
+      Dwarf_Addr  addr;
+      const char *filename = dwfl_lineinfo (line, &addr, &nline, NULL, NULL, NULL);
+      if (filename)
         {
-          sprintf (data, "#%d ", curr);
+          resolved->filename = filename;
+          resolved->lineno = nline;
         }
     }
-  else
+}
+
+static void
+__vala_rt_print_frames_structured (void)
+{
+  for (int i = 0; i < __vala_rt_n_saved_stackframes; i++)
     {
-      sprintf (data, "#%d ", curr);
+      const struct stack_frame   *saved = &__vala_rt_saved_stackframes[i];
+      struct vala_rt_report_frame frame = { 0 };
+      frame.ip = saved->ip;
+      frame.library_name = saved->library_name ? __vala_rt_string_pool_get (saved->library_name) : NULL;
+      frame.function_name = saved->function_name ? __vala_rt_string_pool_get (saved->function_name) : NULL;
+      frame.signal_name = saved->signal_name;
+      frame.filename = saved->filename ? __vala_rt_string_pool_get (saved->filename) : NULL;
+      frame.lineno = frame.filename ? saved->lineno : -1;
+      frame.flags = (saved->skip ? VALA_RT_REPORT_FRAME_SKIPPED : 0)
+                    | (saved->collapsed ? VALA_RT_REPORT_FRAME_COLLAPSED : 0);
+      frame.cycle_len = saved->cycle_len;
+      frame.repeats = saved->repeats;
+      frame.omitted = saved->omitted;
+      __vala_rt_report_frame (&frame);
     }
-  write (STDERR_FILENO, data, strlen (data));
-  memset (data, 0, sizeof (data));
-  sprintf (data, "<0x%016lx> ", (uint64_t)ip);
-  write (STDERR_FILENO, data, strlen (data));
+  __vala_rt_report_end (VALA_RT_REPORT_STATUS_OK);
 }
 
-static void
-pad_string (const char *s, size_t len)
+// Symbolizes using the current session, starting one if there is none. The caller
+// ends it, so several backtraces can share the module cache. The backtrace is
+// written to the report fd, together with anything appended before.
+void
+__vala_rt_print_backtrace (const uintptr_t *ips, int n_frames)
+{
+  static struct vala_rt_folded_stack stack;
+  __vala_rt_fold_begin (&stack);
+  for (int i = 0; i < n_frames; i++)
+    {
+      __vala_rt_fold_push (&stack, ips[i]);
+    }
+  __vala_rt_fold_finish (&stack);
+  __vala_rt_print_folded_backtrace (&stack);
+}
+
+// Symbolizes a frame, unless an earlier frame had the same address. Returns 1
+// for the frame of main, nothing after it is interesting.
+static int
+__vala_rt_save_frame (struct stack_frame *saved, uintptr_t ip, Dwfl **dwfl)
 {
-  write (STDERR_FILENO, s, strlen (s));
-  for (size_t i = strlen (s); i <= len; i++)
+  for (int i = 0; i < __vala_rt_n_saved_stackframes; i++)
     {
-      write (STDERR_FILENO, " ", 1);
+      if (__vala_rt_saved_stackframes[i].ip == ip)
+        {
+          *saved = __vala_rt_saved_stackframes[i];
+          saved->skip = 0;
+          saved->collapsed = 0;
+          saved->signal_name = NULL;
+          return 0;
+        }
     }
+  struct vala_rt_resolved_frame resolved;
+  if (__vala_rt_symbol_cache_lookup (ip, &resolved))
+    {
+      // Only started once a frame misses the symbol cache, as it
+      // uses so much malloc, but what can it do at this point?
+      *dwfl = *dwfl ? *dwfl : __vala_rt_session_begin (&__vala_rt_crash_session);
+      __vala_rt_resolve_frame (&__vala_rt_crash_session, ip, &resolved);
+      __vala_rt_symbol_cache_store (ip, &resolved);
+    }
+  saved->ip = ip;
+  saved->function_name = __vala_rt_string_pool_add (resolved.function_name);
+  saved->library_name = __vala_rt_string_pool_add (resolved.library_name);
+  saved->filename = __vala_rt_string_pool_add (resolved.filename);
+  saved->lineno = saved->filename ? resolved.lineno : -1;
+  // TODO: Match _vala_main.constprop.0
+  const char *symbol = resolved.symbol;
+  return symbol && (!strcmp ("_vala_main", symbol) || !strcmp ("__libc_start_call_main", symbol));
 }
 
+// Prints "[frames first-last: f1 → f2 ×n]" for the repetitions of the cycle
+// starting at the saved frame start.
 static void
-__vala_rt_handle_signal (int signum, __attribute__ ((unused)) siginfo_t *info, __attribute__ ((unused)) void *_ctx)
+__vala_rt_print_cycle (int start, int first)
 {
-  if (__vala_rt_handler_triggered)
+  const struct stack_frame *frame = &__vala_rt_saved_stackframes[start];
+  uint32_t                  n_frames = frame->cycle_len * (frame->repeats - 1);
+  __vala_rt_report_string ("[frames ");
+  __vala_rt_report_decimal (first);
+  __vala_rt_report_string ("\u2013");
+  __vala_rt_report_decimal (first + n_frames - 1);
+  __vala_rt_report_string (": ");
+  for (uint32_t i = 0; i < frame->cycle_len; i++)
     {
-      return;
+      string_id name = __vala_rt_saved_stackframes[start + i].function_name;
+      __vala_rt_report_string (i ? " \u2192 " : "");
+      __vala_rt_report_string (name ? __vala_rt_string_pool_get (name) : "??");
     }
+  __vala_rt_report_string (" \u00d7");
+  __vala_rt_report_decimal (frame->repeats - 1);
+  __vala_rt_report_string ("]\n");
+}
+
+// Like __vala_rt_print_backtrace, for a stack that is already folded. Repeated
+// cycles are printed once, followed by a line summarizing the repetitions.
+void
+__vala_rt_print_folded_backtrace (const struct vala_rt_folded_stack *stack)
+{
   __vala_rt_n_saved_stackframes = 0;
   memset (__vala_rt_saved_stackframes, 0, sizeof (__vala_rt_saved_stackframes));
-  psignal (signum, "Received signal");
-  __vala_rt_handler_triggered = 1;
-  unw_context_t uc = { 0 };
-  unw_getcontext (&uc);
-  unw_cursor_t cursor = { 0 };
-#ifdef UNW_INIT_SIGNAL_FRAME
-  unw_init_local2 (&cursor, &uc, UNW_INIT_SIGNAL_FRAME);
-#else
-  unw_init_local (&cursor, &uc);
-#endif
-  unw_step (&cursor);
+  __vala_rt_string_pool_reset ();
   Dwfl *dwfl = NULL;
-  // This uses so much malloc, but what can
-  // it do at this point?
-  int frame = 0;
-  while (unw_step (&cursor) > 0 && __vala_rt_n_saved_stackframes < MAX_BACKTRACE_DEPTH)
-    {
-      unw_word_t ip;
-      unw_get_reg (&cursor, UNW_REG_IP, &ip);
-      unw_word_t     offset;
-      char           name[128];
-      char          *debuginfo_path = NULL;
-      Dwfl_Callbacks callbacks = {
-        .find_elf = dwfl_linux_proc_find_elf,
-        .find_debuginfo = dwfl_standard_find_debuginfo,
-        .debuginfo_path = &debuginfo_path,
-      };
-
-      unw_get_proc_name (&cursor, name, sizeof (name), &offset);
-
-      dwfl = dwfl_begin (&callbacks);
-      dwfl_linux_proc_report (dwfl, getpid ());
-      dwfl_report_end (dwfl, NULL, NULL);
-      Dwarf_Addr   ipaddr = (uintptr_t)ip;
-      Dwfl_Module *module = dwfl_addrmodule (dwfl, ipaddr);
-      GElf_Addr    gaddr = 0;
-      Elf         *elf = dwfl_module_getelf (module, &gaddr);
-      Dwarf_Addr   bias;
-      Dwarf       *dwarf = dwfl_module_getdwarf (module, &bias);
-      Dwarf       *alt_dwarf = dwarf_getalt (dwarf);
-      void        *section_data = NULL;
-      size_t       section_size = 0;
-      Elf         *second_elf = NULL;
-      int          compressed = 0;
-      __vala_rt_find_section_in_elf (elf, ".debug_info_vala", &section_data, &section_size);
-      if (!section_data)
-        {
-          __vala_rt_find_section_in_elf (elf, ".zdebug_info_vala", &section_data, &section_size);
-          if (section_data)
-            {
-              compressed = 1;
-            }
-        }
-      if (!section_data && alt_dwarf)
-        {
-          elf = dwarf_getelf (alt_dwarf);
-          __vala_rt_find_section_in_elf (elf, ".debug_info_vala", &section_data, &section_size);
-          if (!section_data)
-            {
-              __vala_rt_find_section_in_elf (elf, ".zdebug_info_vala", &section_data, &section_size);
-              if (section_data)
-                {
-                  compressed = 1;
-                }
-            }
-        }
-      if (!section_data)
-        {
-          int fd = __vala_rt_find_debuginfo_by_id (module);
-          if (fd > 0)
-            {
-              second_elf = elf_begin (fd, ELF_C_READ, NULL);
-              __vala_rt_find_section_in_elf (second_elf, ".debug_info_vala", &section_data, &section_size);
-              if (!section_data)
-                {
-                  __vala_rt_find_section_in_elf (second_elf, ".zdebug_info_vala", &section_data, &section_size);
-                  if (section_data)
-                    {
-                      compressed = 1;
-                    }
-                }
-            }
-        }
-      __vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].ip = ip;
-      __vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].skip = 0;
-      const char *function_name = dwfl_module_addrname (module, ipaddr);
-      const char *real_name = __vala_rt_find_function (function_name, &cursor, section_data, section_size, compressed);
-      if (real_name)
-        {
-          strcpy (__vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].function_name, real_name);
-        }
-      else
-        {
-          __vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].function_name[0] = 1;
-        }
-      Dwfl_Line  *line = dwfl_getsrc (dwfl, ipaddr);
-      const char *module_name = dwfl_module_info (module, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
-      strcpy (__vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].library_name, module_name);
-      if (line && real_name)
-        {
-          int         nline;
-          Dwarf_Addr  addr;
-          const char *filename = dwfl_lineinfo (line, &addr, &nline, NULL, NULL, NULL);
-          strcpy (__vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].filename, filename);
-          __vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].lineno = nline;
-        }
-      else
-        {
-          __vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].filename[0] = (char)1;
-          __vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes].lineno = -1;
-        }
-      __vala_rt_n_saved_stackframes++;
-      if (second_elf)
+  for (int frame = 0; frame < stack->n && __vala_rt_n_saved_stackframes < MAX_BACKTRACE_DEPTH; frame++)
+    {
+      const struct vala_rt_folded_frame *folded = &stack->frames[frame];
+      struct stack_frame                *saved = &__vala_rt_saved_stackframes[__vala_rt_n_saved_stackframes++];
+      if (!folded->ip)
         {
-          elf_end (second_elf);
+          saved->lineno = -1;
+          saved->omitted = folded->count;
+          continue;
         }
-      // TODO: Match _vala_main.constprop.0
-      if (function_name && (!strcmp ("_vala_main", function_name) || !strcmp ("__libc_start_call_main", function_name)))
+      int is_main = __vala_rt_save_frame (saved, folded->ip, &dwfl);
+      saved->cycle_len = folded->cycle_len;
+      saved->repeats = folded->cycle_len ? folded->count : 0;
+      if (is_main)
         {
           break;
         }
-      dwfl_end (dwfl);
-      frame++;
     }
-  dwfl_end (dwfl);
-  // Search for call stacks like this:
+  // Replaces signal emissions like this:
   // __lambda4_              | May be inlined
   // ___lambda4_class_signal
   // GLib::Closure.invoke
   // signal_emit_unlocked_R
   // g_signal_emit_valist
   // GLib::Signal.emit
-  // And replace them by this:
+  // By this:
   // __lambda4_ or ___lambda4_class_signal
   // <<signal Class::signal>>
-  for (int i = 0; i < __vala_rt_n_saved_stackframes; i++)
+  __vala_rt_collapse_frames (__vala_rt_saved_stackframes, __vala_rt_n_saved_stackframes);
+  if (__vala_rt_report_format != VALA_RT_REPORT_TEXT)
     {
-      if (!__vala_rt_find_signal (__vala_rt_saved_stackframes[i].library_name,
-                                  __vala_rt_saved_stackframes[i].function_name))
-        {
-          continue;
-        }
-      if (__vala_rt_saved_stackframes[i].function_name[0] == 1)
-        {
-          continue;
-        }
-      if (strcmp (__vala_rt_saved_stackframes[i].library_name, __vala_rt_saved_stackframes[i + 1].library_name) == 0)
-        {
-          const char *s1 = __vala_rt_find_signal (__vala_rt_saved_stackframes[i].library_name,
-                                                  __vala_rt_saved_stackframes[i].function_name);
-          const char *s2 = __vala_rt_find_signal (__vala_rt_saved_stackframes[i + 1].library_name,
-                                                  __vala_rt_saved_stackframes[i + 1].function_name);
-          // TODO: Can we compare addresses here?
-          if (s1 && s2 && !strcmp (s1, s2))
-            {
-              if ((strcmp (__vala_rt_saved_stackframes[i + 2].function_name, "GLib::Closure.invoke") == 0
-                   || strcmp (__vala_rt_saved_stackframes[i + 2].function_name, "g_closure_invoke") == 0)
-                  && strncmp (__vala_rt_saved_stackframes[i + 3].function_name, "signal_emit_unlocked_R", 22) == 0)
-                {
-                  int n_to_skip = 2;
-                  if (i + 4 < __vala_rt_n_saved_stackframes
-                      && strcmp (__vala_rt_saved_stackframes[i + 4].function_name, "g_signal_emitv") == 0)
-                    {
-                      n_to_skip++;
-                    }
-                  else if (i + 4 < __vala_rt_n_saved_stackframes
-                           && strcmp (__vala_rt_saved_stackframes[i + 4].function_name, "g_signal_emit_valist") == 0)
-                    {
-                      n_to_skip++;
-                      if (i + 5 < __vala_rt_n_saved_stackframes
-                          && strcmp (__vala_rt_saved_stackframes[i + 5].function_name, "g_signal_emit") == 0)
-                        {
-                          n_to_skip++;
-                        }
-                      if (i + 5 < __vala_rt_n_saved_stackframes
-                          && strcmp (__vala_rt_saved_stackframes[i + 5].function_name, "g_signal_emit_by_name") == 0)
-                        {
-                          n_to_skip++;
-                        }
-                    }
-                  if (s1)
-                    {
-                      __vala_rt_format_signal_name (__vala_rt_saved_stackframes[i + 1].function_name, s1);
-                      for (int j = 1; j < n_to_skip + 1; j++)
-                        {
-                          __vala_rt_saved_stackframes[i + 1 + j].skip = 1;
-                        }
-                      i += n_to_skip;
-                    }
-                }
-            }
-        }
-      else if (i + 2 < __vala_rt_n_saved_stackframes)
-        {
-          if ((strcmp (__vala_rt_saved_stackframes[i + 1].function_name, "GLib::Closure.invoke") == 0
-               || strcmp (__vala_rt_saved_stackframes[i + 1].function_name, "g_closure_invoke") == 0)
-              && strncmp (__vala_rt_saved_stackframes[i + 2].function_name, "signal_emit_unlocked_R", 22) == 0)
-            {
-              int n_to_skip = 1;
-              if (i + 3 < __vala_rt_n_saved_stackframes
-                  && strcmp (__vala_rt_saved_stackframes[i + 3].function_name, "g_signal_emitv") == 0)
-                {
-                  n_to_skip++;
-                }
-              else if (i + 3 < __vala_rt_n_saved_stackframes
-                       && strcmp (__vala_rt_saved_stackframes[i + 3].function_name, "g_signal_emit_valist") == 0)
-                {
-                  n_to_skip++;
-                  if (i + 4 < __vala_rt_n_saved_stackframes
-                      && strcmp (__vala_rt_saved_stackframes[i + 4].function_name, "g_signal_emit") == 0)
-                    {
-                      n_to_skip++;
-                    }
-                  if (i + 4 < __vala_rt_n_saved_stackframes
-                      && strcmp (__vala_rt_saved_stackframes[i + 4].function_name, "g_signal_emit_by_name") == 0)
-                    {
-                      n_to_skip++;
-                    }
-                }
-              const char *s = __vala_rt_find_signal (__vala_rt_saved_stackframes[i].library_name,
-                                                     __vala_rt_saved_stackframes[i].function_name);
-              if (s)
-                {
-                  __vala_rt_format_signal_name (__vala_rt_saved_stackframes[i + 1].function_name, s);
-                  for (int j = 2; j < n_to_skip + 2; j++)
-                    {
-                      __vala_rt_saved_stackframes[i + j].skip = 1;
-                    }
-                  i += n_to_skip;
-                }
-            }
-        }
+      __vala_rt_print_frames_structured ();
+      return;
     }
+  // Including the repetitions of cycles and the dropped frames, for the width
+  // of the frame numbers
   size_t n_traces = 0;
   size_t max_fname = 0;
-  size_t max_filename = 0;
   size_t max_lname = 0;
   for (int i = 0; i < __vala_rt_n_saved_stackframes; i++)
     {
-      if (!__vala_rt_saved_stackframes[i].skip)
+      n_traces += __vala_rt_saved_stackframes[i].omitted;
+      if (__vala_rt_saved_stackframes[i].cycle_len)
+        {
+          n_traces += __vala_rt_saved_stackframes[i].cycle_len * (__vala_rt_saved_stackframes[i].repeats - 1);
+        }
+      if (!__vala_rt_saved_stackframes[i].skip && !__vala_rt_saved_stackframes[i].omitted)
         {
           n_traces++;
-          max_fname = MAX (max_fname, strlen (__vala_rt_saved_stackframes[i].function_name));
-          max_lname = MAX (max_lname, strlen (__vala_rt_saved_stackframes[i].library_name));
-          max_filename = MAX (max_filename, strlen (__vala_rt_saved_stackframes[i].filename));
+          const struct stack_frame *saved = &__vala_rt_saved_stackframes[i];
+          max_fname = MAX (max_fname, strlen (__vala_rt_string_pool_get (saved->function_name)));
+          max_lname = MAX (max_lname, strlen (__vala_rt_string_pool_get (saved->library_name)));
         }
     }
   int cnter = 0;
+  int cycle_start = -1;
   for (int i = 0; i < __vala_rt_n_saved_stackframes; i++)
     {
+      if (__vala_rt_saved_stackframes[i].omitted)
+        {
+          __vala_rt_report_string ("[frames ");
+          __vala_rt_report_decimal (cnter);
+          __vala_rt_report_string ("\u2013");
+          __vala_rt_report_decimal (cnter + __vala_rt_saved_stackframes[i].omitted - 1);
+          __vala_rt_report_string (" omitted]\n");
+          cnter += __vala_rt_saved_stackframes[i].omitted;
+          continue;
+        }
+      if (__vala_rt_saved_stackframes[i].cycle_len)
+        {
+          cycle_start = i;
+        }
       if (!__vala_rt_saved_stackframes[i].skip)
         {
           print_initial_part (cnter, __vala_rt_saved_stackframes[i].ip, n_traces);
-          pad_string (__vala_rt_saved_stackframes[i].library_name, max_lname);
-          if (__vala_rt_saved_stackframes[i].function_name[0] == 1)
+          pad_string (__vala_rt_string_pool_get (__vala_rt_saved_stackframes[i].library_name), max_lname);
+          if (!__vala_rt_saved_stackframes[i].function_name)
             {
               goto eol;
             }
-          pad_string (__vala_rt_saved_stackframes[i].function_name, max_fname);
-          if (__vala_rt_saved_stackframes[i].filename[0] == 1)
+          pad_string (__vala_rt_string_pool_get (__vala_rt_saved_stackframes[i].function_name), max_fname);
+          if (!__vala_rt_saved_stackframes[i].filename)
             {
               goto eol;
             }
-          write (
-              STDERR_FILENO, __vala_rt_saved_stackframes[i].filename, strlen (__vala_rt_saved_stackframes[i].filename));
+          __vala_rt_report_string (__vala_rt_string_pool_get (__vala_rt_saved_stackframes[i].filename));
           if (__vala_rt_saved_stackframes[i].lineno == -1)
             {
               goto eol;
             }
-          write (STDERR_FILENO, ":", 1);
-          char data[10] = { 0 };
-          sprintf (data, "%d", __vala_rt_saved_stackframes[i].lineno);
-          write (STDERR_FILENO, data, strlen (data));
+          __vala_rt_report_append (":", 1);
+          __vala_rt_report_decimal (__vala_rt_saved_stackframes[i].lineno);
         eol:
-          write (STDERR_FILENO, "\n", 1);
+          __vala_rt_report_append ("\n", 1);
           cnter++;
         }
+      // After the first time through the cycle
+      if (cycle_start != -1 && i == cycle_start + (int)__vala_rt_saved_stackframes[cycle_start].cycle_len - 1)
+        {
+          __vala_rt_print_cycle (cycle_start, cnter);
+          cnter += __vala_rt_saved_stackframes[cycle_start].cycle_len
+                   * (__vala_rt_saved_stackframes[cycle_start].repeats - 1);
+          cycle_start = -1;
+        }
     }
-  abort ();
+  __vala_rt_report_end (VALA_RT_REPORT_STATUS_OK);
 }
 
+// A name copied out of a search directory is only valid until the next lookup
+// in the same session.
 static const char *
-__vala_rt_find_function (const char                            *function,
-                         __attribute__ ((unused)) unw_cursor_t *cursor,
-                         void                                  *data,
-                         size_t                                 len,
-                         int                                    compressed)
+__vala_rt_find_function (struct vala_rt_session *session, const char *function, const struct vala_rt_module *module)
 {
   if (function == NULL)
     {
@@ -481,14 +466,18 @@ __vala_rt_find_function (const char                            *function,
     {
       return "main";
     }
-  const char *r = __vala_rt_find_function_internal_file (function);
+  // A .vdbg found by build-id belongs to exactly this module, so there is
+  // no need to look at any other file.
+  const char *r = module->vdbg_data ? __vala_rt_vdbg_lookup (module->vdbg_data, module->vdbg_size, function)
+                                    : __vala_rt_find_function_internal_file (
+                                        function, session->function_buffer, sizeof (session->function_buffer));
   if (r)
     {
       return r;
     }
-  if (data && len)
+  if (module->section_data && module->section_size)
     {
-      const char *r1 = __vala_rt_find_function_internal_section (function, data, len, compressed);
+      const char *r1 = __vala_rt_find_function_internal_section (function, module->section_data, module->section_size);
       if (r1)
         {
           return r1;
@@ -497,117 +486,382 @@ __vala_rt_find_function (const char                            *function,
   return function;
 }
 
+static uint32_t
+__vala_rt_signal_hash (const char *library, const char *function_name)
+{
+  uint32_t hash = __vala_rt_hash_name (library, strlen (library))
+                  ^ (__vala_rt_hash_name (function_name, strlen (function_name)) * 16777619u);
+  // 0 marks empty slots
+  return hash ? hash : 1;
+}
+
 static const char *
-__vala_rt_find_signal (const char *library, const char *function_name)
+__vala_rt_find_signal_indexed (const char *library, const char *function_name)
 {
-  char real_path_tmp[PATH_MAX + 1] = { 0 };
-  for (size_t i = 0; i < __vala_rt_n_signal_mappings; i++)
+  if (!__vala_rt_signal_index_size)
     {
-      realpath (library, real_path_tmp);
-      if (!strcmp (__vala_rt_signal_mappings[i].library_path, library)
-          || !strcmp (__vala_rt_signal_mappings[i].library_path, real_path_tmp))
+      return NULL;
+    }
+  uint32_t hash = __vala_rt_signal_hash (library, function_name);
+  size_t   mask = __vala_rt_signal_index_size - 1;
+  for (size_t i = hash & mask; __vala_rt_signal_index[i].hash; i = (i + 1) & mask)
+    {
+      const struct signal_slot *slot = &__vala_rt_signal_index[i];
+      if (slot->hash == hash && !strcmp (slot->c_function_name, function_name)
+          && !strcmp (slot->library_path, library))
         {
-          for (size_t j = 0; j < __vala_rt_signal_mappings[i].n_mappings; j++)
-            {
-              if (!strcmp (__vala_rt_signal_mappings[i].mappings[j].c_function_name, function_name))
-                {
-                  return __vala_rt_signal_mappings[i].mappings[j].demangled_signal_name;
-                }
-            }
+          return slot->demangled_signal_name;
         }
     }
   return NULL;
 }
 
-void
-__vala_register_signal_mappings (const char                        *library_path,
-                                 const struct vala_signal_mappings *mappings,
-                                 size_t                             n_mappings)
+static uint32_t
+__vala_rt_library_hash (const char *library)
 {
-  if (__vala_rt_n_signal_mappings == MAX_SIGNAL_MAPPINGS)
+  uint32_t hash = __vala_rt_hash_name (library, strlen (library));
+  // 0 marks empty slots
+  return hash ? hash : 1;
+}
+
+static const char *
+__vala_rt_find_signal_sorted (const struct mapping_holder *holder, const char *function_name)
+{
+  size_t low = 0;
+  size_t high = holder->n_mappings;
+  while (low < high)
     {
-      fprintf (stderr, "Unable to register vala signal mappings for %s\n", library_path);
-      return;
+      size_t mid = low + (high - low) / 2;
+      int    cmp = strcmp (function_name, __vala_rt_mapping_c_name (holder, mid));
+      if (cmp == 0)
+        {
+          return __vala_rt_mapping_signal_name (holder, mid);
+        }
+      if (cmp < 0)
+        {
+          high = mid;
+        }
+      else
+        {
+          low = mid + 1;
+        }
     }
-  __vala_rt_signal_mappings[__vala_rt_n_signal_mappings].library_path = strdup (library_path);
-  __vala_rt_signal_mappings[__vala_rt_n_signal_mappings].n_mappings = n_mappings;
-  __vala_rt_signal_mappings[__vala_rt_n_signal_mappings].mappings = mappings;
-  __vala_rt_n_signal_mappings++;
+  return NULL;
+}
+
+// Only called with the library names of the session, which are canonical like
+// the registered ones, so no path has to be resolved.
+const char *
+__vala_rt_find_signal (const char *library, const char *function_name)
+{
+  const char *signal = __vala_rt_find_signal_indexed (library, function_name);
+  uint32_t    hash = __vala_rt_library_hash (library);
+  size_t      mask = __vala_rt_holder_index_size - 1;
+  for (size_t i = hash & mask; !signal && __vala_rt_holder_index_size && __vala_rt_holder_index[i].hash;
+       i = (i + 1) & mask)
+    {
+      const struct mapping_holder *holder = &__vala_rt_signal_mappings[__vala_rt_holder_index[i].holder];
+      if (__vala_rt_holder_index[i].hash == hash && !strcmp (holder->library_path, library))
+        {
+          signal = __vala_rt_find_signal_sorted (holder, function_name);
+        }
+    }
+  if (!signal)
+    {
+      const struct vala_rt_module *module = __vala_rt_module_by_name (&__vala_rt_crash_session, library);
+      if (module && module->signal_data)
+        {
+          signal = __vala_rt_signal_section_lookup (module->signal_data, module->signal_size, function_name);
+        }
+      else if (!module)
+        {
+          signal = __vala_rt_symbol_cache_find_signal (library, function_name);
+        }
+    }
+  return signal;
 }
 
 static void
-__vala_rt_format_signal_name (char *into, const char *demangled)
+__vala_rt_signal_index_put (struct signal_slot *index, size_t size, const struct signal_slot *slot)
 {
-  memset (into, 0, strlen (into));
-  strcat (into, "<<signal ");
-  strcat (into, demangled);
-  strcat (into, ">>");
+  size_t mask = size - 1;
+  size_t i = slot->hash & mask;
+  while (index[i].hash)
+    {
+      i = (i + 1) & mask;
+    }
+  index[i] = *slot;
+}
+
+// Grows the index so n more entries fit, keeping the load factor below 1/2.
+static int
+__vala_rt_signal_index_reserve (size_t n)
+{
+  size_t new_size = __vala_rt_signal_index_size ? __vala_rt_signal_index_size : 256;
+  while ((__vala_rt_signal_index_used + n) * 2 > new_size)
+    {
+      new_size *= 2;
+    }
+  if (new_size == __vala_rt_signal_index_size)
+    {
+      return 0;
+    }
+  struct signal_slot *new_index = calloc (new_size, sizeof (struct signal_slot));
+  if (!new_index)
+    {
+      return -1;
+    }
+  for (size_t i = 0; i < __vala_rt_signal_index_size; i++)
+    {
+      if (__vala_rt_signal_index[i].hash)
+        {
+          __vala_rt_signal_index_put (new_index, new_size, &__vala_rt_signal_index[i]);
+        }
+    }
+  free (__vala_rt_signal_index);
+  __vala_rt_signal_index = new_index;
+  __vala_rt_signal_index_size = new_size;
+  return 0;
 }
 
 static void
-__vala_rt_find_section_in_elf (Elf *elf, const char *sname, void **ptr, size_t *len)
-{
-  size_t num_sections = 0;
-  elf_getshdrnum (elf, &num_sections);
-  size_t shstrndx;
-  elf_getshdrstrndx (elf, &shstrndx);
-  for (size_t i = 0; i < num_sections; i++)
-    {
-      Elf_Scn  *scn = elf_getscn (elf, i);
-      GElf_Shdr shdr;
-      gelf_getshdr (scn, &shdr);
-      const char *name = elf_strptr (elf, shstrndx, shdr.sh_name);
-      if (!strcmp (sname, name))
+__vala_rt_holder_index_put (struct holder_slot *index, size_t size, const struct holder_slot *slot)
+{
+  size_t mask = size - 1;
+  size_t i = slot->hash & mask;
+  while (index[i].hash)
+    {
+      i = (i + 1) & mask;
+    }
+  index[i] = *slot;
+}
+
+// Like __vala_rt_signal_index_reserve, for one more sorted table.
+static int
+__vala_rt_holder_index_reserve (void)
+{
+  size_t new_size = __vala_rt_holder_index_size ? __vala_rt_holder_index_size : 16;
+  while ((__vala_rt_holder_index_used + 1) * 2 > new_size)
+    {
+      new_size *= 2;
+    }
+  if (new_size == __vala_rt_holder_index_size)
+    {
+      return 0;
+    }
+  struct holder_slot *new_index = calloc (new_size, sizeof (struct holder_slot));
+  if (!new_index)
+    {
+      return -1;
+    }
+  for (size_t i = 0; i < __vala_rt_holder_index_size; i++)
+    {
+      if (__vala_rt_holder_index[i].hash)
         {
-          Elf_Data *data = NULL;
-          data = elf_rawdata (scn, data);
-          *ptr = data->d_buf;
-          *len = data->d_size;
+          __vala_rt_holder_index_put (new_index, new_size, &__vala_rt_holder_index[i]);
+        }
+    }
+  free (__vala_rt_holder_index);
+  __vala_rt_holder_index = new_index;
+  __vala_rt_holder_index_size = new_size;
+  return 0;
+}
+
+// Everything is canonicalized and indexed here, so the crash handler doesn't
+// have to allocate or touch the filesystem. Sorted tables registered using
+// __vala_register_signal_mappings2 are binary searched instead of indexed,
+// after finding them by their library path in the holder index.
+static void
+__vala_rt_add_signal_mappings (const char *library_path, struct mapping_holder holder, int indexed)
+{
+  if (__vala_rt_n_signal_mappings == __vala_rt_signal_mappings_capacity)
+    {
+      size_t new_capacity = __vala_rt_signal_mappings_capacity ? __vala_rt_signal_mappings_capacity * 2 : 16;
+      struct mapping_holder *new_mappings
+          = realloc (__vala_rt_signal_mappings, new_capacity * sizeof (struct mapping_holder));
+      if (!new_mappings)
+        {
+          fprintf (stderr, "Unable to register vala signal mappings for %s\n", library_path);
           return;
         }
+      __vala_rt_signal_mappings = new_mappings;
+      __vala_rt_signal_mappings_capacity = new_capacity;
+    }
+  holder.library_path = realpath (library_path, NULL);
+  if (!holder.library_path)
+    {
+      holder.library_path = strdup (library_path);
+    }
+  if (!holder.library_path || (indexed && __vala_rt_signal_index_reserve (holder.n_mappings))
+      || (!indexed && __vala_rt_holder_index_reserve ()))
+    {
+      free (holder.library_path);
+      fprintf (stderr, "Unable to register vala signal mappings for %s\n", library_path);
+      return;
+    }
+  if (!indexed)
+    {
+      struct holder_slot slot = { __vala_rt_library_hash (holder.library_path), __vala_rt_n_signal_mappings };
+      __vala_rt_holder_index_put (__vala_rt_holder_index, __vala_rt_holder_index_size, &slot);
+      __vala_rt_holder_index_used++;
+    }
+  __vala_rt_signal_mappings[__vala_rt_n_signal_mappings++] = holder;
+  for (size_t i = 0; indexed && i < holder.n_mappings; i++)
+    {
+      struct signal_slot slot = {
+        __vala_rt_signal_hash (holder.library_path, __vala_rt_mapping_c_name (&holder, i)),
+        holder.library_path,
+        __vala_rt_mapping_c_name (&holder, i),
+        __vala_rt_mapping_signal_name (&holder, i),
+      };
+      __vala_rt_signal_index_put (__vala_rt_signal_index, __vala_rt_signal_index_size, &slot);
+      __vala_rt_signal_index_used++;
+    }
+}
+
+void
+__vala_register_signal_mappings (const char                        *library_path,
+                                 const struct vala_signal_mappings *mappings,
+                                 size_t                             n_mappings)
+{
+  struct mapping_holder holder = { NULL, mappings, NULL, NULL, n_mappings };
+  __vala_rt_add_signal_mappings (library_path, holder, 1);
+}
+
+void
+__vala_register_signal_mappings2 (const char                         *library_path,
+                                  const char                         *strings,
+                                  const struct vala_signal_mappings2 *mappings,
+                                  size_t                              n_mappings)
+{
+  struct mapping_holder holder = { NULL, NULL, strings, mappings, n_mappings };
+  int                   sorted = 1;
+  for (size_t i = 1; i < n_mappings && sorted; i++)
+    {
+      sorted = strcmp (__vala_rt_mapping_c_name (&holder, i - 1), __vala_rt_mapping_c_name (&holder, i)) <= 0;
+    }
+  __vala_rt_add_signal_mappings (library_path, holder, !sorted);
+}
+
+static void
+__vala_rt_clear_signal_mappings (void)
+{
+  for (size_t i = 0; i < __vala_rt_n_signal_mappings; i++)
+    {
+      free (__vala_rt_signal_mappings[i].library_path);
     }
+  __vala_rt_n_signal_mappings = 0;
+  memset (__vala_rt_signal_index, 0, __vala_rt_signal_index_size * sizeof (struct signal_slot));
+  __vala_rt_signal_index_used = 0;
+  memset (__vala_rt_holder_index, 0, __vala_rt_holder_index_size * sizeof (struct holder_slot));
+  __vala_rt_holder_index_used = 0;
 }
-// Last resort, guessing and hoping the best
+
 static int
-__vala_rt_find_debuginfo_by_id (Dwfl_Module *module)
+__vala_rt_remote_read (pid_t pid, const void *remote, void *local, size_t len)
+{
+  struct iovec local_iov = { local, len };
+  struct iovec remote_iov = { (void *)remote, len };
+  return process_vm_readv (pid, &local_iov, 1, &remote_iov, 1, 0) == (ssize_t)len ? 0 : -1;
+}
+
+static char *
+__vala_rt_remote_read_string (pid_t pid, const char *remote)
 {
-  unsigned char bits[32] = { 0 };
-  GElf_Addr     addr = 0;
-  dwfl_module_getelf (module, &addr);
-  int ret = dwfl_module_build_id (module, (const unsigned char **)&bits, &addr);
-  if (ret <= 0)
+  char   buf[PATH_MAX] = { 0 };
+  size_t len = 0;
+  // Never read across a page boundary, the next page may not be mapped.
+  while (len < sizeof (buf) - 1)
     {
-      return -1;
+      size_t    page_size = getpagesize ();
+      uintptr_t addr = (uintptr_t)remote + len;
+      size_t    n = page_size - addr % page_size;
+      n = n < sizeof (buf) - 1 - len ? n : sizeof (buf) - 1 - len;
+      if (__vala_rt_remote_read (pid, (const void *)addr, &buf[len], n))
+        {
+          return NULL;
+        }
+      if (memchr (&buf[len], '\0', n))
+        {
+          break;
+        }
+      len += n;
     }
-  uint8_t    *id = (uint8_t *)addr;
-  char        path[512];
-  const char *prefixes_to_try[6]
-      = { "/usr/lib/debug/.build-id/",       "/usr/local/lib/debug/.build-id/", "/app/lib/debug/.build-id/",
-          "/app/local/lib/debug/.build-id/", __vala_rt_debuginfod_location1,    __vala_rt_debuginfod_location2 };
+  return strdup (buf);
+}
 
-  for (size_t i = 0; i < sizeof (prefixes_to_try) / sizeof (prefixes_to_try[0]); i++)
+// Copies the mappings of a remote library, converting them to the unpacked
+// format.
+static struct vala_signal_mappings *
+__vala_rt_remote_read_mappings (pid_t pid, const struct mapping_holder *holder)
+{
+  size_t                       n_mappings = holder->n_mappings;
+  struct vala_signal_mappings *mappings = calloc (n_mappings + 1, sizeof (struct vala_signal_mappings));
+  if (!mappings || !holder->mappings2)
     {
-      if (!prefixes_to_try[i][0])
+      if (mappings && __vala_rt_remote_read (pid, holder->mappings, mappings, n_mappings * sizeof (mappings[0])))
         {
-          continue;
+          free (mappings);
+          return NULL;
         }
-      memset (path, 0, sizeof (path));
-      strcat (path, prefixes_to_try[i]);
-      size_t base_len = strlen (path);
-      sprintf (&path[base_len], "%x%x/", id[0] >> 4 & 0xf, id[0] & 0xf);
-      base_len += 3;
-      for (int j = 1; j < ret; j++)
+      return mappings;
+    }
+  struct vala_signal_mappings2 *mappings2 = calloc (n_mappings + 1, sizeof (struct vala_signal_mappings2));
+  if (!mappings2 || __vala_rt_remote_read (pid, holder->mappings2, mappings2, n_mappings * sizeof (mappings2[0])))
+    {
+      free (mappings);
+      free (mappings2);
+      return NULL;
+    }
+  for (size_t i = 0; i < n_mappings; i++)
+    {
+      char *c_name = __vala_rt_remote_read_string (pid, &holder->strings[mappings2[i].c_function_name]);
+      char *signal = __vala_rt_remote_read_string (pid, &holder->strings[mappings2[i].demangled_signal_name]);
+      if (c_name && signal)
         {
-          sprintf (&path[base_len], "%x%x", id[j] >> 4 & 0xf, id[j] & 0xf);
-          base_len += 2;
+          strncpy ((char *)mappings[i].c_function_name, c_name, sizeof (mappings[i].c_function_name) - 1);
+          strncpy ((char *)mappings[i].demangled_signal_name, signal, sizeof (mappings[i].demangled_signal_name) - 1);
         }
-      strcat (path, ".debug");
-      int fd = open (path, O_RDONLY);
-      if (fd < 0)
+      free (c_name);
+      free (signal);
+    }
+  free (mappings2);
+  return mappings;
+}
+
+// Replaces the signal mappings of this process with the ones of pid. Only usable
+// in a process forked from pid, as it relies on the globals being at the same
+// addresses.
+int
+__vala_rt_import_remote_signal_mappings (pid_t pid)
+{
+  size_t                 n_mappings = 0;
+  struct mapping_holder *remote_holders = NULL;
+  if (__vala_rt_remote_read (pid, &__vala_rt_n_signal_mappings, &n_mappings, sizeof (n_mappings))
+      || __vala_rt_remote_read (pid, &__vala_rt_signal_mappings, &remote_holders, sizeof (remote_holders)))
+    {
+      return -1;
+    }
+  struct mapping_holder *holders = calloc (n_mappings + 1, sizeof (struct mapping_holder));
+  if (!holders || __vala_rt_remote_read (pid, remote_holders, holders, n_mappings * sizeof (holders[0])))
+    {
+      free (holders);
+      return -1;
+    }
+  __vala_rt_clear_signal_mappings ();
+  for (size_t i = 0; i < n_mappings; i++)
+    {
+      char                        *library_path = __vala_rt_remote_read_string (pid, holders[i].library_path);
+      struct vala_signal_mappings *mappings = __vala_rt_remote_read_mappings (pid, &holders[i]);
+      if (!library_path || !mappings)
         {
+          free (library_path);
+          free (mappings);
           continue;
         }
-      return fd;
+      __vala_register_signal_mappings (library_path, mappings, holders[i].n_mappings);
+      free (library_path);
     }
-  return -1;
+  free (holders);
+  return 0;
 }
@@ -30,6 +30,27 @@ struct vala_signal_mappings
   const char demangled_signal_name[255];
 };
 
+// Like vala_signal_mappings, but both names are offsets of NUL-terminated
+// strings in a single string table. The entries must be sorted by C name
+// (as compared by strcmp), so they can be searched without building an index.
+struct vala_signal_mappings2
+{
+  unsigned int c_function_name;
+  unsigned int demangled_signal_name;
+};
+
+// A symbolized frame, the strings are owned by vala-rt and are never freed.
+struct vala_rt_frame
+{
+  void       *ip;
+  // The Vala name, if known, else the C name. NULL if there is no symbol.
+  const char *function_name;
+  const char *library_name;
+  const char *filename;
+  // -1 if unknown
+  int         lineno;
+};
+
 extern const char  *__vala_debug_prefix;
 extern const char **__vala_extra_debug_directories;
 
@@ -37,3 +58,163 @@ extern void
 __vala_init (void);
 extern void
 __vala_register_signal_mappings (const char *, const struct vala_signal_mappings *, size_t);
+// Takes the library path, the string table and the mappings
+extern void
+__vala_register_signal_mappings2 (const char *, const char *, const struct vala_signal_mappings2 *, size_t);
+
+// Instead of printing a backtrace, the crash handler will only write a crash
+// record with the raw frames to this directory, to be symbolized later using
+// vala-rt-symbolize. Can be set using the environment variable
+// VALA_RT_CRASH_RECORD_DIR, too. Passing NULL disables it.
+extern void
+vala_rt_set_crash_record_directory (const char *);
+
+// Writes the backtraces printed by the crash handler to the given file
+// descriptor instead of stderr. Passing -1 resets it to stderr.
+extern void
+vala_rt_set_report_fd (int);
+
+// Appends the backtraces printed by the crash handler to the file at the given
+// path, which is only opened once there is something to write. Can be set
+// using the environment variable VALA_RT_REPORT_FILE, too. Passing NULL resets
+// it to stderr.
+extern void
+vala_rt_set_report_file (const char *);
+
+enum vala_rt_report_format
+{
+  // Aligned columns, for humans
+  VALA_RT_REPORT_TEXT,
+  // One JSON object per line
+  VALA_RT_REPORT_JSON,
+  // Length-prefixed records, see vala-rt-format.h in the sources
+  VALA_RT_REPORT_BINARY,
+};
+
+// Selects how the crash handler writes reports. The machine readable formats
+// include every frame with its flags and a fingerprint of the stack, which is
+// stable across runs of the same build, to deduplicate crashes. Can be selected
+// using the environment variable VALA_RT_REPORT_FORMAT=json or binary, too.
+extern void
+vala_rt_set_report_format (enum vala_rt_report_format);
+
+// Optional groups of rules for collapsing frames in printed backtraces. The
+// GLib signal emission is always collapsed.
+enum vala_rt_collapse_rules
+{
+  // g_task_return_now and its callers
+  VALA_RT_COLLAPSE_GTASK = 1 << 0,
+  // Dispatching sources from the main loop
+  VALA_RT_COLLAPSE_MAIN_CONTEXT = 1 << 1,
+  // Closures invoked through a marshaller
+  VALA_RT_COLLAPSE_CLOSURES = 1 << 2,
+  // The _ready callbacks resuming async methods
+  VALA_RT_COLLAPSE_ASYNC = 1 << 3,
+};
+
+// Enables the given groups of rules. Can be set using the environment variable
+// VALA_RT_COLLAPSE, a comma-separated list of gtask, main-context, closures and
+// async, too.
+extern void
+vala_rt_enable_collapse_rules (int);
+
+// Adds a rule collapsing the frames matching the pattern into one frame called
+// label. The pattern lists the function names from the innermost frame
+// outwards, separated by spaces, "a|b" matching either one, "?a" being
+// optional, "a*" and "*a" matching prefixes and suffixes, and frames before a
+// ">" being kept. E.g. "my_dispatch ?my_queue_run|my_queue_flush" with label
+// "<<queue>>". The pattern is checked right away, so an invalid one, or one
+// that doesn't fit into the tables anymore, returns -1. Returns 0 on success.
+extern int
+vala_rt_add_collapse_rule (const char *, const char *);
+
+// Remembers the frames symbolized by the crash handler in a file in the given
+// directory, keyed by the build-id of the module and the offset in it, so
+// repeated crashes of the same build are symbolized without reading any
+// debuginfo. Can be enabled using the environment variable VALA_RT_SYMBOL_CACHE,
+// too, set to the directory or to 1 for $XDG_CACHE_HOME/vala-rt. Passing NULL
+// disables it.
+extern void
+vala_rt_set_symbol_cache_directory (const char *);
+
+// Forks a helper process that waits until this process crashes and then
+// symbolizes and prints the backtrace on its behalf, so the crashing process
+// only has to unwind. Done by __vala_init if the environment variable
+// VALA_RT_CRASH_HELPER is set. Returns 0 on success.
+// The helper is killed when the thread that started it exits (PR_SET_PDEATHSIG),
+// so call it from the main thread. If the helper died, the crash handler
+// prints the backtrace itself and calling this function again starts a new one.
+extern int
+vala_rt_start_crash_helper (void);
+
+// On a fatal signal, print the backtraces of all other threads, too. They are
+// interrupted using SIGRTMIN + 3, which must not be used by the program for
+// anything else. Can be enabled using the environment variable
+// VALA_RT_ALL_THREADS, too. The other threads are part of crash records and of
+// the reports of the crash helper, too.
+extern void
+vala_rt_set_dump_all_threads (int);
+
+// Installs an alternate signal stack for the calling thread, so a stack
+// overflow is reported by the crash handler, too. The stack is returned to a
+// pool once the thread exits. Done by __vala_init for its thread and, if
+// vala-rt was built with -Dinterpose_pthread_create=true, for every thread
+// created using pthread_create. Returns 0 on success.
+extern int
+vala_rt_enable_signal_stack (void);
+
+enum vala_rt_unwinder
+{
+  // DWARF based, works for all code
+  VALA_RT_UNWINDER_LIBUNWIND,
+  // Walks the frame pointers, falling back to libunwind if they look invalid
+  VALA_RT_UNWINDER_FRAME_POINTER,
+};
+
+// Selects the unwinder used by the crash handler, the thread dumps, the profiler
+// and vala_rt_backtrace_capture. Can be selected using the environment variable
+// VALA_RT_UNWINDER=fp, too.
+extern void
+vala_rt_set_unwinder (enum vala_rt_unwinder);
+
+// Records the return addresses of the calling thread into buffer, without
+// symbolizing them. Cheap enough to be used on hot paths. Returns the number
+// of frames, at most size. libunwind needs one slot for the frame of this
+// function, so with it, a stack that doesn't fit is cut at size - 1 frames.
+extern int
+vala_rt_backtrace_capture (void **, int);
+
+// Symbolizes frames recorded using vala_rt_backtrace_capture, using the same
+// Vala name lookup as the crash handler, but not its session, so a crash while
+// symbolizing is still reported with all loaded modules. Resolved addresses are
+// cached, so symbolizing the same frames again is cheap. Thread-safe.
+extern void
+vala_rt_backtrace_symbolize (void *const *, int, struct vala_rt_frame *);
+
+// Writes the Vala name of the C function c_name to out, truncated to len - 1
+// bytes and NUL-terminated. Returns the length of the full name like snprintf,
+// or -1 if no Vala name is known. The names are indexed once per loaded module
+// and lookups take no locks, so it is meant to be called at high rates from any
+// number of threads, e.g. for logging. Modules loaded later are picked up, too.
+// Nothing is freed when a module is unloaded using dlclose: its names, the copy
+// of its .debug_info_vala section and every older snapshot of the index stay
+// allocated until the process exits.
+extern int
+vala_rt_demangle (const char *, char *, size_t);
+
+// Like vala_rt_demangle, for the function containing the address. Functions
+// only known by their C name are found using an address index, or, without
+// one, if they are exported.
+extern int
+vala_rt_demangle_address (const void *, char *, size_t);
+
+// Samples the stacks of all threads using SIGPROF at the given frequency in Hz
+// (0 for the default of 99) until vala_rt_profiler_stop is called. The samples
+// are written to path as folded stacks using the Vala names, ready to be
+// turned into a flamegraph. Done by __vala_init if the environment variable
+// VALA_RT_PROFILE is set to the path, using VALA_RT_PROFILE_FREQUENCY as
+// frequency, stopping at exit. Both return 0 on success.
+extern int
+vala_rt_profiler_start (const char *, int);
+extern int
+vala_rt_profiler_stop (void);
@@ -0,0 +1,183 @@
+/* section-layouts.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vdbg-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Builds a version 1 and a version 2 .debug_info_vala section from the same
+ * names and checks that both return the same Vala name for every lookup.
+ */
+
+static const char *names[][2] = {
+  { "main_window_on_clicked", "Main.Window.on_clicked" },
+  { "foo_bar_new", "Foo.Bar.Bar" },
+  { "_vala_main", "main" },
+  { "a", "A.a" },
+  { "foo_bar_construct", "Foo.Bar.construct" },
+  { "foo_bar_get_type", "Foo.Bar.get_type" },
+  { "z_last", "Z.last" },
+  { "foo_bar_new", "Shadowed.by.the.first.entry" },
+};
+
+static const char *misses[] = { "", "foo", "foo_bar", "foo_bar_new_", "zz", "_vala_main2", "foo.constprop.0", ".isra" };
+
+// Clones emitted by GCC, found using the name they were cloned from
+static const char *suffixes[] = { ".constprop.0", ".isra.0", ".part.0.lto_priv.0", ".cold" };
+
+// Padding followed by the records, like the compiler emits them.
+static uint8_t *
+build_linear (size_t *size)
+{
+  size_t n_names = sizeof (names) / sizeof (names[0]);
+  size_t total = 7 + strlen (SECTION_MAGIC_LINEAR) + 2 * sizeof (uint64_t);
+  for (size_t i = 0; i < n_names; i++)
+    {
+      total += strlen (names[i][0]) + strlen (names[i][1]) + 6;
+    }
+  uint8_t *data = calloc (1, total);
+  if (!data)
+    {
+      return NULL;
+    }
+  size_t offset = 7;
+  memcpy (&data[offset], SECTION_MAGIC_LINEAR, strlen (SECTION_MAGIC_LINEAR));
+  offset += strlen (SECTION_MAGIC_LINEAR);
+  uint64_t version = 1;
+  memcpy (&data[offset], &version, sizeof (version));
+  offset += sizeof (version);
+  uint64_t n_mappings = __builtin_bswap64 (n_names);
+  memcpy (&data[offset], &n_mappings, sizeof (n_mappings));
+  offset += sizeof (n_mappings);
+  for (size_t i = 0; i < n_names; i++)
+    {
+      for (size_t j = 0; j < 2; j++)
+        {
+          size_t len = strlen (names[i][j]);
+          data[offset++] = len;
+          memcpy (&data[offset], names[i][j], len);
+          offset += len + 2;
+        }
+    }
+  *size = total;
+  return data;
+}
+
+struct foreach_data
+{
+  const uint8_t *other;
+  size_t         other_size;
+  size_t         n_pairs;
+  int            failed;
+};
+
+// Every pair enumerated from one layout has to be found in the other one.
+static void
+check_pair (const char *c_name, const char *vala_name, void *user_data)
+{
+  struct foreach_data *data = user_data;
+  const char          *r = __vala_rt_find_function_internal_section (c_name, data->other, data->other_size);
+  data->n_pairs++;
+  // The first entry for a C name wins, so only those of v1 are found in v2
+  if (strcmp (vala_name, "Shadowed.by.the.first.entry") && (!r || strcmp (r, vala_name)))
+    {
+      fprintf (stderr, "%s: Enumerated %s, found %s\n", c_name, vala_name, r ? r : "NULL");
+      data->failed = 1;
+    }
+}
+
+static int
+check (const char *function, const uint8_t *v1, size_t v1_size, const uint8_t *v2, size_t v2_size)
+{
+  const char *r1 = __vala_rt_find_function_internal_section (function, v1, v1_size);
+  const char *r2 = __vala_rt_find_function_internal_section (function, v2, v2_size);
+  if ((r1 == NULL) != (r2 == NULL) || (r1 && strcmp (r1, r2)))
+    {
+      fprintf (stderr, "%s: v1 returned %s, v2 returned %s\n", function, r1 ? r1 : "NULL", r2 ? r2 : "NULL");
+      return 1;
+    }
+  return 0;
+}
+
+int
+main (void)
+{
+  struct vdbg_entries entries = { 0 };
+  size_t              n_names = sizeof (names) / sizeof (names[0]);
+  for (size_t i = 0; i < n_names; i++)
+    {
+      if (vdbg_entries_add (&entries, names[i][0], names[i][1]))
+        {
+          return 1;
+        }
+    }
+  vdbg_entries_sort (&entries);
+  size_t   v1_size = 0, v2_size = 0;
+  uint8_t *v1 = build_linear (&v1_size);
+  uint8_t *v2 = vdbg_build_section (&entries, &v2_size);
+  if (!v1 || !v2)
+    {
+      return 1;
+    }
+  int failed = 0;
+  for (size_t i = 0; i < n_names; i++)
+    {
+      if (!__vala_rt_find_function_internal_section (names[i][0], v2, v2_size))
+        {
+          fprintf (stderr, "%s: Not found\n", names[i][0]);
+          failed = 1;
+        }
+      failed |= check (names[i][0], v1, v1_size, v2, v2_size);
+      for (size_t j = 0; j < sizeof (suffixes) / sizeof (suffixes[0]); j++)
+        {
+          char clone[128];
+          snprintf (clone, sizeof (clone), "%s%s", names[i][0], suffixes[j]);
+          if (!__vala_rt_find_function_internal_section (clone, v1, v1_size))
+            {
+              fprintf (stderr, "%s: Not found\n", clone);
+              failed = 1;
+            }
+          failed |= check (clone, v1, v1_size, v2, v2_size);
+        }
+    }
+  for (size_t i = 0; i < sizeof (misses) / sizeof (misses[0]); i++)
+    {
+      failed |= check (misses[i], v1, v1_size, v2, v2_size);
+    }
+  struct foreach_data data = { v2, v2_size, 0, 0 };
+  __vala_rt_section_foreach (v1, v1_size, check_pair, &data);
+  failed |= data.failed || data.n_pairs != n_names;
+  data = (struct foreach_data){ v1, v1_size, 0, 0 };
+  __vala_rt_section_foreach (v2, v2_size, check_pair, &data);
+  failed |= data.failed || data.n_pairs != entries.n_entries;
+  free (v1);
+  free (v2);
+  vdbg_entries_free (&entries);
+  // An empty section is valid and finds nothing
+  v2 = vdbg_build_section (&entries, &v2_size);
+  if (!v2 || __vala_rt_find_function_internal_section ("a", v2, v2_size))
+    {
+      failed = 1;
+    }
+  free (v2);
+  return failed;
+}
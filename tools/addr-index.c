@@ -0,0 +1,605 @@
+/* addr-index.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vala-rt-internal.h"
+#include "vdbg-common.h"
+#include <dwarf.h>
+#include <elfutils/libdw.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Builds the address index of an ELF file from its DWARF. Every function with
+ * a Vala name, taken from the .vdbg files given or the .debug_info_vala section
+ * of the ELF, gets its address ranges and line table in the index. The result
+ * can be embedded using
+ *   objcopy --add-section .vala_addr_index=<output> <elf>
+ * or installed as .build-id/xx/yyyy.vaddr next to the .vdbg files. The ELF must
+ * not be stripped yet.
+ */
+
+// Normally emitted by valac, unused here.
+const char  *__vala_debug_prefix = NULL;
+const char **__vala_extra_debug_directories = NULL;
+
+struct line
+{
+  uint64_t    addr;
+  size_t      position;
+  const char *filename;
+  int         lineno;
+};
+
+struct range
+{
+  uint64_t start;
+  uint32_t size;
+  uint32_t symbol;
+  uint32_t function;
+  uint32_t first_line;
+  uint32_t n_lines;
+};
+
+// Deduplicated NUL-terminated strings, hashed by their contents.
+struct strings
+{
+  char     *data;
+  size_t    size;
+  size_t    capacity;
+  uint32_t *slots;
+  size_t    n_slots;
+  size_t    used;
+};
+
+struct index
+{
+  struct range             *ranges;
+  size_t                    n_ranges;
+  size_t                    ranges_capacity;
+  struct vala_rt_addr_line *lines;
+  size_t                    n_lines;
+  size_t                    lines_capacity;
+  struct strings            strings;
+};
+
+struct names
+{
+  struct vdbg_entries entries;
+  const void         *section;
+  size_t              section_size;
+};
+
+static int
+grow (void **ptr, size_t *capacity, size_t needed, size_t element_size)
+{
+  if (needed <= *capacity)
+    {
+      return 0;
+    }
+  size_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < needed)
+    {
+      new_capacity *= 2;
+    }
+  void *resized = realloc (*ptr, new_capacity * element_size);
+  if (!resized)
+    {
+      return -1;
+    }
+  *ptr = resized;
+  *capacity = new_capacity;
+  return 0;
+}
+
+static int
+strings_rehash (struct strings *strings)
+{
+  size_t    n_slots = strings->n_slots ? strings->n_slots * 2 : 1024;
+  uint32_t *slots = malloc (n_slots * sizeof (uint32_t));
+  if (!slots)
+    {
+      return -1;
+    }
+  memset (slots, 0xff, n_slots * sizeof (uint32_t));
+  for (size_t i = 0; i < strings->n_slots; i++)
+    {
+      uint32_t offset = strings->slots[i];
+      if (offset == UINT32_MAX)
+        {
+          continue;
+        }
+      const char *str = &strings->data[offset];
+      size_t      j = __vala_rt_hash_name (str, strlen (str)) & (n_slots - 1);
+      while (slots[j] != UINT32_MAX)
+        {
+          j = (j + 1) & (n_slots - 1);
+        }
+      slots[j] = offset;
+    }
+  free (strings->slots);
+  strings->slots = slots;
+  strings->n_slots = n_slots;
+  return 0;
+}
+
+// Returns the offset of str in the blob, UINT32_MAX on failure.
+static uint32_t
+strings_add (struct strings *strings, const char *str)
+{
+  if ((strings->used + 1) * 2 > strings->n_slots && strings_rehash (strings))
+    {
+      return UINT32_MAX;
+    }
+  size_t len = strlen (str);
+  size_t i = __vala_rt_hash_name (str, len) & (strings->n_slots - 1);
+  while (strings->slots[i] != UINT32_MAX)
+    {
+      if (!strcmp (&strings->data[strings->slots[i]], str))
+        {
+          return strings->slots[i];
+        }
+      i = (i + 1) & (strings->n_slots - 1);
+    }
+  if (strings->size + len + 1 >= UINT32_MAX
+      || grow ((void **)&strings->data, &strings->capacity, strings->size + len + 1, 1))
+    {
+      return UINT32_MAX;
+    }
+  uint32_t offset = strings->size;
+  memcpy (&strings->data[offset], str, len + 1);
+  strings->size += len + 1;
+  strings->slots[i] = offset;
+  strings->used++;
+  return offset;
+}
+
+static int
+compare_vdbg_entry (const void *key, const void *entry)
+{
+  return strcmp (key, ((const struct vdbg_entry *)entry)->c_name);
+}
+
+// Looks up the Vala name like the runtime does, a .vdbg wins over the section.
+static const char *
+names_find (const struct names *names, const char *c_name)
+{
+  const struct vdbg_entry *entry = bsearch (
+      c_name, names->entries.entries, names->entries.n_entries, sizeof (struct vdbg_entry), compare_vdbg_entry);
+  if (entry)
+    {
+      return entry->vala_name;
+    }
+  if (names->section)
+    {
+      return __vala_rt_find_function_internal_section (c_name, names->section, names->section_size);
+    }
+  return NULL;
+}
+
+// Finds .debug_info_vala or .zdebug_info_vala, decompressing it if needed.
+static void
+names_find_section (struct names *names, Elf *elf)
+{
+  size_t shstrndx;
+  if (elf_getshdrstrndx (elf, &shstrndx))
+    {
+      return;
+    }
+  Elf_Scn *scn = NULL;
+  while ((scn = elf_nextscn (elf, scn)))
+    {
+      GElf_Shdr shdr;
+      if (!gelf_getshdr (scn, &shdr))
+        {
+          continue;
+        }
+      const char *name = elf_strptr (elf, shstrndx, shdr.sh_name);
+      if (!name)
+        {
+          continue;
+        }
+      if (!strcmp (name, ".debug_info_vala"))
+        {
+          if ((shdr.sh_flags & SHF_COMPRESSED) && elf_compress (scn, 0, 0) < 0)
+            {
+              continue;
+            }
+        }
+      else if (!strcmp (name, ".zdebug_info_vala"))
+        {
+          if (elf_compress_gnu (scn, 0, 0) < 0)
+            {
+              continue;
+            }
+        }
+      else
+        {
+          continue;
+        }
+      Elf_Data *data = elf_getdata (scn, NULL);
+      if (data && data->d_size)
+        {
+          names->section = data->d_buf;
+          names->section_size = data->d_size;
+          return;
+        }
+    }
+}
+
+static int
+compare_lines (const void *a, const void *b)
+{
+  const struct line *l1 = a;
+  const struct line *l2 = b;
+  if (l1->addr != l2->addr)
+    {
+      return l1->addr < l2->addr ? -1 : 1;
+    }
+  return l1->position < l2->position ? -1 : l1->position > l2->position;
+}
+
+// Returns the lines of the CU sorted by their address. If several lines start
+// at the same address, only the last one is kept, as libdw would return it.
+static struct line *
+collect_lines (Dwarf_Die *cu, size_t *n)
+{
+  Dwarf_Lines *src_lines;
+  size_t       n_src_lines;
+  *n = 0;
+  if (dwarf_getsrclines (cu, &src_lines, &n_src_lines) || !n_src_lines)
+    {
+      return NULL;
+    }
+  struct line *lines = calloc (n_src_lines, sizeof (struct line));
+  if (!lines)
+    {
+      return NULL;
+    }
+  size_t count = 0;
+  for (size_t i = 0; i < n_src_lines; i++)
+    {
+      Dwarf_Line *src_line = dwarf_onesrcline (src_lines, i);
+      bool        end_sequence = false;
+      Dwarf_Addr  addr;
+      if (!src_line || dwarf_lineaddr (src_line, &addr) || dwarf_lineendsequence (src_line, &end_sequence)
+          || end_sequence)
+        {
+          continue;
+        }
+      lines[count].addr = addr;
+      lines[count].position = i;
+      lines[count].filename = dwarf_linesrc (src_line, NULL, NULL);
+      if (!lines[count].filename || dwarf_lineno (src_line, &lines[count].lineno))
+        {
+          continue;
+        }
+      count++;
+    }
+  qsort (lines, count, sizeof (struct line), compare_lines);
+  size_t unique = 0;
+  for (size_t i = 0; i < count; i++)
+    {
+      if (unique && lines[unique - 1].addr == lines[i].addr)
+        {
+          unique--;
+        }
+      lines[unique++] = lines[i];
+    }
+  *n = unique;
+  return lines;
+}
+
+static int
+index_add_line (struct index *index, uint32_t offset, const char *filename, int lineno)
+{
+  uint32_t filename_offset = strings_add (&index->strings, filename);
+  if (filename_offset == UINT32_MAX
+      || grow ((void **)&index->lines, &index->lines_capacity, index->n_lines + 1, sizeof (struct vala_rt_addr_line)))
+    {
+      return -1;
+    }
+  struct vala_rt_addr_line *line = &index->lines[index->n_lines++];
+  line->offset = offset;
+  line->filename = filename_offset;
+  line->lineno = lineno;
+  return 0;
+}
+
+// Adds [start, end) with all lines within it. An address before the first line
+// of the range belongs to the line before, like for libdw.
+static int
+index_add_range (struct index      *index,
+                 uint64_t           start,
+                 uint64_t           end,
+                 const char        *symbol,
+                 const char        *function,
+                 const struct line *lines,
+                 size_t             n_lines)
+{
+  if (end <= start || end - start > UINT32_MAX)
+    {
+      return 0;
+    }
+  if (grow ((void **)&index->ranges, &index->ranges_capacity, index->n_ranges + 1, sizeof (struct range)))
+    {
+      return -1;
+    }
+  struct range *range = &index->ranges[index->n_ranges];
+  range->start = start;
+  range->size = end - start;
+  range->symbol = strings_add (&index->strings, symbol);
+  range->function = strings_add (&index->strings, function);
+  range->first_line = index->n_lines;
+  if (range->symbol == UINT32_MAX || range->function == UINT32_MAX)
+    {
+      return -1;
+    }
+  size_t lo = 0;
+  size_t hi = n_lines;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (lines[mid].addr <= start)
+        {
+          lo = mid + 1;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+  for (size_t i = lo ? lo - 1 : 0; i < n_lines && lines[i].addr < end; i++)
+    {
+      uint32_t offset = lines[i].addr > start ? lines[i].addr - start : 0;
+      // Consecutive lines with the same location are merged.
+      if (index->n_lines > range->first_line)
+        {
+          const struct vala_rt_addr_line *last = &index->lines[index->n_lines - 1];
+          if (last->lineno == lines[i].lineno && !strcmp (&index->strings.data[last->filename], lines[i].filename))
+            {
+              continue;
+            }
+        }
+      if (index_add_line (index, offset, lines[i].filename, lines[i].lineno))
+        {
+          return -1;
+        }
+    }
+  range->n_lines = index->n_lines - range->first_line;
+  index->n_ranges++;
+  return 0;
+}
+
+static int
+index_add_cu (struct index *index, const struct names *names, Dwarf_Die *cu)
+{
+  size_t       n_lines;
+  struct line *lines = collect_lines (cu, &n_lines);
+  Dwarf_Die    die;
+  int          ret = 0;
+  if (dwarf_child (cu, &die))
+    {
+      free (lines);
+      return 0;
+    }
+  do
+    {
+      if (dwarf_tag (&die) != DW_TAG_subprogram)
+        {
+          continue;
+        }
+      // Follows DW_AT_abstract_origin, so clones like foo.isra.0 are found, too.
+      Dwarf_Attribute attr;
+      const char     *symbol = dwarf_formstring (dwarf_attr_integrate (&die, DW_AT_name, &attr));
+      const char     *function = symbol ? names_find (names, symbol) : NULL;
+      if (!function)
+        {
+          continue;
+        }
+      Dwarf_Addr base;
+      Dwarf_Addr start;
+      Dwarf_Addr end;
+      ptrdiff_t  offset = 0;
+      while (!ret && (offset = dwarf_ranges (&die, offset, &base, &start, &end)) > 0)
+        {
+          ret = index_add_range (index, start, end, symbol, function, lines, n_lines);
+        }
+    }
+  while (!ret && dwarf_siblingof (&die, &die) == 0);
+  free (lines);
+  return ret;
+}
+
+static int
+compare_ranges (const void *a, const void *b)
+{
+  const struct range *r1 = a;
+  const struct range *r2 = b;
+  return r1->start < r2->start ? -1 : r1->start > r2->start;
+}
+
+// Sorts the ranges and drops every range overlapping the one before.
+static void
+index_finish (struct index *index)
+{
+  qsort (index->ranges, index->n_ranges, sizeof (struct range), compare_ranges);
+  size_t n = 0;
+  for (size_t i = 0; i < index->n_ranges; i++)
+    {
+      if (n && index->ranges[n - 1].start + index->ranges[n - 1].size > index->ranges[i].start)
+        {
+          continue;
+        }
+      index->ranges[n++] = index->ranges[i];
+    }
+  index->n_ranges = n;
+}
+
+static int
+index_write (const struct index *index, const char *path)
+{
+  size_t ranges_offset = sizeof (struct vala_rt_addr_index_header);
+  size_t lines_offset = ranges_offset + index->n_ranges * sizeof (struct vala_rt_addr_range);
+  size_t strings_offset = lines_offset + index->n_lines * sizeof (struct vala_rt_addr_line);
+  size_t total = strings_offset + index->strings.size;
+  if (total > UINT32_MAX || !index->strings.size)
+    {
+      return -1;
+    }
+  uint8_t *data = calloc (1, total);
+  if (!data)
+    {
+      return -1;
+    }
+  struct vala_rt_addr_index_header header = { 0 };
+  memcpy (header.magic, ADDR_INDEX_MAGIC, sizeof (header.magic));
+  header.version = ADDR_INDEX_VERSION;
+  header.n_ranges = htobe32 (index->n_ranges);
+  header.ranges_offset = htobe32 (ranges_offset);
+  header.n_lines = htobe32 (index->n_lines);
+  header.lines_offset = htobe32 (lines_offset);
+  header.strings_offset = htobe32 (strings_offset);
+  header.strings_size = htobe32 (index->strings.size);
+  memcpy (data, &header, sizeof (header));
+  for (size_t i = 0; i < index->n_ranges; i++)
+    {
+      struct vala_rt_addr_range range = { 0 };
+      range.start = htobe64 (index->ranges[i].start);
+      range.size = htobe32 (index->ranges[i].size);
+      range.symbol = htobe32 (index->ranges[i].symbol);
+      range.function = htobe32 (index->ranges[i].function);
+      range.first_line = htobe32 (index->ranges[i].first_line);
+      range.n_lines = htobe32 (index->ranges[i].n_lines);
+      memcpy (&data[ranges_offset + i * sizeof (range)], &range, sizeof (range));
+    }
+  for (size_t i = 0; i < index->n_lines; i++)
+    {
+      struct vala_rt_addr_line line;
+      line.offset = htobe32 (index->lines[i].offset);
+      line.filename = htobe32 (index->lines[i].filename);
+      line.lineno = (int32_t)htobe32 ((uint32_t)index->lines[i].lineno);
+      memcpy (&data[lines_offset + i * sizeof (line)], &line, sizeof (line));
+    }
+  memcpy (&data[strings_offset], index->strings.data, index->strings.size);
+  int   ret = -1;
+  FILE *fp = fopen (path, "wb");
+  if (fp)
+    {
+      ret = fwrite (data, 1, total, fp) == total ? 0 : -1;
+      if (fclose (fp))
+        {
+          ret = -1;
+        }
+    }
+  free (data);
+  return ret;
+}
+
+static void
+index_free (struct index *index)
+{
+  free (index->ranges);
+  free (index->lines);
+  free (index->strings.data);
+  free (index->strings.slots);
+  memset (index, 0, sizeof (*index));
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 3)
+    {
+      fprintf (stderr, "Usage: %s <elf> <output.vaddr> [names.vdbg...]\n", argv[0]);
+      return 1;
+    }
+  struct names names = { 0 };
+  for (int i = 3; i < argc; i++)
+    {
+      if (vdbg_read_file (argv[i], &names.entries))
+        {
+          fprintf (stderr, "%s: Unable to read %s\n", argv[0], argv[i]);
+          vdbg_entries_free (&names.entries);
+          return 1;
+        }
+    }
+  vdbg_entries_sort (&names.entries);
+  elf_version (EV_CURRENT);
+  int    fd = open (argv[1], O_RDONLY);
+  Elf   *elf = fd >= 0 ? elf_begin (fd, ELF_C_READ, NULL) : NULL;
+  Dwarf *dwarf = elf ? dwarf_begin_elf (elf, DWARF_C_READ, NULL) : NULL;
+  if (!dwarf)
+    {
+      fprintf (stderr, "%s: Unable to read the DWARF of %s\n", argv[0], argv[1]);
+      goto fail;
+    }
+  names_find_section (&names, elf);
+  // The blob may not be empty, even if there are no Vala functions.
+  struct index index = { 0 };
+  if (strings_add (&index.strings, "") == UINT32_MAX)
+    {
+      fprintf (stderr, "%s: Out of memory\n", argv[0]);
+      goto fail;
+    }
+  Dwarf_Off offset = 0;
+  Dwarf_Off next_offset;
+  size_t    header_size;
+  while (dwarf_nextcu (dwarf, offset, &next_offset, &header_size, NULL, NULL, NULL) == 0)
+    {
+      Dwarf_Die cu;
+      if (dwarf_offdie (dwarf, offset + header_size, &cu) && index_add_cu (&index, &names, &cu))
+        {
+          fprintf (stderr, "%s: Out of memory\n", argv[0]);
+          index_free (&index);
+          goto fail;
+        }
+      offset = next_offset;
+    }
+  index_finish (&index);
+  if (index_write (&index, argv[2]))
+    {
+      fprintf (stderr, "%s: Unable to write %s\n", argv[0], argv[2]);
+      index_free (&index);
+      goto fail;
+    }
+  index_free (&index);
+  dwarf_end (dwarf);
+  elf_end (elf);
+  close (fd);
+  vdbg_entries_free (&names.entries);
+  return 0;
+fail:
+  if (dwarf)
+    {
+      dwarf_end (dwarf);
+    }
+  if (elf)
+    {
+      elf_end (elf);
+    }
+  if (fd >= 0)
+    {
+      close (fd);
+    }
+  vdbg_entries_free (&names.entries);
+  return 1;
+}
@@ -0,0 +1,63 @@
+/* symbolize.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-internal.h"
+#include "vala-rt.h"
+#include <stdio.h>
+
+// Normally emitted by valac, here they are taken from the crash record.
+const char  *__vala_debug_prefix = NULL;
+const char **__vala_extra_debug_directories = NULL;
+
+// Prints the backtrace of a crash record written by a process that crashed
+// with VALA_RT_CRASH_RECORD_DIR set, just like the crash handler would have,
+// in the format and to the file selected by VALA_RT_REPORT_FORMAT and
+// VALA_RT_REPORT_FILE.
+int
+main (int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      fprintf (stderr, "Usage: %s <record.crash>\n", argv[0]);
+      return 1;
+    }
+  __vala_rt_report_settings_from_env ();
+  struct vala_rt_crash_record record;
+  if (__vala_rt_load_crash_record (argv[1], &record))
+    {
+      fprintf (stderr, "%s: Unable to read crash record %s\n", argv[0], argv[1]);
+      return 1;
+    }
+  __vala_debug_prefix = record.debug_prefix;
+  __vala_extra_debug_directories = record.extra_debug_directories;
+  if (!__vala_rt_session_begin_offline (&__vala_rt_crash_session, &record))
+    {
+      fprintf (stderr, "%s: Unable to load the modules of %s\n", argv[0], argv[1]);
+      __vala_rt_free_crash_record (&record);
+      return 1;
+    }
+  __vala_rt_report_begin (record.signum, record.pid);
+  __vala_rt_print_folded_backtrace (record.stack);
+  for (uint32_t i = 0; i < record.n_threads; i++)
+    {
+      __vala_rt_print_thread_stack (&record.threads[i]);
+    }
+  __vala_rt_session_end (&__vala_rt_crash_session);
+  __vala_rt_free_crash_record (&record);
+  return 0;
+}
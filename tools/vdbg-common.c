@@ -0,0 +1,347 @@
+/* vdbg-common.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vdbg-common.h"
+#include "vala-rt-format.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct sort_entry
+{
+  struct vdbg_entry entry;
+  size_t            position;
+};
+
+int
+vdbg_entries_add (struct vdbg_entries *entries, const char *c_name, const char *vala_name)
+{
+  if (entries->n_entries == entries->capacity)
+    {
+      size_t             capacity = entries->capacity ? entries->capacity * 2 : 64;
+      struct vdbg_entry *resized = realloc (entries->entries, capacity * sizeof (struct vdbg_entry));
+      if (!resized)
+        {
+          return -1;
+        }
+      entries->entries = resized;
+      entries->capacity = capacity;
+    }
+  struct vdbg_entry *entry = &entries->entries[entries->n_entries];
+  entry->c_name = strdup (c_name);
+  entry->vala_name = strdup (vala_name);
+  if (!entry->c_name || !entry->vala_name)
+    {
+      free (entry->c_name);
+      free (entry->vala_name);
+      return -1;
+    }
+  entries->n_entries++;
+  return 0;
+}
+
+void
+vdbg_entries_free (struct vdbg_entries *entries)
+{
+  for (size_t i = 0; i < entries->n_entries; i++)
+    {
+      free (entries->entries[i].c_name);
+      free (entries->entries[i].vala_name);
+    }
+  free (entries->entries);
+  memset (entries, 0, sizeof (*entries));
+}
+
+static int
+compare_entries (const void *a, const void *b)
+{
+  const struct sort_entry *e1 = a;
+  const struct sort_entry *e2 = b;
+  int                      ret = strcmp (e1->entry.c_name, e2->entry.c_name);
+  if (ret)
+    {
+      return ret;
+    }
+  return e1->position < e2->position ? -1 : e1->position > e2->position;
+}
+
+void
+vdbg_entries_sort (struct vdbg_entries *entries)
+{
+  if (!entries->n_entries)
+    {
+      return;
+    }
+  struct sort_entry *tmp = calloc (entries->n_entries, sizeof (struct sort_entry));
+  if (!tmp)
+    {
+      abort ();
+    }
+  for (size_t i = 0; i < entries->n_entries; i++)
+    {
+      tmp[i].entry = entries->entries[i];
+      tmp[i].position = i;
+    }
+  qsort (tmp, entries->n_entries, sizeof (struct sort_entry), compare_entries);
+  size_t n = 0;
+  for (size_t i = 0; i < entries->n_entries; i++)
+    {
+      if (n && !strcmp (entries->entries[n - 1].c_name, tmp[i].entry.c_name))
+        {
+          free (tmp[i].entry.c_name);
+          free (tmp[i].entry.vala_name);
+          continue;
+        }
+      entries->entries[n++] = tmp[i].entry;
+    }
+  entries->n_entries = n;
+  free (tmp);
+}
+
+static int
+read_linear (const uint8_t *data, size_t size, struct vdbg_entries *entries)
+{
+  size_t offset = strlen (VDBG_MAGIC) + 1;
+  if (size < offset + sizeof (uint32_t))
+    {
+      return -1;
+    }
+  uint32_t n_functions = __vala_rt_read_be32 (&data[offset]);
+  offset += sizeof (uint32_t);
+  for (uint32_t i = 0; i < n_functions; i++)
+    {
+      const char *names[2];
+      for (int j = 0; j < 2; j++)
+        {
+          if (size - offset < sizeof (uint16_t))
+            {
+              return -1;
+            }
+          uint16_t len = __vala_rt_read_be16 (&data[offset]);
+          offset += sizeof (uint16_t);
+          if (size - offset < (size_t)len + 1 || data[offset + len])
+            {
+              return -1;
+            }
+          names[j] = (const char *)&data[offset];
+          offset += len + 1;
+        }
+      if (vdbg_entries_add (entries, names[0], names[1]))
+        {
+          return -1;
+        }
+    }
+  return 0;
+}
+
+static int
+read_indexed (const uint8_t *data, size_t size, struct vdbg_entries *entries)
+{
+  if (size < sizeof (struct vala_rt_vdbg2_header))
+    {
+      return -1;
+    }
+  const struct vala_rt_vdbg2_header *header = (const struct vala_rt_vdbg2_header *)data;
+  uint32_t                           n_entries = __vala_rt_read_be32 (&header->n_entries);
+  uint32_t                           index_offset = __vala_rt_read_be32 (&header->index_offset);
+  uint32_t                           strings_offset = __vala_rt_read_be32 (&header->strings_offset);
+  uint32_t                           strings_size = __vala_rt_read_be32 (&header->strings_size);
+  if (index_offset > size || (size - index_offset) / sizeof (struct vala_rt_name_index_entry) < n_entries
+      || strings_offset > size || size - strings_offset < strings_size || !strings_size
+      || data[strings_offset + strings_size - 1])
+    {
+      return -1;
+    }
+  const char *strings = (const char *)&data[strings_offset];
+  for (uint32_t i = 0; i < n_entries; i++)
+    {
+      const uint8_t *entry = &data[index_offset + i * sizeof (struct vala_rt_name_index_entry)];
+      uint32_t       c_name = __vala_rt_read_be32 (entry);
+      uint32_t       vala_name = __vala_rt_read_be32 (entry + sizeof (uint32_t));
+      if (c_name >= strings_size || vala_name >= strings_size)
+        {
+          return -1;
+        }
+      if (vdbg_entries_add (entries, &strings[c_name], &strings[vala_name]))
+        {
+          return -1;
+        }
+    }
+  return 0;
+}
+
+int
+vdbg_read_file (const char *path, struct vdbg_entries *entries)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  struct stat st;
+  if (fstat (fd, &st) || st.st_size <= (off_t)strlen (VDBG_MAGIC))
+    {
+      close (fd);
+      return -1;
+    }
+  uint8_t *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      return -1;
+    }
+  int ret = -1;
+  if (!memcmp (data, VDBG_MAGIC, strlen (VDBG_MAGIC)))
+    {
+      switch (data[strlen (VDBG_MAGIC)])
+        {
+        case VDBG_VERSION_LINEAR:
+          ret = read_linear (data, st.st_size, entries);
+          break;
+        case VDBG_VERSION_INDEXED:
+          ret = read_indexed (data, st.st_size, entries);
+          break;
+        default:
+          break;
+        }
+    }
+  munmap (data, st.st_size);
+  return ret;
+}
+
+// Lays out the index and the string blob after a header of header_size bytes.
+// The caller fills in the header from the returned offsets.
+static uint8_t *
+build_indexed (const struct vdbg_entries *entries,
+               size_t                     header_size,
+               size_t                    *total,
+               size_t                    *strings_offset,
+               size_t                    *strings_size)
+{
+  *strings_size = 0;
+  for (size_t i = 0; i < entries->n_entries; i++)
+    {
+      *strings_size += strlen (entries->entries[i].c_name) + 1;
+      *strings_size += strlen (entries->entries[i].vala_name) + 1;
+    }
+  // An empty file still needs a NUL-terminated string blob
+  *strings_size = *strings_size ? *strings_size : 1;
+  *strings_offset = header_size + entries->n_entries * sizeof (struct vala_rt_name_index_entry);
+  *total = *strings_offset + *strings_size;
+  if (*total > UINT32_MAX)
+    {
+      return NULL;
+    }
+  uint8_t *data = calloc (1, *total);
+  if (!data)
+    {
+      return NULL;
+    }
+  size_t offset = 0;
+  for (size_t i = 0; i < entries->n_entries; i++)
+    {
+      struct vala_rt_name_index_entry entry;
+      size_t                          len = strlen (entries->entries[i].c_name) + 1;
+      entry.c_name = htobe32 (offset);
+      memcpy (&data[*strings_offset + offset], entries->entries[i].c_name, len);
+      offset += len;
+      len = strlen (entries->entries[i].vala_name) + 1;
+      entry.vala_name = htobe32 (offset);
+      memcpy (&data[*strings_offset + offset], entries->entries[i].vala_name, len);
+      offset += len;
+      memcpy (&data[header_size + i * sizeof (entry)], &entry, sizeof (entry));
+    }
+  return data;
+}
+
+static int
+write_data (const char *path, const uint8_t *data, size_t size)
+{
+  int   ret = -1;
+  FILE *fp = fopen (path, "wb");
+  if (fp)
+    {
+      ret = fwrite (data, 1, size, fp) == size ? 0 : -1;
+      if (fclose (fp))
+        {
+          ret = -1;
+        }
+    }
+  return ret;
+}
+
+int
+vdbg_write_indexed (const char *path, const struct vdbg_entries *entries)
+{
+  size_t   total, strings_offset, strings_size;
+  uint8_t *data = build_indexed (
+      entries, sizeof (struct vala_rt_vdbg2_header), &total, &strings_offset, &strings_size);
+  if (!data)
+    {
+      return -1;
+    }
+  struct vala_rt_vdbg2_header header = { 0 };
+  memcpy (header.magic, VDBG_MAGIC, sizeof (header.magic));
+  header.version = VDBG_VERSION_INDEXED;
+  header.n_entries = htobe32 (entries->n_entries);
+  header.index_offset = htobe32 (sizeof (header));
+  header.strings_offset = htobe32 (strings_offset);
+  header.strings_size = htobe32 (strings_size);
+  memcpy (data, &header, sizeof (header));
+  int ret = write_data (path, data, total);
+  free (data);
+  return ret;
+}
+
+uint8_t *
+vdbg_build_section (const struct vdbg_entries *entries, size_t *size)
+{
+  size_t   strings_offset, strings_size;
+  uint8_t *data = build_indexed (
+      entries, sizeof (struct vala_rt_section2_header), size, &strings_offset, &strings_size);
+  if (!data)
+    {
+      return NULL;
+    }
+  struct vala_rt_section2_header header = { 0 };
+  memcpy (header.magic, SECTION_MAGIC_INDEXED, sizeof (header.magic));
+  header.n_entries = htobe32 (entries->n_entries);
+  header.index_offset = htobe32 (sizeof (header));
+  header.strings_offset = htobe32 (strings_offset);
+  header.strings_size = htobe32 (strings_size);
+  memcpy (data, &header, sizeof (header));
+  return data;
+}
+
+int
+vdbg_write_section (const char *path, const struct vdbg_entries *entries)
+{
+  size_t   size;
+  uint8_t *data = vdbg_build_section (entries, &size);
+  if (!data)
+    {
+      return -1;
+    }
+  int ret = write_data (path, data, size);
+  free (data);
+  return ret;
+}
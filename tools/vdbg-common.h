@@ -0,0 +1,56 @@
+/* vdbg-common.h
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#pragma once
+
+struct vdbg_entry
+{
+  char *c_name;
+  char *vala_name;
+};
+
+struct vdbg_entries
+{
+  struct vdbg_entry *entries;
+  size_t             n_entries;
+  size_t             capacity;
+};
+
+int
+vdbg_entries_add (struct vdbg_entries *, const char *, const char *);
+void
+vdbg_entries_free (struct vdbg_entries *);
+// Sorts the entries by their C name and removes duplicates. Like the linear
+// lookup, the first entry for a C name wins.
+void
+vdbg_entries_sort (struct vdbg_entries *);
+// Appends all entries from a VDBG file (Any version), returns 0 on success.
+int
+vdbg_read_file (const char *, struct vdbg_entries *);
+// Writes the sorted entries as VDBG version 2, returns 0 on success.
+int
+vdbg_write_indexed (const char *, const struct vdbg_entries *);
+// Builds the sorted entries as a version 2 .debug_info_vala section, returns
+// NULL on failure. The size is stored in the second parameter.
+uint8_t *
+vdbg_build_section (const struct vdbg_entries *, size_t *);
+// Writes the sorted entries as a version 2 .debug_info_vala section, that can be
+// added using "objcopy --add-section .debug_info_vala=<file>". Returns 0 on success.
+int
+vdbg_write_section (const char *, const struct vdbg_entries *);
@@ -0,0 +1,51 @@
+/* vdbg-convert.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vdbg-common.h"
+#include <stdio.h>
+#include <string.h>
+
+// Converts a .vdbg file of any version to the indexed version 2. Using
+// --section, the output is a version 2 .debug_info_vala section instead.
+int
+main (int argc, char **argv)
+{
+  int section = argc == 4 && !strcmp (argv[1], "--section");
+  if (argc != 3 && !section)
+    {
+      fprintf (stderr, "Usage: %s [--section] <input.vdbg> <output>\n", argv[0]);
+      return 1;
+    }
+  const char         *input = argv[argc - 2];
+  const char         *output = argv[argc - 1];
+  struct vdbg_entries entries = { 0 };
+  if (vdbg_read_file (input, &entries))
+    {
+      fprintf (stderr, "%s: Unable to read %s\n", argv[0], input);
+      vdbg_entries_free (&entries);
+      return 1;
+    }
+  vdbg_entries_sort (&entries);
+  if (section ? vdbg_write_section (output, &entries) : vdbg_write_indexed (output, &entries))
+    {
+      fprintf (stderr, "%s: Unable to write %s\n", argv[0], output);
+      vdbg_entries_free (&entries);
+      return 1;
+    }
+  vdbg_entries_free (&entries);
+  return 0;
+}
@@ -0,0 +1,220 @@
+/* vdbg-pack.c
+ *
+ * Copyright 2022 JCWasmx86
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "vala-rt-format.h"
+#include "vdbg-common.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Builds DIR/vala-debug.vpack from all .vdbg files in DIR. The pack gets the
+ * modification time of the directory, so the runtime can tell whether any
+ * .vdbg was added or removed afterwards.
+ */
+
+static int
+has_vdbg_extension (const char *name)
+{
+  size_t len = strlen (name);
+  size_t extension_len = strlen (".vdbg");
+  return len >= extension_len && memcmp (&name[len - extension_len], ".vdbg", extension_len) == 0;
+}
+
+// Same order as the runtime scans the directory, so the same file wins
+// for duplicate C names.
+static int
+collect_entries (const char *dir, struct vdbg_entries *entries)
+{
+  DIR *d = opendir (dir);
+  if (!d)
+    {
+      return -1;
+    }
+  struct dirent *entry;
+  while ((entry = readdir (d)))
+    {
+      if (entry->d_type != DT_REG || !has_vdbg_extension (entry->d_name))
+        {
+          continue;
+        }
+      char *path = NULL;
+      if (asprintf (&path, "%s/%s", dir, entry->d_name) < 0)
+        {
+          closedir (d);
+          return -1;
+        }
+      if (vdbg_read_file (path, entries))
+        {
+          fprintf (stderr, "Skipping unreadable %s\n", path);
+        }
+      free (path);
+    }
+  closedir (d);
+  return 0;
+}
+
+static uint8_t *
+build_pack (const struct vdbg_entries *entries, size_t *out_len)
+{
+  uint32_t n_buckets = 16;
+  while (n_buckets < entries->n_entries * 2)
+    {
+      n_buckets *= 2;
+    }
+  size_t strings_size = 0;
+  for (size_t i = 0; i < entries->n_entries; i++)
+    {
+      strings_size += strlen (entries->entries[i].c_name) + strlen (entries->entries[i].vala_name) + 2;
+    }
+  size_t buckets_offset = sizeof (struct vala_rt_vpack_header);
+  size_t strings_offset = buckets_offset + (size_t)n_buckets * sizeof (struct vala_rt_name_index_entry);
+  // An empty pack still needs a NUL-terminated string blob
+  size_t total = strings_offset + (strings_size ? strings_size : 1);
+  if (total > UINT32_MAX)
+    {
+      return NULL;
+    }
+  uint8_t *data = calloc (1, total);
+  if (!data)
+    {
+      return NULL;
+    }
+  memset (&data[buckets_offset], 0xff, strings_offset - buckets_offset);
+  uint32_t n_entries = 0;
+  size_t   offset = 0;
+  for (size_t i = 0; i < entries->n_entries; i++)
+    {
+      const char *c_name = entries->entries[i].c_name;
+      size_t      c_len = strlen (c_name);
+      uint32_t    bucket = __vala_rt_hash_name (c_name, c_len) & (n_buckets - 1);
+      int         duplicate = 0;
+      while (1)
+        {
+          uint8_t *slot = &data[buckets_offset + (size_t)bucket * sizeof (struct vala_rt_name_index_entry)];
+          uint32_t existing = __vala_rt_read_be32 (slot);
+          if (existing == VPACK_EMPTY_BUCKET)
+            {
+              struct vala_rt_name_index_entry entry;
+              entry.c_name = htobe32 (offset);
+              memcpy (&data[strings_offset + offset], c_name, c_len + 1);
+              offset += c_len + 1;
+              size_t vala_len = strlen (entries->entries[i].vala_name);
+              entry.vala_name = htobe32 (offset);
+              memcpy (&data[strings_offset + offset], entries->entries[i].vala_name, vala_len + 1);
+              offset += vala_len + 1;
+              memcpy (slot, &entry, sizeof (entry));
+              break;
+            }
+          if (!strcmp ((const char *)&data[strings_offset + existing], c_name))
+            {
+              duplicate = 1;
+              break;
+            }
+          bucket = (bucket + 1) & (n_buckets - 1);
+        }
+      n_entries += !duplicate;
+    }
+  struct vala_rt_vpack_header header = { 0 };
+  memcpy (header.magic, VPACK_MAGIC, sizeof (header.magic));
+  header.version = VPACK_VERSION;
+  header.n_entries = htobe32 (n_entries);
+  header.n_buckets = htobe32 (n_buckets);
+  header.buckets_offset = htobe32 (buckets_offset);
+  header.strings_offset = htobe32 (strings_offset);
+  header.strings_size = htobe32 (offset ? offset : 1);
+  memcpy (data, &header, sizeof (header));
+  *out_len = strings_offset + (offset ? offset : 1);
+  return data;
+}
+
+static int
+write_pack (const char *dir, const uint8_t *data, size_t len)
+{
+  char *tmp_path = NULL;
+  char *path = NULL;
+  int   ret = -1;
+  if (asprintf (&tmp_path, "%s/.%s.tmp", dir, VPACK_FILENAME) < 0)
+    {
+      return -1;
+    }
+  if (asprintf (&path, "%s/%s", dir, VPACK_FILENAME) < 0)
+    {
+      free (tmp_path);
+      return -1;
+    }
+  FILE *fp = fopen (tmp_path, "wb");
+  if (!fp)
+    {
+      goto end;
+    }
+  size_t written = fwrite (data, 1, len, fp);
+  if (fclose (fp) || written != len || rename (tmp_path, path))
+    {
+      unlink (tmp_path);
+      goto end;
+    }
+  // The rename changed the directory, so take its time afterwards.
+  struct stat dir_st;
+  if (stat (dir, &dir_st))
+    {
+      goto end;
+    }
+  struct timespec times[2] = { dir_st.st_mtim, dir_st.st_mtim };
+  ret = utimensat (AT_FDCWD, path, times, 0);
+end:
+  free (tmp_path);
+  free (path);
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2)
+    {
+      fprintf (stderr, "Usage: %s <directory>...\n", argv[0]);
+      return 1;
+    }
+  int ret = 0;
+  for (int i = 1; i < argc; i++)
+    {
+      struct vdbg_entries entries = { 0 };
+      if (collect_entries (argv[i], &entries))
+        {
+          fprintf (stderr, "%s: Unable to read %s\n", argv[0], argv[i]);
+          vdbg_entries_free (&entries);
+          ret = 1;
+          continue;
+        }
+      size_t   len = 0;
+      uint8_t *data = build_pack (&entries, &len);
+      if (!data || write_pack (argv[i], data, len))
+        {
+          fprintf (stderr, "%s: Unable to write the pack for %s\n", argv[0], argv[i]);
+          ret = 1;
+        }
+      free (data);
+      vdbg_entries_free (&entries);
+    }
+  return ret;
+}